@@ -0,0 +1,243 @@
+#!/usr/bin/env julia
+
+# Measures how long it takes to set up, run and tear down sandboxes with every executor
+# that is available on this machine, and writes the results out as JSON, so that changes
+# to `userns_sandbox.c` or `build_executor_command()` can be checked for regressions.
+#
+# Usage: julia --project=benchmark benchmark/runbenchmarks.jl [results.json]
+#
+# The number of samples taken of every measurement can be set through the environment
+# variable `SANDBOX_BENCHMARK_SAMPLES` (default: 10).
+using Pkg
+Pkg.develop(PackageSpec(path=dirname(@__DIR__)))
+Pkg.instantiate()
+
+using Sandbox, Statistics
+
+const samples = parse(Int, get(ENV, "SANDBOX_BENCHMARK_SAMPLES", "10"))
+const rootfs_dir = Sandbox.alpine_rootfs()
+
+# Runs `f()` `samples` times (after `setup()`, which is not timed) and summarizes how long that took
+function measure(f::Function; setup::Function = () -> nothing, samples::Int = samples)
+    times_ms = Float64[]
+    for _ in 1:samples
+        setup()
+        push!(times_ms, 1000 * @elapsed f())
+    end
+    return Dict(
+        "samples" => samples,
+        "min_ms" => minimum(times_ms),
+        "median_ms" => median(times_ms),
+        "mean_ms" => mean(times_ms),
+        "max_ms" => maximum(times_ms),
+    )
+end
+
+function run_true(exe::SandboxExecutor, config::SandboxConfig)
+    if !success(exe, config, `/bin/true`)
+        error("`/bin/true` failed within $(exe)")
+    end
+end
+
+base_config(; kwargs...) = SandboxConfig(Dict("/" => rootfs_dir); stdout=devnull, stderr=devnull, kwargs...)
+
+# `/bin/true` with a fresh executor every time, and with one that has run before
+function bench_latency(executor)
+    config = base_config()
+    results = Dict{String,Any}()
+    results["cold"] = measure() do
+        with_executor(exe -> run_true(exe, config), executor)
+    end
+    with_executor(executor) do exe
+        run_true(exe, config)
+        results["warm"] = measure(() -> run_true(exe, config))
+    end
+    if executor <: UserNamespacesExecutor && Sandbox.sandbox_supports("--serve")
+        with_executor(executor; zygote=true) do exe
+            run_true(exe, config)
+            results["zygote"] = measure(() -> run_true(exe, config))
+        end
+    end
+    return results
+end
+
+# Setup cost as the number of read-only maps grows
+function bench_maps(executor)
+    results = Dict{String,Any}()
+    mktempdir() do dir
+        for num_maps in (0, 8, 32, 128)
+            maps = Dict("/" => rootfs_dir)
+            for idx in 1:num_maps
+                map_dir = joinpath(dir, "map-$(idx)")
+                mkpath(map_dir)
+                maps["/maps/$(idx)"] = map_dir
+            end
+            config = SandboxConfig(maps; stdout=devnull, stderr=devnull)
+            with_executor(executor) do exe
+                run_true(exe, config)
+                results[string(num_maps)] = measure(() -> run_true(exe, config))
+            end
+        end
+    end
+    return results
+end
+
+# Setup cost as the rootfs grows; the first run includes any per-rootfs work (such as
+# building a docker image), later runs only what every run has to do.
+function bench_rootfs_size(executor)
+    results = Dict{String,Any}()
+    for num_files in (0, 1_000, 10_000)
+        mktempdir() do dir
+            run(`cp -a $(rootfs_dir) $(joinpath(dir, "rootfs"))`)
+            filler_dir = joinpath(dir, "rootfs", "usr", "share", "filler")
+            mkpath(filler_dir)
+            for idx in 1:num_files
+                write(joinpath(filler_dir, "file-$(idx)"), "filler $(idx)\n")
+            end
+            config = SandboxConfig(Dict("/" => joinpath(dir, "rootfs")); stdout=devnull, stderr=devnull)
+            with_executor(executor) do exe
+                first_ms = 1000 * @elapsed run_true(exe, config)
+                results[string(num_files)] = merge(measure(() -> run_true(exe, config)), Dict("first_ms" => first_ms))
+            end
+        end
+    end
+    return results
+end
+
+# How much more a sandbox within a sandbox costs than the outer sandbox alone
+function bench_nesting(executor)
+    # Nesting explicitly does not work with privileged user namespaces, see `test/Nesting.jl`
+    if executor <: PrivilegedUserNamespacesExecutor || !Sandbox.UserNSSandbox_jll.is_available()
+        return nothing
+    end
+    sandbox_path = Sandbox.UserNSSandbox_jll.sandbox_path
+    config = SandboxConfig(
+        Dict("/" => rootfs_dir, "/usr/local/bin/sandbox" => sandbox_path),
+        Dict{String,String}(),
+        Dict("FORCE_SANDBOX_MODE" => "unprivileged");
+        stdout=devnull,
+        stderr=devnull,
+    )
+    nested_cmd = `/usr/local/bin/sandbox --rootfs / -- /bin/true`
+    return with_executor(executor) do exe
+        run_true(exe, config)
+        outer = measure(() -> run_true(exe, config))
+        if !success(exe, config, nested_cmd)
+            @warn("Unable to nest sandboxes within $(exe), skipping")
+            return nothing
+        end
+        nested = measure(() -> success(exe, config, nested_cmd))
+        return Dict(
+            "outer" => outer,
+            "nested" => nested,
+            "overhead_ms" => nested["median_ms"] - outer["median_ms"],
+        )
+    end
+end
+
+# `cleanup()` of an executor whose persistent changes hold an increasing number of files
+function bench_cleanup(executor)
+    config = base_config(; persist=true)
+    results = Dict{String,Any}()
+    for num_files in (100, 1_000, 10_000)
+        executors = SandboxExecutor[]
+        fill_cmd = `/bin/sh -c "mkdir -p /fill && cd /fill && seq 1 $(num_files) | xargs touch"`
+        results[string(num_files)] = measure(; setup = () -> begin
+            exe = executor()
+            success(exe, config, fill_cmd) || error("Unable to fill the persistence directory of $(exe)")
+            push!(executors, exe)
+        end) do
+            cleanup(pop!(executors))
+        end
+    end
+    return results
+end
+
+# Commands per second at an increasing number of concurrently running sandboxes
+function bench_throughput(executor)
+    config = base_config()
+    results = Dict{String,Any}()
+    for concurrency in (1, 2, 4, 8)
+        pool = ExecutorPool(executor; size=concurrency)
+        try
+            num_cmds = concurrency * samples
+            elapsed = @elapsed @sync for _ in 1:num_cmds
+                @async with_executor(exe -> run_true(exe, config), pool)
+            end
+            results[string(concurrency)] = Dict(
+                "commands" => num_cmds,
+                "elapsed_ms" => 1000 * elapsed,
+                "commands_per_second" => num_cmds / elapsed,
+            )
+        finally
+            cleanup(pool)
+        end
+    end
+    return results
+end
+
+const benchmarks = [
+    "latency" => bench_latency,
+    "maps" => bench_maps,
+    "rootfs_size" => bench_rootfs_size,
+    "nesting" => bench_nesting,
+    "cleanup" => bench_cleanup,
+    "throughput" => bench_throughput,
+]
+
+# Just enough JSON for our results, so that we don't need another dependency
+json(io::IO, x::AbstractString) = print(io, '"', escape_string(x), '"')
+json(io::IO, x::Union{Integer,Bool}) = print(io, x)
+json(io::IO, x::AbstractFloat) = isfinite(x) ? print(io, x) : print(io, "null")
+json(io::IO, ::Nothing) = print(io, "null")
+function json(io::IO, x::AbstractDict)
+    print(io, '{')
+    for (idx, key) in enumerate(sort!(collect(keys(x))))
+        idx > 1 && print(io, ", ")
+        json(io, string(key))
+        print(io, ": ")
+        json(io, x[key])
+    end
+    print(io, '}')
+end
+function json(io::IO, x::AbstractVector)
+    print(io, '[')
+    for (idx, value) in enumerate(x)
+        idx > 1 && print(io, ", ")
+        json(io, value)
+    end
+    print(io, ']')
+end
+
+executors = filter(Sandbox.all_executors) do executor
+    # Only benchmark the privileged executor if `sudo` doesn't require a password
+    if executor <: PrivilegedUserNamespacesExecutor && !success(`sudo -k -n true`)
+        return false
+    end
+    return executor_available(executor)
+end
+
+results = Dict{String,Any}(
+    "julia_version" => string(VERSION),
+    "kernel" => string(something(Sandbox.get_kernel_version(), "unknown")),
+    "samples" => samples,
+    "timestamp" => time(),
+    "executors" => Dict{String,Any}(),
+)
+for executor in executors
+    executor_results = Dict{String,Any}()
+    for (name, bench) in benchmarks
+        @info("Benchmarking $(name) for $(executor)")
+        executor_results[name] = bench(executor)
+    end
+    results["executors"][string(nameof(executor))] = executor_results
+end
+
+output_path = get(ARGS, 1, nothing)
+if output_path === nothing
+    json(stdout, results)
+    println()
+else
+    open(io -> (json(io, results); println(io)), output_path; write=true)
+    @info("Wrote benchmark results to $(output_path)")
+end
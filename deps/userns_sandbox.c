@@ -54,6 +54,7 @@ Then run it, mounting in a rootfs with a workspace and no other read-only maps:
 #include <linux/veth.h>
 #include <sched.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -65,6 +66,11 @@ Then run it, mounting in a rootfs with a workspace and no other read-only maps:
 #include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/un.h>
+#include <sys/signalfd.h>
+#include <sys/time.h>
+#include <poll.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <libgen.h>
@@ -73,7 +79,16 @@ Then run it, mounting in a rootfs with a workspace and no other read-only maps:
 #include <linux/reboot.h>
 #include <linux/limits.h>
 #include <getopt.h>
+#include <grp.h>
 #include <byteswap.h>
+#include <endian.h>
+#include <linux/loop.h>
+#include <linux/magic.h>
+#include <sys/vfs.h>
+#include <time.h>
+#include <sys/utsname.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
 
 /**** Global Variables ***/
 #define TRUE 1
@@ -89,9 +104,62 @@ char *new_cd = NULL;
 // Specifying this will allow subsequent invocations to persist temporary state.
 char * persist_dir = NULL;
 
+// layers are extra read-only directories stacked on top of the rootfs (see `--layer`),
+// bottom-most first, such as rootfs changes frozen by an earlier persistent sandbox.
+#define MAX_LAYERS 64
+char *layers[MAX_LAYERS];
+int num_layers = 0;
+
+// tmpfs_size is the size limit of the tmpfs that holds ephemeral overlayfs data.
+char *tmpfs_size = "1G";
+
+// tmpfs_huge sets whether that tmpfs should be backed by transparent huge pages.
+unsigned char tmpfs_huge = 0;
+
+// scratch_dir is a host directory within which we create (and afterwards delete) a
+// disk-backed overlayfs work directory, for changes that are too large to keep in memory.
+char *scratch_dir = NULL;
+
+// scratch_fd is a handle on the overlayfs work directory, so that we can still measure
+// how much space the changes take up once we've pivoted away from it.
+int scratch_fd = -1;
+
 // verbose sets whether we're in verbose mode.
 unsigned char verbose = 0;
 
+// trace_fd is where we write machine-readable trace events to (see `--trace-file`), if anywhere.
+int trace_fd = -1;
+
+// serve_path is where we listen for commands when running as a long-lived zygote server.
+char *serve_path = NULL;
+
+// connect_path is the socket of a zygote server that we hand our command off to.
+char *connect_path = NULL;
+
+// pin_dir is where we record the namespaces of a long-lived sandbox for `--join` to enter.
+char *pin_dir = NULL;
+
+// join_dir is the `--pin` directory of a sandbox whose namespaces we run our command within.
+char *join_dir = NULL;
+
+// cleanup_path is a persistence directory that we are asked to delete, instead of sandboxing
+char *cleanup_path = NULL;
+
+// die_with_parent makes us (and with us, the sandbox) go down when our parent process does.
+int die_with_parent = FALSE;
+
+// network_mode is which network namespace (if any) the sandbox gets, see `--network`.
+enum {
+  NETWORK_HOST,
+  NETWORK_NONE,
+  NETWORK_LOOPBACK,
+  NETWORK_VETH,
+};
+int network_mode = NETWORK_HOST;
+
+// seccomp_prog is the seccomp-BPF filter that commands get run under, if any (see `--seccomp`).
+struct sock_fprog seccomp_prog = {0, NULL};
+
 // Linked list of volume mappings
 struct map_list {
     char *map_path;
@@ -108,6 +176,10 @@ enum {
 };
 static int execution_mode;
 
+// proc_root is where we find the host's procfs; usually `/proc`, unless we had to leave
+// our overlay tmpfs uncovered there (see `mount_the_world()`).
+const char * proc_root = "/proc";
+
 /**** General Utilities ***/
 
 /* Like assert, but don't go away with optimizations */
@@ -121,10 +193,164 @@ static void _check(int ok, int line) {
 }
 #define check(ok) _check(ok, __LINE__)
 
+/* Monotonic timestamp in milliseconds, for reporting how long our setup phases take */
+static double timestamp_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/**** Signals *****
+ *
+ * Rather than dying on their own and leaving the command behind, every `sandbox` process
+ * between our caller and the command passes SIGTERM and SIGINT on towards it.  Only signals
+ * that some process sent are forwarded; those generated by the terminal (^C) already reach
+ * everything in its foreground process group.  If the command is still around
+ * `kill_timeout` seconds after a SIGTERM, the init of the sandbox SIGKILLs everything within
+ * it.  Commands killed by a signal exit with 128 plus its number, as they would in a shell.
+ *
+ * SIGKILL can't be forwarded, of course; with `--die-with-parent`, we at least follow a
+ * parent that got SIGKILLed (such as the `sudo` that privileged sandboxes run under), and
+ * the init of the sandbox in turn follows us, taking everything within it along.
+ */
+static double kill_timeout = 5.0;
+static pid_t forward_pid = -1;
+
+static int sent_by_process(const siginfo_t * info) {
+  return info->si_code <= 0;
+}
+
+static void forward_signal(int sig, siginfo_t * info, void * ucontext) {
+  (void)ucontext;
+  if (forward_pid > 0 && sent_by_process(info)) {
+    kill(forward_pid, sig);
+  }
+}
+
+static void forward_signals_to(pid_t pid) {
+  forward_pid = pid;
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = forward_signal;
+  action.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  check(0 == sigaction(SIGTERM, &action, NULL));
+  check(0 == sigaction(SIGINT, &action, NULL));
+}
+
+// While the init of the sandbox is still setting it up, there is nothing to forward to yet
+static void exit_on_signal(int sig) {
+  _exit(128 + sig);
+}
+
+static int exit_code_of(int status) {
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+/**** Tracing *****
+ *
+ * With `--trace-file`, we record what we're doing as a series of TOML `[[event]]` tables,
+ * each with a `type`, the monotonic timestamp `t_ms` at which it was recorded, and whatever
+ * else is interesting about it.  Both the parent and the sandboxed child write to the same
+ * `O_APPEND` file, so every event is assembled in memory first and written in one go.
+ */
+struct trace_event {
+  char data[3*PATH_MAX];
+  size_t len;
+};
+
+static void trace_printf(struct trace_event * event, const char * fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  int n = vsnprintf(event->data + event->len, sizeof(event->data) - event->len, fmt, args);
+  va_end(args);
+  if (n > 0) {
+    event->len += n;
+    if (event->len >= sizeof(event->data)) {
+      event->len = sizeof(event->data) - 1;
+    }
+  }
+}
+
+static void trace_begin(struct trace_event * event, const char * type) {
+  event->len = 0;
+  trace_printf(event, "[[event]]\ntype = \"%s\"\nt_ms = %.3f\n", type, timestamp_ms());
+}
+
+static void trace_string(struct trace_event * event, const char * key, const char * value) {
+  trace_printf(event, "%s = \"", key);
+  for (; *value; ++value) {
+    unsigned char c = (unsigned char)*value;
+    if (c == '"' || c == '\\') {
+      trace_printf(event, "\\%c", c);
+    } else if (c < 0x20 || c == 0x7f) {
+      trace_printf(event, "\\u%04x", c);
+    } else {
+      trace_printf(event, "%c", c);
+    }
+  }
+  trace_printf(event, "\"\n");
+}
+
+static void trace_number(struct trace_event * event, const char * key, double value) {
+  trace_printf(event, "%s = %.3f\n", key, value);
+}
+
+static void trace_integer(struct trace_event * event, const char * key, long long value) {
+  trace_printf(event, "%s = %lld\n", key, value);
+}
+
+/* Everything `getrusage()`/`wait4()` know about the accumulated resource usage of a process tree */
+static void trace_rusage(struct trace_event * event, const struct rusage * usage) {
+  trace_number(event, "user_ms", usage->ru_utime.tv_sec * 1000.0 + usage->ru_utime.tv_usec / 1000.0);
+  trace_number(event, "system_ms", usage->ru_stime.tv_sec * 1000.0 + usage->ru_stime.tv_usec / 1000.0);
+  trace_integer(event, "max_rss_kb", usage->ru_maxrss);
+  trace_integer(event, "minor_faults", usage->ru_minflt);
+  trace_integer(event, "major_faults", usage->ru_majflt);
+  trace_integer(event, "read_blocks", usage->ru_inblock);
+  trace_integer(event, "write_blocks", usage->ru_oublock);
+  trace_integer(event, "voluntary_switches", usage->ru_nvcsw);
+  trace_integer(event, "involuntary_switches", usage->ru_nivcsw);
+}
+
+static void trace_end(struct trace_event * event) {
+  trace_printf(event, "\n");
+  // Tracing is best-effort; we never fail a run because we couldn't write a trace event.
+  ssize_t ignored = write(trace_fd, event->data, event->len);
+  (void)ignored;
+}
+
+static void report_phase(const char * phase, double start_ms) {
+  double duration_ms = timestamp_ms() - start_ms;
+  if (verbose) {
+    fprintf(stderr, "--> Phase %s took %.3f ms\n", phase, duration_ms);
+  }
+  if (trace_fd != -1) {
+    struct trace_event event;
+    trace_begin(&event, "phase");
+    trace_string(&event, "name", phase);
+    trace_number(&event, "start_ms", start_ms);
+    trace_number(&event, "duration_ms", duration_ms);
+    trace_end(&event);
+  }
+}
+
+static void trace_mount(const char * kind, const char * src, const char * dest, double start_ms) {
+  if (trace_fd != -1) {
+    struct trace_event event;
+    trace_begin(&event, "mount");
+    trace_string(&event, "kind", kind);
+    trace_string(&event, "source", src);
+    trace_string(&event, "target", dest);
+    trace_number(&event, "duration_ms", timestamp_ms() - start_ms);
+    trace_end(&event);
+  }
+}
+
 /* Opens /proc/%pid/%file */
 static int open_proc_file(pid_t pid, const char *file, int mode) {
   char path[PATH_MAX];
-  int n = snprintf(path, sizeof(path), "/proc/%d/%s", pid, file);
+  int n = snprintf(path, sizeof(path), "%s/%d/%s", proc_root, pid, file);
   check(n >= 0 && n < sizeof(path));
   int fd = open(path, mode);
   check(fd != -1);
@@ -132,8 +358,17 @@ static int open_proc_file(pid_t pid, const char *file, int mode) {
 }
 
 /* `touch` a file; create it if it doesn't already exist. */
+static void mkpath(const char * dir);
 static void touch(const char * path) {
   int fd = open(path, O_RDONLY | O_CREAT, S_IRUSR | S_IRGRP | S_IROTH);
+  // Files get mapped into directories that don't exist yet just as well as directories do
+  if (fd == -1 && errno == ENOENT) {
+    char * parent = strdup(path);
+    check(parent != NULL);
+    mkpath(dirname(parent));
+    free(parent);
+    fd = open(path, O_RDONLY | O_CREAT, S_IRUSR | S_IRGRP | S_IROTH);
+  }
   // Ignore EISDIR as sometimes we try to `touch()` a directory
   if (fd == -1 && errno != EISDIR) {
     check(fd != -1);
@@ -141,41 +376,301 @@ static void touch(const char * path) {
   close(fd);
 }
 
-/* Make all directories up to the given directory name. */
+/*
+ * Remember which directories `mkpath()` already knows to exist, as with many maps the same
+ * parents get checked over and over again.  Mounting something over a directory hides
+ * whatever was beneath it, so mounts must call `mkpath_cache_forget()` on their mountpoint.
+ */
+#define MKPATH_CACHE_SIZE 1024
+static char * mkpath_cache[MKPATH_CACHE_SIZE];
+
+static uint32_t hash_path(const char * path) {
+  uint32_t h = 2166136261u;
+  for (; *path; ++path) {
+    h = (h ^ (unsigned char)*path) * 16777619u;
+  }
+  return h;
+}
+
+static char ** mkpath_cache_slot(const char * dir) {
+  uint32_t h = hash_path(dir);
+  for (int probe = 0; probe < MKPATH_CACHE_SIZE; ++probe) {
+    char ** slot = &mkpath_cache[(h + probe) % MKPATH_CACHE_SIZE];
+    if (*slot == NULL || strcmp(*slot, dir) == 0) {
+      return slot;
+    }
+  }
+  return NULL;
+}
+
+static void mkpath_cache_forget(const char * mountpoint) {
+  size_t len = strlen(mountpoint);
+  int forgot = FALSE;
+  for (int idx = 0; idx < MKPATH_CACHE_SIZE; ++idx) {
+    if (mkpath_cache[idx] != NULL && strncmp(mkpath_cache[idx], mountpoint, len) == 0 &&
+        (mkpath_cache[idx][len] == '/' || mkpath_cache[idx][len] == '\0')) {
+      free(mkpath_cache[idx]);
+      mkpath_cache[idx] = NULL;
+      forgot = TRUE;
+    }
+  }
+  // Our open addressing can't cope with holes, so rehash whatever is left
+  if (forgot) {
+    char * entries[MKPATH_CACHE_SIZE];
+    memcpy(entries, mkpath_cache, sizeof(entries));
+    memset(mkpath_cache, 0, sizeof(mkpath_cache));
+    for (int idx = 0; idx < MKPATH_CACHE_SIZE; ++idx) {
+      if (entries[idx] != NULL) {
+        *mkpath_cache_slot(entries[idx]) = entries[idx];
+      }
+    }
+  }
+}
+
+static void mkpath_cache_clear() {
+  for (int idx = 0; idx < MKPATH_CACHE_SIZE; ++idx) {
+    free(mkpath_cache[idx]);
+    mkpath_cache[idx] = NULL;
+  }
+}
+
+/*
+ * Make all directories up to the given directory name.  Usually everything but (at most) the
+ * last component exists already, so we first just try to create that; only if its parent is
+ * missing too do we walk down from the top with `mkdirat()`, one directory fd at a time.
+ */
 static void mkpath(const char * dir) {
-  // If this directory already exists, back out.
-  DIR * dir_obj = opendir(dir);
-  if (dir_obj) {
-    closedir(dir_obj);
+  char ** slot = mkpath_cache_slot(dir);
+  if (slot != NULL && *slot != NULL) {
     return;
   }
-  // Otherwise, first make sure our parent exists.  Note that dirname()
-  // clobbers its input, so we copy to a temporary variable first. >:|
-  char dir_dirname[PATH_MAX];
-  strncpy(dir_dirname, dir, PATH_MAX);
-  mkpath(dirname(&dir_dirname[0]));
 
-  // then create our directory
-  int result = mkdir(dir, 0777);
-  check((0 == result) || (errno == EEXIST));
+  if (0 != mkdir(dir, 0777) && errno != EEXIST) {
+    check(errno == ENOENT);
+    char * path = strdup(dir);
+    check(path != NULL);
+    int dir_fd = open(path[0] == '/' ? "/" : ".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    check(dir_fd != -1);
+    char * saveptr = NULL;
+    for (char * name = strtok_r(path, "/", &saveptr); name != NULL; name = strtok_r(NULL, "/", &saveptr)) {
+      check(0 == mkdirat(dir_fd, name, 0777) || errno == EEXIST);
+      int next_fd = openat(dir_fd, name, O_PATH | O_DIRECTORY | O_CLOEXEC);
+      check(next_fd != -1);
+      close(dir_fd);
+      dir_fd = next_fd;
+    }
+    close(dir_fd);
+    free(path);
+  }
+
+  // Creating a parent never needs the cache, so our slot is still free
+  if (slot != NULL) {
+    *slot = strdup(dir);
+  }
+}
+
+/* Returns the number of bytes allocated to everything beneath the directory `dir_fd`. */
+static uint64_t dir_usage(int dir_fd) {
+  uint64_t total = 0;
+  DIR * dir_obj = fdopendir(dir_fd);
+  if (dir_obj == NULL) {
+    close(dir_fd);
+    return 0;
+  }
+  struct dirent * entry;
+  while ((entry = readdir(dir_obj)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+      continue;
+    }
+    struct stat st;
+    if (fstatat(dirfd(dir_obj), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+      continue;
+    }
+    total += (uint64_t)st.st_blocks * 512;
+    if (S_ISDIR(st.st_mode)) {
+      int child_fd = openat(dirfd(dir_obj), entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+      if (child_fd != -1) {
+        total += dir_usage(child_fd);
+      }
+    }
+  }
+  closedir(dir_obj);
+  return total;
+}
+
+/* Recursively delete `name` (relative to `parent_fd`), whatever its permissions. */
+static void remove_tree_at(int parent_fd, const char * name) {
+  // overlayfs leaves its `work` directories with mode 000, so make sure we can get in
+  fchmodat(parent_fd, name, 0700, 0);
+  int dir_fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (dir_fd != -1) {
+    DIR * dir_obj = fdopendir(dir_fd);
+    check(dir_obj != NULL);
+    struct dirent * entry;
+    while ((entry = readdir(dir_obj)) != NULL) {
+      if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+        continue;
+      }
+      int is_dir = (entry->d_type == DT_DIR);
+      if (entry->d_type == DT_UNKNOWN) {
+        struct stat st;
+        is_dir = (fstatat(dir_fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0) && S_ISDIR(st.st_mode);
+      }
+      if (is_dir) {
+        remove_tree_at(dir_fd, entry->d_name);
+      } else {
+        unlinkat(dir_fd, entry->d_name, 0);
+      }
+    }
+    closedir(dir_obj);
+  }
+  unlinkat(parent_fd, name, AT_REMOVEDIR);
 }
 
-static int isdir(const char * path) {
-  struct stat path_stat;
-  int result = stat(path, &path_stat);
+/**** Seccomp *****
+ *
+ * `--seccomp <file>` takes an already compiled seccomp-BPF program (the raw `struct
+ * sock_filter` instructions, as generated by Sandbox.jl), which we read in once up front
+ * and install in every command's process right before it `execve()`s, so that a policy
+ * costs nothing more than a `prctl()` and a `seccomp()` per run.
+ */
+static int load_seccomp(const char * path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) != 0) {
+    fprintf(stderr, "ERROR: Unable to open seccomp filter %s: %s\n", path, strerror(errno));
+    return 0;
+  }
+  size_t num_insns = st.st_size / sizeof(struct sock_filter);
+  if (st.st_size == 0 || st.st_size % sizeof(struct sock_filter) != 0 || num_insns > BPF_MAXINSNS) {
+    fprintf(stderr, "ERROR: %s is not a seccomp-BPF program\n", path);
+    close(fd);
+    return 0;
+  }
+  struct sock_filter * filter = (struct sock_filter *)malloc(st.st_size);
+  check(filter != NULL);
+  if (read(fd, filter, st.st_size) != st.st_size) {
+    fprintf(stderr, "ERROR: Unable to read seccomp filter %s\n", path);
+    free(filter);
+    close(fd);
+    return 0;
+  }
+  close(fd);
+  seccomp_prog.len = num_insns;
+  seccomp_prog.filter = filter;
+  if (verbose) {
+    fprintf(stderr, "--> Loaded seccomp filter of %zu instructions from %s\n", num_insns, path);
+  }
+  return 1;
+}
 
-  // Silently ignore calling `isdir()` on a non-existant path
-  check((0 == result) || (errno == ENOENT) || (errno == ENOTDIR));
-  return S_ISDIR(path_stat.st_mode);
+// Only ever called in a process that is about to `execve()` the command (or die trying)
+static void install_seccomp() {
+  if (seccomp_prog.filter == NULL) {
+    return;
+  }
+  if (0 != prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) ||
+      0 != syscall(SYS_seccomp, SECCOMP_SET_MODE_FILTER, 0, &seccomp_prog)) {
+    fprintf(stderr, "ERROR: Unable to install seccomp filter: %d (%s)\n", errno, strerror(errno));
+    _exit(1);
+  }
 }
 
-static int islink(const char * path) {
-  struct stat path_stat;
-  int result = stat(path, &path_stat);
+/**** Cleanup *****
+ *
+ * `sandbox --cleanup <dir>` deletes a persistence directory that earlier sandboxes have
+ * left behind.  Overlay upper and work directories are full of files that are unreadable
+ * or owned by (mapped) root, which we would otherwise have to fix up one `chmod` at a time.
+ * Run as the same user that ran the sandboxes (or once through `sudo` for privileged ones),
+ * we own everything in there and can simply walk it.  The walk is split across a handful of
+ * forked workers by farming out the entries two levels down (the contents of `upper` and `work`),
+ * after which the remaining skeleton is removed by the parent.
+ */
+#define MAX_CLEANUP_WORKERS 16
+
+static int cleanup_main(const char * path) {
+  double start = timestamp_ms();
+  chmod(path, 0700);
+  int root_fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (root_fd == -1) {
+    if (errno == ENOENT) {
+      return 0;
+    }
+    fprintf(stderr, "ERROR: Unable to open %s for cleanup: %d (%s)\n", path, errno, strerror(errno));
+    return 1;
+  }
+
+  long num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_workers < 1) {
+    num_workers = 1;
+  }
+  if (num_workers > MAX_CLEANUP_WORKERS) {
+    num_workers = MAX_CLEANUP_WORKERS;
+  }
+
+  pid_t workers[MAX_CLEANUP_WORKERS];
+  int num_started = 0;
+  for (int worker_idx = 0; worker_idx < num_workers; ++worker_idx) {
+    pid_t pid = fork();
+    check(pid != -1);
+    if (pid != 0) {
+      workers[num_started++] = pid;
+      continue;
+    }
+
+    // Worker `worker_idx` takes every `num_workers`-th entry two levels down.  Each worker
+    // reads the top level through a descriptor of its own, as a `dup()`ed one would share
+    // its directory offset with all other workers.
+    long entry_idx = 0;
+    DIR * root_obj = fdopendir(openat(root_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    check(root_obj != NULL);
+    struct dirent * top;
+    while ((top = readdir(root_obj)) != NULL) {
+      if (strcmp(top->d_name, ".") == 0 || strcmp(top->d_name, "..") == 0) {
+        continue;
+      }
+      fchmodat(root_fd, top->d_name, 0700, 0);
+      int top_fd = openat(root_fd, top->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+      if (top_fd == -1) {
+        continue;
+      }
+      DIR * top_obj = fdopendir(top_fd);
+      check(top_obj != NULL);
+      struct dirent * entry;
+      while ((entry = readdir(top_obj)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+          continue;
+        }
+        if ((entry_idx++ % num_workers) == worker_idx) {
+          if (unlinkat(top_fd, entry->d_name, 0) != 0) {
+            remove_tree_at(top_fd, entry->d_name);
+          }
+        }
+      }
+      closedir(top_obj);
+    }
+    closedir(root_obj);
+    _exit(0);
+  }
+
+  for (int idx = 0; idx < num_started; ++idx) {
+    int status;
+    waitpid(workers[idx], &status, 0);
+  }
+
+  // Whatever is left (the top-level directories and anything the workers raced on)
+  remove_tree_at(AT_FDCWD, path);
+  close(root_fd);
+  if (verbose) {
+    fprintf(stderr, "--> Cleaned up %s with %d workers in %.3f ms\n", path, num_started, timestamp_ms() - start);
+  }
 
-  // Silently ignore calling `islink()` on a non-existant path
-  check((0 == result) || (errno == ENOENT) || (errno == ENOTDIR));
-  return S_ISLNK(path_stat.st_mode);
+  struct stat st;
+  if (lstat(path, &st) == 0) {
+    fprintf(stderr, "ERROR: Unable to fully remove %s\n", path);
+    return 1;
+  }
+  return 0;
 }
 
 /**** User namespaces *****
@@ -227,6 +722,181 @@ static void configure_user_namespace(pid_t pid, uid_t src_uid, gid_t src_gid,
   check(write(gidmap_fd, gidmap, nbytes) == nbytes);
 }
 
+/**** Network namespaces *****
+ *
+ * By default the sandbox shares the host's network.  With `--network`, it gets a network
+ * namespace of its own instead: `none` leaves it without any usable interface, `loopback`
+ * brings up just `lo`, and `veth` also connects it to the host through a veth pair, with
+ * `eth0` inside and `sbx<pid>` outside.  The pair gets the /30 out of 10.0.0.0/8 at
+ * `pid << 2`, so concurrent sandboxes never collide, and the sandbox's default route points
+ * at the host end; routing or NAT beyond that is up to the host.  Creating the pair needs
+ * `CAP_NET_ADMIN` on the host, so `veth` is only available in privileged mode.
+ *
+ * Addresses and routes are set through the classic ioctls, so the only netlink request we
+ * need is the one that creates the veth pair.
+ */
+static uint32_t veth_subnet(pid_t pid) {
+  return (10u << 24) | (((uint32_t)pid << 2) & 0x00ffffff);
+}
+
+static int link_ioctl(const char * name, unsigned long request, struct ifreq * ifr) {
+  int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    return -1;
+  }
+  strncpy(ifr->ifr_name, name, IFNAMSIZ - 1);
+  int ret = ioctl(fd, request, ifr);
+  close(fd);
+  return ret;
+}
+
+static int link_up(const char * name) {
+  struct ifreq ifr;
+  memset(&ifr, 0, sizeof(ifr));
+  if (link_ioctl(name, SIOCGIFFLAGS, &ifr) != 0) {
+    return -1;
+  }
+  ifr.ifr_flags |= IFF_UP;
+  return link_ioctl(name, SIOCSIFFLAGS, &ifr);
+}
+
+static int link_address(const char * name, uint32_t addr, uint32_t netmask) {
+  struct ifreq ifr;
+  memset(&ifr, 0, sizeof(ifr));
+  struct sockaddr_in * sin = (struct sockaddr_in *)&ifr.ifr_addr;
+  sin->sin_family = AF_INET;
+  sin->sin_addr.s_addr = htobe32(addr);
+  if (link_ioctl(name, SIOCSIFADDR, &ifr) != 0) {
+    return -1;
+  }
+  sin->sin_addr.s_addr = htobe32(netmask);
+  return link_ioctl(name, SIOCSIFNETMASK, &ifr);
+}
+
+static int add_default_route(uint32_t gateway) {
+  struct rtentry route;
+  memset(&route, 0, sizeof(route));
+  struct sockaddr_in * sin = (struct sockaddr_in *)&route.rt_gateway;
+  sin->sin_family = AF_INET;
+  sin->sin_addr.s_addr = htobe32(gateway);
+  ((struct sockaddr_in *)&route.rt_dst)->sin_family = AF_INET;
+  ((struct sockaddr_in *)&route.rt_genmask)->sin_family = AF_INET;
+  route.rt_flags = RTF_UP | RTF_GATEWAY;
+
+  int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    return -1;
+  }
+  int ret = ioctl(fd, SIOCADDRT, &route);
+  close(fd);
+  return ret;
+}
+
+// Appends an attribute to `msg`, returning it so that further attributes can be nested within
+static struct rtattr * netlink_attr(struct nlmsghdr * msg, int type, const void * data, size_t len) {
+  struct rtattr * attr = (struct rtattr *)((char *)msg + NLMSG_ALIGN(msg->nlmsg_len));
+  attr->rta_type = type;
+  attr->rta_len = RTA_LENGTH(len);
+  if (len > 0) {
+    memcpy(RTA_DATA(attr), data, len);
+  }
+  msg->nlmsg_len = NLMSG_ALIGN(msg->nlmsg_len) + RTA_ALIGN(attr->rta_len);
+  return attr;
+}
+
+static void netlink_nest_end(struct nlmsghdr * msg, struct rtattr * nest) {
+  nest->rta_len = (char *)msg + msg->nlmsg_len - (char *)nest;
+}
+
+// Sends `msg` off to the kernel, returning 0 if it was acknowledged, or -1 (and `errno`) if not
+static int netlink_request(struct nlmsghdr * msg) {
+  int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+  if (fd == -1) {
+    return -1;
+  }
+  struct sockaddr_nl addr = {.nl_family = AF_NETLINK};
+  msg->nlmsg_flags |= NLM_F_REQUEST | NLM_F_ACK;
+  char reply[1024];
+  ssize_t len = -1;
+  if (sendto(fd, msg, msg->nlmsg_len, 0, (struct sockaddr *)&addr, sizeof(addr)) == msg->nlmsg_len) {
+    len = recv(fd, reply, sizeof(reply), 0);
+  }
+  close(fd);
+
+  struct nlmsghdr * hdr = (struct nlmsghdr *)reply;
+  if (len < 0) {
+    return -1;
+  }
+  if (!NLMSG_OK(hdr, len) || hdr->nlmsg_type != NLMSG_ERROR) {
+    errno = EPROTO;
+    return -1;
+  }
+  struct nlmsgerr * err = (struct nlmsgerr *)NLMSG_DATA(hdr);
+  if (err->error != 0) {
+    errno = -err->error;
+    return -1;
+  }
+  return 0;
+}
+
+// Create a veth pair, with `host_name` staying with us and `peer_name` within the netns of `pid`
+static int create_veth(const char * host_name, const char * peer_name, pid_t pid) {
+  union {
+    struct nlmsghdr hdr;
+    char buff[512];
+  } msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.hdr.nlmsg_type = RTM_NEWLINK;
+  msg.hdr.nlmsg_flags = NLM_F_CREATE | NLM_F_EXCL;
+  msg.hdr.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+  ((struct ifinfomsg *)NLMSG_DATA(&msg.hdr))->ifi_family = AF_UNSPEC;
+
+  netlink_attr(&msg.hdr, IFLA_IFNAME, host_name, strlen(host_name) + 1);
+  struct rtattr * linkinfo = netlink_attr(&msg.hdr, IFLA_LINKINFO, NULL, 0);
+  netlink_attr(&msg.hdr, IFLA_INFO_KIND, "veth", strlen("veth"));
+  struct rtattr * info_data = netlink_attr(&msg.hdr, IFLA_INFO_DATA, NULL, 0);
+  struct ifinfomsg peer_info = {.ifi_family = AF_UNSPEC};
+  struct rtattr * peer = netlink_attr(&msg.hdr, VETH_INFO_PEER, &peer_info, sizeof(peer_info));
+  netlink_attr(&msg.hdr, IFLA_IFNAME, peer_name, strlen(peer_name) + 1);
+  uint32_t netns_pid = pid;
+  netlink_attr(&msg.hdr, IFLA_NET_NS_PID, &netns_pid, sizeof(netns_pid));
+  netlink_nest_end(&msg.hdr, peer);
+  netlink_nest_end(&msg.hdr, info_data);
+  netlink_nest_end(&msg.hdr, linkinfo);
+  return netlink_request(&msg.hdr);
+}
+
+// The outside half of network setup, done by the parent while the child waits on it
+static void configure_network_outside(pid_t pid) {
+  if (network_mode != NETWORK_VETH) {
+    return;
+  }
+  char host_name[IFNAMSIZ];
+  snprintf(host_name, sizeof(host_name), "sbx%d", pid);
+  if (0 != create_veth(host_name, "eth0", pid)) {
+    fprintf(stderr, "ERROR: Unable to create veth pair %s: %s\n", host_name, strerror(errno));
+    _exit(1);
+  }
+  check(0 == link_address(host_name, veth_subnet(pid) + 1, 0xfffffffc));
+  check(0 == link_up(host_name));
+  if (verbose) {
+    fprintf(stderr, "--> Connected sandbox through %s\n", host_name);
+  }
+}
+
+// The inside half, done by the child within its fresh network namespace; `pid` is its pid outside
+static void configure_network_inside(pid_t pid) {
+  if (network_mode == NETWORK_HOST || network_mode == NETWORK_NONE) {
+    return;
+  }
+  check(0 == link_up("lo"));
+  if (network_mode == NETWORK_VETH) {
+    check(0 == link_address("eth0", veth_subnet(pid) + 2, 0xfffffffc));
+    check(0 == link_up("eth0"));
+    check(0 == add_default_route(veth_subnet(pid) + 1));
+  }
+}
+
 
 /*
  * Mount an overlayfs from `src` onto `dest`, anchoring the changes made to the overlayfs
@@ -238,7 +908,7 @@ static void configure_user_namespace(pid_t pid, uid_t src_uid, gid_t src_gid,
  */
 static void mount_overlay(const char * src, const char * dest, const char * bname,
                           const char * work_dir, uid_t uid, gid_t gid) {
-  char upper[PATH_MAX], work[PATH_MAX], opts[3*PATH_MAX+28];
+  char upper[PATH_MAX], work[PATH_MAX];
 
   // Construct the location of our upper and work directories
   snprintf(upper, sizeof(upper), "%s/upper/%s", work_dir, bname);
@@ -262,9 +932,16 @@ static void mount_overlay(const char * src, const char * dest, const char * bnam
   mkpath(upper);
   mkpath(work);
 
-  // Construct the opts, mount the overlay
-  snprintf(opts, sizeof(opts), "lowerdir=%s,upperdir=%s,workdir=%s", src, upper, work);
+  // Construct the opts (`src` may be a whole stack of lowerdirs), mount the overlay
+  size_t opts_len = strlen(src) + strlen(upper) + strlen(work) + 32;
+  char * opts = malloc(opts_len);
+  check(opts != NULL);
+  snprintf(opts, opts_len, "lowerdir=%s,upperdir=%s,workdir=%s", src, upper, work);
+  double mount_start = timestamp_ms();
   check(0 == mount("overlay", dest, "overlay", 0, opts));
+  trace_mount("overlay", src, dest, mount_start);
+  free(opts);
+  mkpath_cache_forget(dest);
 
   // Chown this directory to the desired UID/GID, so that it doesn't look like it's
   // owned by "nobody" when we're inside the sandbox.
@@ -280,7 +957,10 @@ static void mount_procfs(const char * root_dir, uid_t uid, gid_t gid) {
     fprintf(stderr, "--> Mounting procfs at %s\n", path);
   }
   // Attempt to unmount a previous /proc if it exists
+  double mount_start = timestamp_ms();
   check(0 == mount("proc", path, "proc", 0, ""));
+  trace_mount("proc", "proc", path, mount_start);
+  mkpath_cache_forget(path);
 
   // Chown this directory to the desired UID/GID, so that it doesn't look like it's
   // owned by "nobody" when we're inside the sandbox.  We allow this to fail, as
@@ -288,20 +968,196 @@ static void mount_procfs(const char * root_dir, uid_t uid, gid_t gid) {
   int ignored = chown(path, uid, gid);
 }
 
+/*
+ * The new mount API (Linux 5.12+) lets us build a read-only bind mount in one go: clone the
+ * source tree, flip all of it (submounts included) to read-only while it is still detached,
+ * and only then attach it at `dest`.  The legacy remount dance only affects the topmost mount.
+ */
+#ifndef SYS_open_tree
+#define SYS_open_tree 428
+#endif
+#ifndef SYS_move_mount
+#define SYS_move_mount 429
+#endif
+#ifndef SYS_mount_setattr
+#define SYS_mount_setattr 442
+#endif
+#ifndef OPEN_TREE_CLONE
+#define OPEN_TREE_CLONE 1
+#endif
+#ifndef MOVE_MOUNT_F_EMPTY_PATH
+#define MOVE_MOUNT_F_EMPTY_PATH 0x00000004
+#endif
+#ifndef AT_RECURSIVE
+#define AT_RECURSIVE 0x8000
+#endif
+#ifndef MOUNT_ATTR_RDONLY
+#define MOUNT_ATTR_RDONLY 0x00000001
+#define MOUNT_ATTR_NOSUID 0x00000002
+#define MOUNT_ATTR_NODEV  0x00000004
+#endif
+
+// Same layout as the kernel's `struct mount_attr`, which not every libc defines (or agrees on)
+struct sandbox_mount_attr {
+  uint64_t attr_set;
+  uint64_t attr_clr;
+  uint64_t propagation;
+  uint64_t userns_fd;
+};
+
+// Flipped off the first time the kernel tells us it doesn't know these syscalls
+static int have_new_mount_api = TRUE;
+
+/* Returns FALSE if the new mount API is unavailable, so the caller can fall back to `mount()`. */
+static int bind_mount_read_only(const char * src, const char * dest) {
+  if (!have_new_mount_api) {
+    return FALSE;
+  }
+  int tree_fd = syscall(SYS_open_tree, AT_FDCWD, src, OPEN_TREE_CLONE | O_CLOEXEC | AT_RECURSIVE);
+  if (tree_fd == -1) {
+    have_new_mount_api = (errno != ENOSYS);
+    return FALSE;
+  }
+  struct sandbox_mount_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.attr_set = MOUNT_ATTR_RDONLY | MOUNT_ATTR_NOSUID | MOUNT_ATTR_NODEV;
+  if (syscall(SYS_mount_setattr, tree_fd, "", AT_EMPTY_PATH | AT_RECURSIVE, &attr, sizeof(attr)) != 0) {
+    have_new_mount_api = (errno != ENOSYS);
+    close(tree_fd);
+    return FALSE;
+  }
+  check(0 == syscall(SYS_move_mount, tree_fd, "", AT_FDCWD, dest, MOVE_MOUNT_F_EMPTY_PATH));
+  close(tree_fd);
+  return TRUE;
+}
+
+/*
+ * Idmapped mounts go one step further: the kernel translates file ownership as it is read,
+ * according to the mappings of some user namespace.  Our own user namespace only maps the
+ * calling user, so a rootfs unpacked by anybody else (root, typically) shows up as owned by
+ * `nobody` inside the sandbox.  Rather than chowning the whole tree, we idmap it in place,
+ * mapping its owner onto the calling user.  Creating idmapped mounts of host filesystems
+ * requires real privileges and a filesystem that supports them, and overlayfs only accepts
+ * idmapped layers since Linux 5.19; if any of that is missing, we leave the tree alone.
+ */
+#ifndef MOUNT_ATTR_IDMAP
+#define MOUNT_ATTR_IDMAP 0x00100000
+#endif
+
+static int kernel_at_least(int major, int minor) {
+  struct utsname name;
+  int kernel_major = 0, kernel_minor = 0;
+  if (uname(&name) != 0 || sscanf(name.release, "%d.%d", &kernel_major, &kernel_minor) != 2) {
+    return FALSE;
+  }
+  return kernel_major > major || (kernel_major == major && kernel_minor >= minor);
+}
+
+static int write_id_map(pid_t pid, const char * file, unsigned int from_id, unsigned int to_id) {
+  char map[64];
+  int nbytes = snprintf(map, sizeof(map), "%u %u 1\n", from_id, to_id);
+  int fd = open_proc_file(pid, file, O_WRONLY);
+  if (fd == -1) {
+    return FALSE;
+  }
+  int ok = (write(fd, map, nbytes) == nbytes);
+  close(fd);
+  return ok;
+}
+
+// Returns an fd for a user namespace that maps `from_uid`/`from_gid` onto `to_uid`/`to_gid`,
+// held open by a child that sits within it only for as long as it takes us to open it.
+static int idmap_userns(uid_t from_uid, gid_t from_gid, uid_t to_uid, gid_t to_gid) {
+  int ready[2], done[2];
+  check(0 == pipe(ready));
+  check(0 == pipe(done));
+  pid_t pid = fork();
+  check(pid != -1);
+  if (pid == 0) {
+    close(ready[0]);
+    close(done[1]);
+    char ok = (0 == unshare(CLONE_NEWUSER));
+    check(1 == write(ready[1], &ok, 1));
+    // Stay in the namespace until the parent closes its end, once it has opened it
+    char ignored;
+    check(0 == read(done[0], &ignored, 1));
+    _exit(0);
+  }
+  close(ready[1]);
+  close(done[0]);
+
+  int userns_fd = -1;
+  char ok = 0;
+  if (read(ready[0], &ok, 1) == 1 && ok) {
+    int map_ok = write_id_map(pid, "uid_map", from_uid, to_uid) &&
+                 write_id_map(pid, "gid_map", from_gid, to_gid);
+    if (map_ok) {
+      userns_fd = open_proc_file(pid, "ns/user", O_RDONLY | O_CLOEXEC);
+    }
+  }
+  close(ready[0]);
+  close(done[1]);
+  waitpid(pid, NULL, 0);
+  return userns_fd;
+}
+
+/* Returns TRUE if `path` now shows up as owned by `uid`/`gid`, because we idmapped it. */
+static int idmap_in_place(const char * path, uid_t uid, gid_t gid) {
+  struct stat st;
+  if (!have_new_mount_api || stat(path, &st) != 0 || !S_ISDIR(st.st_mode) ||
+      (st.st_uid == uid && st.st_gid == gid)) {
+    return FALSE;
+  }
+  if (!kernel_at_least(5, 19)) {
+    return FALSE;
+  }
+  int userns_fd = idmap_userns(st.st_uid, st.st_gid, uid, gid);
+  if (userns_fd == -1) {
+    return FALSE;
+  }
+  int tree_fd = syscall(SYS_open_tree, AT_FDCWD, path, OPEN_TREE_CLONE | O_CLOEXEC);
+  int mounted = FALSE;
+  if (tree_fd != -1) {
+    struct sandbox_mount_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.attr_set = MOUNT_ATTR_IDMAP;
+    attr.userns_fd = userns_fd;
+    double mount_start = timestamp_ms();
+    mounted = (0 == syscall(SYS_mount_setattr, tree_fd, "", AT_EMPTY_PATH, &attr, sizeof(attr))) &&
+              (0 == syscall(SYS_move_mount, tree_fd, "", AT_FDCWD, path, MOVE_MOUNT_F_EMPTY_PATH));
+    if (mounted) {
+      trace_mount("idmap", path, path, mount_start);
+    }
+    close(tree_fd);
+  }
+  if (verbose) {
+    if (mounted) {
+      fprintf(stderr, "--> Idmapped %s from %d:%d to %d:%d\n", path, st.st_uid, st.st_gid, uid, gid);
+    } else {
+      fprintf(stderr, "--> Unable to idmap %s: %d (%s)\n", path, errno, strerror(errno));
+    }
+  }
+  close(userns_fd);
+  return mounted;
+}
+
 static void bind_mount(const char *src, const char *dest, char read_only) {
   // If `src` is a symlink, this bindmount may run into issues, so we collapse
-  // `src` via `realpath()` to ensure that we get a non-symlink.
-  char resolved_src[PATH_MAX] = {0};
-  if (islink(src)) {
+  // `src` via `realpath()` to ensure that we get a non-symlink.  Only then do we
+  // need to look at it a second time.
+  char resolved_src[PATH_MAX];
+  snprintf(resolved_src, sizeof(resolved_src), "%s", src);
+  struct stat src_stat;
+  int src_exists = (0 == lstat(src, &src_stat));
+  check(src_exists || errno == ENOENT || errno == ENOTDIR);
+  if (src_exists && S_ISLNK(src_stat.st_mode)) {
     if (NULL == realpath(src, resolved_src)) {
       if (verbose) {
         fprintf(stderr, "WARNING: Unable to resolve %s ([%d] %s)\n", src, errno, strerror(errno));
       }
+      snprintf(resolved_src, sizeof(resolved_src), "%s", src);
     }
-  }
-
-  if (resolved_src[0] == NULL) {
-    strncpy(resolved_src, src, PATH_MAX);
+    src_exists = (0 == stat(resolved_src, &src_stat));
   }
 
   if (verbose) {
@@ -315,12 +1171,20 @@ static void bind_mount(const char *src, const char *dest, char read_only) {
   // If we're mounting in a directory, create the mountpoint as a directory,
   // otherwise as a file.  Note that if `src` does not exist, we'll create a
   // file here, then error out on the `mount()` call.
-  if (isdir(resolved_src)) {
+  if (src_exists && S_ISDIR(src_stat.st_mode)) {
     mkpath(dest);
   } else {
     touch(dest);
   }
 
+  // Whatever we mount here, it hides what `mkpath()` may have seen beneath `dest`
+  mkpath_cache_forget(dest);
+  double mount_start = timestamp_ms();
+  if (read_only && bind_mount_read_only(resolved_src, dest)) {
+    trace_mount("bind-ro", resolved_src, dest, mount_start);
+    return;
+  }
+
   // We don't expect workspaces to have any submounts in normal operation.
   // However, for runshell(), workspace could be an arbitrary directory,
   // including one with sub-mounts, so allow that situation with MS_REC.
@@ -337,6 +1201,7 @@ static void bind_mount(const char *src, const char *dest, char read_only) {
     // `mnt_id` and extract the correct flags from `/proc/self/mountinfo`.
     check(0 == mount(resolved_src, dest, "", MS_BIND|MS_REMOUNT|MS_RDONLY|MS_NODEV|MS_NOSUID, NULL));
   }
+  trace_mount(read_only ? "bind-ro" : "bind", resolved_src, dest, mount_start);
 }
 
 /*
@@ -364,7 +1229,10 @@ static void mount_dev(const char * root_dir) {
   // Do the same for /dev/pts and /dev/ptmx
   snprintf(path, sizeof(path), "%s/dev/pts", root_dir);
   mkpath(path);
+  double mount_start = timestamp_ms();
   check(0 == mount("devpts", path, "devpts", 0, "ptmxmode=0666"));
+  trace_mount("devpts", "devpts", path, mount_start);
+  mkpath_cache_forget(path);
 
   snprintf(path, sizeof(path), "%s/dev/pts/ptmx", root_dir);
   char ptmx_dst[PATH_MAX];
@@ -379,97 +1247,1184 @@ static void mount_dev(const char * root_dir) {
   }
 }
 
-static void mount_maps(const char * dest, struct map_list * workspaces, uint8_t read_only) {
-  char path[PATH_MAX];
+static const char * relative_map_path(const struct map_list * entry) {
+  const char * inside = entry->map_path;
+  while (inside[0] == '/') {
+    inside = inside + 1;
+  }
+  return inside;
+}
+
+static int compare_maps(const void * a, const void * b) {
+  const struct map_list * map_a = *(const struct map_list **)a;
+  const struct map_list * map_b = *(const struct map_list **)b;
+  return strcmp(relative_map_path(map_a), relative_map_path(map_b));
+}
+
+/*
+ * Put a list of maps in the order we should mount them in: sorted by the path inside the
+ * sandbox, so that parents are always mounted before the maps nested within them (rather
+ * than over them), and with only the last of any repeated mapping for the same path.
+ */
+static struct map_list * sort_maps(struct map_list * list) {
+  size_t num_maps = 0;
+  for (struct map_list * entry = list; entry != NULL; entry = entry->prev) {
+    ++num_maps;
+  }
+  if (num_maps < 2) {
+    return list;
+  }
+  struct map_list ** entries = (struct map_list **) malloc(num_maps * sizeof(struct map_list *));
+  check(entries != NULL);
+
+  // `list` runs from the last argument given to the first, so moving it backwards into the
+  // array keeps the command-line order, and the stable merge below keeps the later duplicate.
+  size_t idx = num_maps;
+  for (struct map_list * entry = list; entry != NULL; entry = entry->prev) {
+    entries[--idx] = entry;
+  }
+  for (size_t i = 1; i < num_maps; ++i) {
+    // insertion sort is stable, and we never have more than a few hundred maps
+    struct map_list * current = entries[i];
+    size_t j = i;
+    while (j > 0 && compare_maps(&entries[j-1], &current) > 0) {
+      entries[j] = entries[j-1];
+      --j;
+    }
+    entries[j] = current;
+  }
+
+  // Re-link in mounting order, dropping all but the last of each run of duplicates
+  struct map_list * head = NULL;
+  struct map_list * tail = NULL;
+  for (size_t i = 0; i < num_maps; ++i) {
+    if (i + 1 < num_maps && compare_maps(&entries[i], &entries[i+1]) == 0) {
+      if (verbose) {
+        fprintf(stderr, "--> Ignoring %s -> %s, as %s is mapped again later\n",
+                entries[i]->outside_path, entries[i]->map_path, entries[i]->map_path);
+      }
+      continue;
+    }
+    entries[i]->prev = NULL;
+    if (tail == NULL) {
+      head = entries[i];
+    } else {
+      tail->prev = entries[i];
+    }
+    tail = entries[i];
+  }
+  free(entries);
+  return head;
+}
+
+static void mount_maps(const char * dest, struct map_list * workspaces, uint8_t read_only) {
+  char path[PATH_MAX];
+
+  struct map_list *current_entry = workspaces;
+  while( current_entry != NULL ) {
+    // take the path relative to root_dir
+    snprintf(path, sizeof(path), "%s/%s", dest, relative_map_path(current_entry));
+
+    // bind-mount the outside path to the inside path
+    bind_mount(current_entry->outside_path, path, read_only);
+    current_entry = current_entry->prev;
+  }
+}
+
+/**** Filesystem images *****
+ *
+ * Besides directories, `--rootfs` and `--map` accept squashfs and EROFS images, which
+ * saves unpacking (and page-caching, and checksumming, ...) thousands of small files
+ * for every rootfs and shard.  Images are mounted read-only within our overlay work
+ * directory and then used exactly as if they had been given as directories.  When we
+ * have the privileges to, we attach them to a loop device and let the kernel mount
+ * them directly; otherwise (e.g. in unprivileged container mode) we fall back to a
+ * FUSE driver (`squashfuse` or `erofsfuse`) found on the `PATH`.
+ */
+#define SQUASHFS_MAGIC_LE 0x73717368
+#define EROFS_MAGIC_LE    0xE0F5E1E2
+
+/* Returns the filesystem type of the image at `path`, or NULL if it is not an image we know. */
+static const char * image_fstype(const char * path) {
+  struct stat st;
+  if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+    return NULL;
+  }
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return NULL;
+  }
+
+  // squashfs puts its magic right at the start, EROFS puts its superblock at 1KB
+  const char * fstype = NULL;
+  uint32_t magic = 0;
+  if (pread(fd, &magic, sizeof(magic), 0) == sizeof(magic) && le32toh(magic) == SQUASHFS_MAGIC_LE) {
+    fstype = "squashfs";
+  } else if (pread(fd, &magic, sizeof(magic), 1024) == sizeof(magic) && le32toh(magic) == EROFS_MAGIC_LE) {
+    fstype = "erofs";
+  }
+  close(fd);
+  return fstype;
+}
+
+/* Attach `image` to a free loop device and mount it at `dest`.  Returns FALSE if we can't. */
+static int loop_mount(const char * image, const char * dest, const char * fstype) {
+  int ctl_fd = open("/dev/loop-control", O_RDWR | O_CLOEXEC);
+  if (ctl_fd == -1) {
+    return FALSE;
+  }
+  int image_fd = open(image, O_RDONLY | O_CLOEXEC);
+  check(image_fd != -1);
+
+  int mounted = FALSE;
+  // Somebody else may grab the loop device we were handed before we attach to it, so retry a few times
+  for (int attempt = 0; attempt < 8 && !mounted; ++attempt) {
+    int loop_nr = ioctl(ctl_fd, LOOP_CTL_GET_FREE);
+    if (loop_nr < 0) {
+      break;
+    }
+    char loop_path[PATH_MAX];
+    snprintf(loop_path, sizeof(loop_path), "/dev/loop%d", loop_nr);
+    int loop_fd = open(loop_path, O_RDONLY | O_CLOEXEC);
+    if (loop_fd == -1) {
+      break;
+    }
+    if (ioctl(loop_fd, LOOP_SET_FD, image_fd) == -1) {
+      close(loop_fd);
+      if (errno == EBUSY) {
+        continue;
+      }
+      break;
+    }
+
+    // Autoclear detaches the loop device once its last user (our mount) goes away, which
+    // happens automatically when the mount namespace is torn down.
+    struct loop_info64 info;
+    memset(&info, 0, sizeof(info));
+    info.lo_flags = LO_FLAGS_AUTOCLEAR;
+    strncpy((char *)info.lo_file_name, image, LO_NAME_SIZE - 1);
+    ioctl(loop_fd, LOOP_SET_STATUS64, &info);
+
+    if (verbose) {
+      fprintf(stderr, "--> Mounting %s image %s at %s via %s\n", fstype, image, dest, loop_path);
+    }
+    mounted = (0 == mount(loop_path, dest, fstype, MS_RDONLY, NULL));
+    if (!mounted && verbose) {
+      fprintf(stderr, "--> Kernel mount of %s failed ([%d] %s)\n", loop_path, errno, strerror(errno));
+    }
+    if (!mounted) {
+      ioctl(loop_fd, LOOP_CLR_FD, 0);
+    }
+    close(loop_fd);
+    break;
+  }
+  close(image_fd);
+  close(ctl_fd);
+  return mounted;
+}
+
+/* Mount `image` at `dest` through its FUSE driver.  Returns FALSE if we can't. */
+static int fuse_mount(const char * image, const char * dest, const char * fstype) {
+  const char * driver = (strcmp(fstype, "squashfs") == 0) ? "squashfuse" : "erofsfuse";
+  if (verbose) {
+    fprintf(stderr, "--> Mounting %s image %s at %s via %s\n", fstype, image, dest, driver);
+  }
+
+  // The driver daemonizes itself once the mount is up, so we just wait for it to do so.
+  pid_t pid = fork();
+  check(pid != -1);
+  if (pid == 0) {
+    // Keep the drivers' chatter out of the output of the sandboxed command
+    if (!verbose) {
+      int null_fd = open("/dev/null", O_WRONLY);
+      if (null_fd != -1) {
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+      }
+    }
+    execlp(driver, driver, image, dest, (char *)NULL);
+    _exit(127);
+  }
+  int status;
+  check(pid == waitpid(pid, &status, 0));
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/*
+ * If `path` is a filesystem image, mount it at `<work_dir>/images/<name>` and return that
+ * directory; otherwise return `path` untouched.
+ */
+static char * mount_image_if_needed(char * path, const char * name, const char * work_dir) {
+  const char * fstype = image_fstype(path);
+  if (fstype == NULL) {
+    return path;
+  }
+
+  char dest[PATH_MAX];
+  snprintf(dest, sizeof(dest), "%s/images/%s", work_dir, name);
+  mkpath(dest);
+  // Neither squashfs nor EROFS can be mounted from within a user namespace, so only
+  // bother with loop devices when we're doing our mounting outside of one.
+  double mount_start = timestamp_ms();
+  int mounted = (execution_mode == PRIVILEGED_CONTAINER_MODE) && loop_mount(path, dest, fstype);
+  mounted = mounted || fuse_mount(path, dest, fstype);
+  if (mounted) {
+    trace_mount(fstype, path, dest, mount_start);
+  }
+  mkpath_cache_forget(dest);
+  if (!mounted) {
+    fprintf(stderr, "ERROR: Unable to mount %s image %s; no usable loop device or FUSE driver!\n", fstype, path);
+    fflush(stderr);
+    _exit(1);
+  }
+  return strdup(dest);
+}
+
+/*
+ * Helper function that mounts pretty much everything:
+ *   - procfs
+ *   - our overlay work directory
+ *   - the rootfs
+ *   - the shards
+ *   - the workspace (if given by the user)
+ *
+ * Returns the directory that the rootfs ended up at, which is no longer `root_dir` if
+ * that was an image.
+ */
+static char * mount_the_world(char * root_dir,
+                            struct map_list * shard_maps,
+                            struct map_list * workspaces,
+                            uid_t uid, gid_t gid,
+                            const char * persist_dir) {
+  // If `persist_dir` is specified, it represents a host directory that should
+  // be used to store our overlayfs work data.  This is where modifications to
+  // the rootfs and such will go.  Typically, these should be ephemeral (and if
+  // `persist_dir` is `NULL`, it will be mounted in a `tmpfs` so that the
+  // modifcations are lost immediately) but if `persist_dir` is given, the
+  // mounting will be done with modifications stored in that directory.
+  // The caller will be responsible for cleaning up the `work` and `upper`
+  // directories wtihin `persist_dir`, but subsequent invocations of `sandbox`
+  // with the same `--persist` argument will allow resuming execution inside of
+  // a rootfs with the previous modifications intact.
+  if (persist_dir == NULL) {
+    // We know that `/proc` will always be available on basically any Linux
+    // system, so we mount our tmpfs here.  It's also convenient because we
+    // will mount an actual `procfs` over this at the end of this function, so
+    // the overlayfs work directories are completely hidden from view.
+    persist_dir = "/proc";
+
+    // Create tmpfs to store ephemeral changes.  These changes are lost once
+    // the `tmpfs` is unmounted, which occurs when all processes within the
+    // namespace exit and the mount namespace is destroyed.
+    char opts[PATH_MAX];
+    snprintf(opts, sizeof(opts), "size=%s%s", tmpfs_size, tmpfs_huge ? ",huge=within_size" : "");
+    if (verbose) {
+      fprintf(stderr, "--> Mounting tmpfs at /proc (%s)\n", opts);
+    }
+    double mount_start = timestamp_ms();
+    check(0 == mount("tmpfs", "/proc", "tmpfs", 0, opts));
+    trace_mount("tmpfs", "tmpfs", "/proc", mount_start);
+    mkpath_cache_forget("/proc");
+  }
+  scratch_fd = open(persist_dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+  check(scratch_fd != -1);
+
+  if (verbose) {
+    fprintf(stderr, "--> Creating overlay workdir at %s\n", persist_dir);
+  }
+
+  // Mount any filesystem images we were given, so that from here on out everything is a directory
+  double phase_start = timestamp_ms();
+  char * image_root = mount_image_if_needed(root_dir, "rootfs", persist_dir);
+  int root_is_image = (image_root != root_dir);
+  root_dir = image_root;
+  int map_idx = 0;
+  for (struct map_list * entry = shard_maps; entry != NULL; entry = entry->prev) {
+    char name[32];
+    snprintf(name, sizeof(name), "map-%d", map_idx++);
+    entry->outside_path = mount_image_if_needed(entry->outside_path, name, persist_dir);
+  }
+  for (int layer_idx = 0; layer_idx < num_layers; ++layer_idx) {
+    char name[32];
+    snprintf(name, sizeof(name), "layer-%d", layer_idx);
+    layers[layer_idx] = mount_image_if_needed(layers[layer_idx], name, persist_dir);
+  }
+  report_phase("images", phase_start);
+
+  // Any layers go on top of the rootfs, and overlayfs wants its lowerdirs topmost first
+  char * lower_dirs = root_dir;
+  if (num_layers > 0) {
+    size_t lower_len = strlen(root_dir) + 1;
+    for (int layer_idx = 0; layer_idx < num_layers; ++layer_idx) {
+      lower_len += strlen(layers[layer_idx]) + 1;
+    }
+    lower_dirs = malloc(lower_len);
+    check(lower_dirs != NULL);
+    lower_dirs[0] = '\0';
+    for (int layer_idx = num_layers - 1; layer_idx >= 0; --layer_idx) {
+      strcat(lower_dirs, layers[layer_idx]);
+      strcat(lower_dirs, ":");
+    }
+    strcat(lower_dirs, root_dir);
+  }
+
+  // The first thing we do is create an overlay mounting `root_dir` over itself.
+  // `root_dir` is the path to the already loopback-mounted rootfs image, and we
+  // are mounting it as an overlay over itself, so that we can make modifications
+  // without altering the actual rootfs image.  When running in privileged mode,
+  // we're mounting before cloning, in unprivileged mode, we clone before calling
+  // this mehod at all.sta
+  phase_start = timestamp_ms();
+  mount_overlay(lower_dirs, root_dir, "rootfs", persist_dir, uid, gid);
+  if (lower_dirs != root_dir) {
+    free(lower_dirs);
+  }
+  report_phase("overlay", phase_start);
+
+  // Mount all of our read-only mounts
+  phase_start = timestamp_ms();
+  mount_maps(root_dir, shard_maps, TRUE);
+  report_phase("maps", phase_start);
+
+  // Mount /proc within the sandbox.
+  phase_start = timestamp_ms();
+  mount_procfs(root_dir, uid, gid);
+
+  // Mount /dev stuff
+  mount_dev(root_dir);
+  report_phase("dev", phase_start);
+
+  // Mount all our read-write mounts (workspaces)
+  phase_start = timestamp_ms();
+  mount_maps(root_dir, workspaces, FALSE);
+  report_phase("workspaces", phase_start);
+
+  // Once we're done with that, put /proc back in its place in the big world.
+  // This is not strictly necessary since if all goes well, we're going to
+  // `pivot_root()` into the rootfs, but it helps with debugging.  If the rootfs
+  // itself lives within our tmpfs though, covering it up would leave us unable to
+  // find it again, so we give the host procfs a spot inside the tmpfs instead.
+  if (strcmp(persist_dir, "/proc") == 0) {
+    if (root_is_image) {
+      mkpath("/proc/host/proc");
+      mount_procfs("/proc/host", uid, gid);
+      proc_root = "/proc/host/proc";
+    } else {
+      mount_procfs("", uid, gid);
+    }
+  }
+  return root_dir;
+}
+
+/**** Control groups *****
+ *
+ * With `--cgroup` or any of the resource limits (`--cpus`, `--memory`, `--io-max`, `--cpuset`,
+ * `--numa`), we create a fresh cgroup v2 for every run beneath the `--cgroup` parent (which
+ * must be delegated to us, and is required with any of the limits), set the limits on it,
+ * and move the sandbox init into it before it gets to run anything, so that everything
+ * within the sandbox is contained by it.  Once the sandbox is gone, we report
+ * what it used and remove the cgroup again.
+ */
+char *cgroup_parent = NULL;
+char *cgroup_cpus = NULL;
+char *cgroup_memory = NULL;
+char *cgroup_cpuset = NULL;
+char *cgroup_numa = NULL;
+#define MAX_IO_LIMITS 16
+char *cgroup_io_max[MAX_IO_LIMITS];
+int cgroup_io_max_count = 0;
+
+// cgroup_path is the cgroup we created for this run, if any.
+char *cgroup_path = NULL;
+
+static int use_cgroup() {
+  return cgroup_parent != NULL || cgroup_cpus != NULL || cgroup_memory != NULL ||
+         cgroup_cpuset != NULL || cgroup_numa != NULL || cgroup_io_max_count > 0;
+}
+
+static int write_cgroup_file(const char * cgroup, const char * file, const char * value) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", cgroup, file);
+  int fd = open(path, O_WRONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return FALSE;
+  }
+  int ok = (write(fd, value, strlen(value)) == (ssize_t)strlen(value));
+  int saved_errno = errno;
+  close(fd);
+  errno = saved_errno;
+  return ok;
+}
+
+/* Reads a whole (small) cgroup file into `buff`, returning FALSE if it doesn't exist. */
+static int read_cgroup_file(const char * cgroup, const char * file, char * buff, size_t len) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", cgroup, file);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return FALSE;
+  }
+  ssize_t n = read(fd, buff, len - 1);
+  close(fd);
+  buff[n > 0 ? n : 0] = '\0';
+  return n >= 0;
+}
+
+static void cgroup_setting(const char * file, const char * value) {
+  if (verbose) {
+    fprintf(stderr, "--> Setting %s/%s to \"%s\"\n", cgroup_path, file, value);
+  }
+  if (!write_cgroup_file(cgroup_path, file, value)) {
+    fprintf(stderr, "ERROR: Unable to set %s of cgroup %s to \"%s\": %s\n", file, cgroup_path, value, strerror(errno));
+    rmdir(cgroup_path);
+    _exit(1);
+  }
+}
+
+static void create_cgroup() {
+  // We can't default to the cgroup that we're in: with us in it, it can't have any controllers
+  // enabled for its children (cgroup v2's no internal processes rule).
+  if (cgroup_parent == NULL) {
+    fputs("ERROR: Resource limits need a delegated cgroup to create our cgroup in; pass one with --cgroup!\n", stderr);
+    _exit(1);
+  }
+
+  // Turn on the controllers that our limits need (and memory, for its accounting).  Note that
+  // the kernel refuses this if `cgroup_parent` has processes of its own, such as ourselves.
+  const char * controllers[][2] = {
+    {"+memory", cgroup_memory},
+    {"+cpu", cgroup_cpus},
+    {"+io", cgroup_io_max_count > 0 ? "" : NULL},
+    {"+cpuset", (cgroup_cpuset != NULL || cgroup_numa != NULL) ? "" : NULL},
+  };
+  for (size_t idx = 0; idx < sizeof(controllers)/sizeof(controllers[0]); ++idx) {
+    if (!write_cgroup_file(cgroup_parent, "cgroup.subtree_control", controllers[idx][0]) && controllers[idx][1] != NULL) {
+      fprintf(stderr, "ERROR: Unable to enable the %s controller in %s (%s); is it a delegated cgroup without processes of its own? Point --cgroup at one that is.\n",
+              controllers[idx][0] + 1, cgroup_parent, strerror(errno));
+      _exit(1);
+    }
+  }
+
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/sandbox-%d", cgroup_parent, getpid());
+  // One left behind by an earlier sandbox that had our pid may still have its limits set (or
+  // worse, processes in it).  An empty one can just be replaced; anything else, we refuse to
+  // touch, as it may well belong to a sandbox in another pid namespace.
+  if (mkdir(path, 0755) != 0 && (errno != EEXIST || rmdir(path) != 0 || mkdir(path, 0755) != 0)) {
+    if (errno == EBUSY) {
+      fprintf(stderr, "ERROR: Unable to create cgroup %s: a stale one with processes in it is in the way\n", path);
+    } else {
+      fprintf(stderr, "ERROR: Unable to create cgroup %s: %s\n", path, strerror(errno));
+    }
+    _exit(1);
+  }
+  cgroup_path = strdup(path);
+  if (verbose) {
+    fprintf(stderr, "--> Created cgroup %s\n", cgroup_path);
+  }
+
+  if (cgroup_cpus != NULL) {
+    // `--cpus 1.5` means a quota of 150ms of CPU time per 100ms period
+    char cpu_max[64];
+    snprintf(cpu_max, sizeof(cpu_max), "%lld 100000", (long long)(atof(cgroup_cpus) * 100000));
+    cgroup_setting("cpu.max", cpu_max);
+  }
+  if (cgroup_memory != NULL) {
+    cgroup_setting("memory.max", cgroup_memory);
+    // Don't let it dodge the limit by swapping
+    write_cgroup_file(cgroup_path, "memory.swap.max", "0");
+  }
+  for (int idx = 0; idx < cgroup_io_max_count; ++idx) {
+    cgroup_setting("io.max", cgroup_io_max[idx]);
+  }
+  if (cgroup_cpuset != NULL) {
+    cgroup_setting("cpuset.cpus", cgroup_cpuset);
+  }
+  if (cgroup_numa != NULL) {
+    cgroup_setting("cpuset.mems", cgroup_numa);
+  }
+}
+
+/* Report what the cgroup used (once everything in it is dead), then remove it */
+static void finish_cgroup() {
+  char buff[4096];
+  long long memory_peak = -1, io_read = 0, io_write = 0, cpu_usec = -1;
+  if (read_cgroup_file(cgroup_path, "memory.peak", buff, sizeof(buff))) {
+    memory_peak = atoll(buff);
+  }
+  if (read_cgroup_file(cgroup_path, "io.stat", buff, sizeof(buff))) {
+    // One line per device: "MAJ:MIN rbytes=N wbytes=N rios=N wios=N ..."
+    for (char * field = strtok(buff, " \n"); field != NULL; field = strtok(NULL, " \n")) {
+      if (strncmp(field, "rbytes=", 7) == 0) {
+        io_read += atoll(field + 7);
+      } else if (strncmp(field, "wbytes=", 7) == 0) {
+        io_write += atoll(field + 7);
+      }
+    }
+  }
+  if (read_cgroup_file(cgroup_path, "cpu.stat", buff, sizeof(buff))) {
+    char * usage = strstr(buff, "usage_usec ");
+    if (usage != NULL) {
+      cpu_usec = atoll(usage + strlen("usage_usec "));
+    }
+  }
+  if (verbose) {
+    fprintf(stderr, "--> cgroup %s: memory.peak %lld, io read %lld, io written %lld, cpu usage %lld us\n",
+            cgroup_path, memory_peak, io_read, io_write, cpu_usec);
+  }
+  if (trace_fd != -1) {
+    struct trace_event event;
+    trace_begin(&event, "cgroup");
+    trace_string(&event, "path", cgroup_path);
+    if (memory_peak >= 0) {
+      trace_integer(&event, "memory_peak", memory_peak);
+    }
+    trace_integer(&event, "io_read_bytes", io_read);
+    trace_integer(&event, "io_write_bytes", io_write);
+    if (cpu_usec >= 0) {
+      trace_integer(&event, "cpu_usage_usec", cpu_usec);
+    }
+    trace_end(&event);
+  }
+
+  // The last processes may take a moment to actually leave the cgroup after being reaped
+  for (int attempt = 0; attempt < 100; ++attempt) {
+    if (rmdir(cgroup_path) == 0 || errno != EBUSY) {
+      break;
+    }
+    usleep(1000);
+  }
+}
+
+/**** Zygote server *****
+ *
+ * Setting up the namespaces and mounting the world is the bulk of our startup cost, so
+ * callers that run many short commands against the same configuration can start `sandbox`
+ * once with `--serve <socket>`.  Instead of running a command, the sandbox init process then
+ * listens on that unix socket, and every client (`sandbox --connect <socket> -- <cmd>`) sends
+ * over its argv, environment, working directory and stdio file descriptors (via SCM_RIGHTS).
+ * The server forks a cheap child per request within the already-built sandbox, and reports
+ * the exit code back over the connection once that child has been reaped.  Each child leads a
+ * process group of its own (unless its stdin is a terminal, where that would stop it from
+ * reading), and clients pass the SIGTERMs and SIGINTs they get on to that group by writing
+ * their number to the connection.  If a client goes away before its command finishes, the
+ * whole group is killed.
+ */
+
+// Every request starts with this header, followed by `payload_len` bytes of NULL-separated
+// strings: the working directory, `argc` argv entries, then `envc` environment entries.
+struct zygote_request {
+  uint32_t argc;
+  uint32_t envc;
+  uint32_t payload_len;
+};
+
+// Keep track of which connection is waiting on which child
+struct zygote_child {
+  pid_t pid;
+  int conn_fd;
+  struct zygote_child *prev;
+};
+
+static void write_full(int fd, const void * buff, size_t len) {
+  const char * ptr = (const char *)buff;
+  while (len > 0) {
+    ssize_t n = write(fd, ptr, len);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    check(n > 0);
+    ptr += n;
+    len -= n;
+  }
+}
+
+/* Returns FALSE if the other end hung up before we could read `len` bytes */
+static int read_full(int fd, void * buff, size_t len) {
+  char * ptr = (char *)buff;
+  while (len > 0) {
+    ssize_t n = read(fd, ptr, len);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return FALSE;
+    }
+    ptr += n;
+    len -= n;
+  }
+  return TRUE;
+}
+
+static int zygote_socket(const char * path, struct sockaddr_un * addr) {
+  memset(addr, 0, sizeof(struct sockaddr_un));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path)) {
+    fprintf(stderr, "ERROR: Socket path \"%s\" is too long!\n", path);
+    _exit(1);
+  }
+  strcpy(addr->sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  check(fd != -1);
+  return fd;
+}
+
+/*
+ * Create the listening socket for `--serve`.  We do this before cloning, while we can still
+ * see the host filesystem, so that the socket lives at the path the caller asked for.  The
+ * socket is handed to the calling user, so that a privileged server can be used by
+ * unprivileged clients.
+ */
+static int zygote_listen(const char * path, uid_t uid, gid_t gid) {
+  struct sockaddr_un addr;
+  int fd = zygote_socket(path, &addr);
+  unlink(path);
+  check(0 == bind(fd, (struct sockaddr *)&addr, sizeof(addr)));
+  check(0 == chown(path, uid, gid));
+  check(0 == chmod(path, S_IRUSR | S_IWUSR));
+  check(0 == listen(fd, 128));
+  if (verbose) {
+    fprintf(stderr, "--> Listening for zygote requests on %s\n", path);
+  }
+  return fd;
+}
+
+/* Split `len` bytes of NULL-separated strings into a NULL-terminated list of `n` pointers */
+static char ** split_strings(char ** payload, char * payload_end, uint32_t n) {
+  char ** list = (char **)calloc(n + 1, sizeof(char *));
+  check(list != NULL);
+  for (uint32_t idx=0; idx<n; ++idx) {
+    char * end = memchr(*payload, '\0', payload_end - *payload);
+    if (end == NULL) {
+      free(list);
+      return NULL;
+    }
+    list[idx] = *payload;
+    *payload = end + 1;
+  }
+  return list;
+}
+
+/*
+ * Read a single request off of `conn_fd` and fork off a child to run it, returning the pid
+ * of that child, or -1 if the request was malformed.
+ */
+static pid_t zygote_spawn(int conn_fd, int listen_fd, int signal_fd) {
+  struct zygote_request req;
+  int fds[3];
+  char cmsg_buff[CMSG_SPACE(sizeof(fds))];
+  struct iovec iov = {.iov_base = &req, .iov_len = sizeof(req)};
+  struct msghdr msg = {0};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cmsg_buff;
+  msg.msg_controllen = sizeof(cmsg_buff);
+
+  if (recvmsg(conn_fd, &msg, MSG_CMSG_CLOEXEC) != sizeof(req)) {
+    return -1;
+  }
+  struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+    if (verbose) {
+      fprintf(stderr, "WARNING: zygote request did not carry stdio file descriptors, ignoring\n");
+    }
+    return -1;
+  }
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+  int own_group = !isatty(fds[0]);
+
+  pid_t pid = -1;
+  char * payload = (char *)malloc(req.payload_len);
+  check(payload != NULL);
+  if (req.argc > 0 && read_full(conn_fd, payload, req.payload_len)) {
+    char * payload_ptr = payload;
+    char * payload_end = payload + req.payload_len;
+    char ** cwd = split_strings(&payload_ptr, payload_end, 1);
+    char ** argv = split_strings(&payload_ptr, payload_end, req.argc);
+    char ** envp = split_strings(&payload_ptr, payload_end, req.envc);
+
+    if (cwd != NULL && argv != NULL && envp != NULL) {
+      if ((pid = fork()) == 0) {
+        close(listen_fd);
+        close(signal_fd);
+        if (own_group) {
+          setpgid(0, 0);
+        }
+        sigset_t waitset;
+        sigemptyset(&waitset);
+        sigaddset(&waitset, SIGCHLD);
+        sigprocmask(SIG_UNBLOCK, &waitset, NULL);
+
+        for (int fd_idx=0; fd_idx<3; ++fd_idx) {
+          check(-1 != dup2(fds[fd_idx], fd_idx));
+        }
+        if (cwd[0][0] != '\0') {
+          mkpath(cwd[0]);
+          check(0 == chdir(cwd[0]));
+        }
+        if (verbose) {
+          fprintf(stderr, "About to run `%s` from zygote\n", argv[0]);
+        }
+        install_seccomp();
+        execve(argv[0], argv, envp);
+        fprintf(stderr, "ERROR: Failed to run %s: %d (%s)\n", argv[0], errno, strerror(errno));
+        fflush(stdout);
+        fflush(stderr);
+        _exit(1);
+      }
+      check(pid != -1);
+      // Also from this side, so that the group exists by the time we might have to signal it
+      if (own_group) {
+        setpgid(pid, pid);
+      }
+    }
+    free(cwd);
+    free(argv);
+    free(envp);
+  }
+  free(payload);
+  for (int fd_idx=0; fd_idx<3; ++fd_idx) {
+    close(fds[fd_idx]);
+  }
+  return pid;
+}
+
+/*
+ * The zygote server loop; we act as init for everything we spawn, reaping orphans and
+ * reporting exit codes back to the clients that requested them.  We never return.
+ */
+static void zygote_main(int listen_fd) {
+  struct zygote_child *children = NULL;
+  size_t num_children = 0;
+
+  // Receive SIGCHLD through a file descriptor so that we can poll() on it alongside our sockets
+  sigset_t waitset;
+  sigemptyset(&waitset);
+  sigaddset(&waitset, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &waitset, NULL);
+  int signal_fd = signalfd(-1, &waitset, SFD_CLOEXEC);
+  check(signal_fd != -1);
+
+  for (;;) {
+    // Wait on the listener, SIGCHLD, and a hangup from any client that is still waiting
+    struct pollfd * pfds = (struct pollfd *)calloc(num_children + 2, sizeof(struct pollfd));
+    check(pfds != NULL);
+    pfds[0].fd = listen_fd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = signal_fd;
+    pfds[1].events = POLLIN;
+    size_t pfd_idx = 2;
+    for (struct zygote_child *c = children; c != NULL; c = c->prev) {
+      pfds[pfd_idx].fd = c->conn_fd;
+      pfds[pfd_idx].events = POLLIN | POLLRDHUP;
+      pfd_idx++;
+    }
+    int ret = poll(pfds, pfd_idx, -1);
+    check(ret != -1 || errno == EINTR);
+
+    // A client passed on a signal, or hung up before its command finished, in which case we
+    // kill its command (and whatever that left behind), to reap it below
+    pfd_idx = 2;
+    for (struct zygote_child *c = children; c != NULL; c = c->prev) {
+      if (pfds[pfd_idx].revents != 0) {
+        pid_t target = (getpgid(c->pid) == c->pid) ? -c->pid : c->pid;
+        int32_t sig;
+        if (recv(c->conn_fd, &sig, sizeof(sig), MSG_DONTWAIT) != sizeof(sig)) {
+          sig = SIGKILL;
+        }
+        if (sig == SIGTERM || sig == SIGINT || sig == SIGKILL) {
+          kill(target, sig);
+        }
+      }
+      pfd_idx++;
+    }
+
+    if (pfds[1].revents & POLLIN) {
+      struct signalfd_siginfo info;
+      check(sizeof(info) == read(signal_fd, &info, sizeof(info)));
+
+      int status;
+      pid_t reaped_pid;
+      while ((reaped_pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        struct zygote_child **c_ptr = &children;
+        while (*c_ptr != NULL && (*c_ptr)->pid != reaped_pid) {
+          c_ptr = &(*c_ptr)->prev;
+        }
+        if (*c_ptr == NULL) {
+          // Just an orphan that we inherited
+          continue;
+        }
+        struct zygote_child *c = *c_ptr;
+        int32_t exit_code = exit_code_of(status);
+        if (verbose) {
+          fprintf(stderr, "Zygote child %d exited, exit code %d\n", reaped_pid, exit_code);
+        }
+        // The client may already be gone, so don't die if it doesn't want to hear from us
+        send(c->conn_fd, &exit_code, sizeof(exit_code), MSG_NOSIGNAL);
+        close(c->conn_fd);
+        *c_ptr = c->prev;
+        free(c);
+        num_children--;
+      }
+    }
+
+    if (pfds[0].revents & POLLIN) {
+      int conn_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+      if (conn_fd != -1) {
+        pid_t pid = zygote_spawn(conn_fd, listen_fd, signal_fd);
+        if (pid == -1) {
+          close(conn_fd);
+        } else {
+          struct zygote_child *c = (struct zygote_child *)malloc(sizeof(struct zygote_child));
+          check(c != NULL);
+          c->pid = pid;
+          c->conn_fd = conn_fd;
+          c->prev = children;
+          children = c;
+          num_children++;
+        }
+      }
+    }
+    free(pfds);
+  }
+}
+
+// Our command is a child of the zygote rather than ours, so signals go over the connection.
+// Unlike with commands that are our own children, this includes those from the terminal, as
+// the command isn't in our process group to get them itself.  A command that is still around
+// `kill_timeout` seconds after a SIGTERM has it followed up by a SIGKILL.
+static int zygote_conn_fd = -1;
+
+static void zygote_forward_signal(int sig) {
+  int32_t msg = (sig == SIGALRM) ? SIGKILL : sig;
+  send(zygote_conn_fd, &msg, sizeof(msg), MSG_NOSIGNAL);
+  if (sig == SIGTERM) {
+    struct itimerval timer = {{0, 0}, {(time_t)kill_timeout, (suseconds_t)((kill_timeout - (time_t)kill_timeout) * 1e6)}};
+    if (timer.it_value.tv_sec == 0 && timer.it_value.tv_usec == 0) {
+      timer.it_value.tv_usec = 1;
+    }
+    setitimer(ITIMER_REAL, &timer, NULL);
+  }
+}
+
+/*
+ * Client side of the zygote protocol: send our command, environment and stdio over to the
+ * server listening at `path`, then wait for it to tell us how that command exited.
+ */
+static int zygote_client_main(const char * path, const char * cwd, int argc, char **argv) {
+  struct sockaddr_un addr;
+  int fd = zygote_socket(path, &addr);
+  if (0 != connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+    fprintf(stderr, "ERROR: Unable to connect to zygote at %s: %d (%s)\n", path, errno, strerror(errno));
+    return 1;
+  }
+
+  // Serialize cwd, argv and environ
+  struct zygote_request req = {.argc = argc, .envc = 0, .payload_len = 0};
+  if (cwd == NULL) {
+    cwd = "";
+  }
+  req.payload_len += strlen(cwd) + 1;
+  for (int idx=0; idx<argc; ++idx) {
+    req.payload_len += strlen(argv[idx]) + 1;
+  }
+  for (char **env = environ; *env != NULL; ++env) {
+    req.payload_len += strlen(*env) + 1;
+    req.envc++;
+  }
+  char * payload = (char *)malloc(req.payload_len);
+  check(payload != NULL);
+  char * payload_ptr = stpcpy(payload, cwd) + 1;
+  for (int idx=0; idx<argc; ++idx) {
+    payload_ptr = stpcpy(payload_ptr, argv[idx]) + 1;
+  }
+  for (char **env = environ; *env != NULL; ++env) {
+    payload_ptr = stpcpy(payload_ptr, *env) + 1;
+  }
+
+  // Send the header along with our stdin, stdout and stderr
+  int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+  char cmsg_buff[CMSG_SPACE(sizeof(fds))];
+  memset(cmsg_buff, 0, sizeof(cmsg_buff));
+  struct iovec iov = {.iov_base = &req, .iov_len = sizeof(req)};
+  struct msghdr msg = {0};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cmsg_buff;
+  msg.msg_controllen = sizeof(cmsg_buff);
+  struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+  check(sizeof(req) == sendmsg(fd, &msg, MSG_NOSIGNAL));
+  write_full(fd, payload, req.payload_len);
+  free(payload);
+
+  // Only now that the request is out is there anything to pass signals on to
+  zygote_conn_fd = fd;
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = zygote_forward_signal;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  check(0 == sigaction(SIGTERM, &action, NULL));
+  check(0 == sigaction(SIGINT, &action, NULL));
+  check(0 == sigaction(SIGALRM, &action, NULL));
+
+  int32_t exit_code;
+  if (!read_full(fd, &exit_code, sizeof(exit_code))) {
+    fprintf(stderr, "ERROR: Zygote at %s hung up before reporting an exit code\n", path);
+    return 1;
+  }
+  if (verbose) {
+    fprintf(stderr, "Zygote child exited, exit code %d\n", exit_code);
+  }
+  return exit_code;
+}
 
-  struct map_list *current_entry = workspaces;
-  while( current_entry != NULL ) {
-    char *inside = current_entry->map_path;
+/**** Pinned namespaces *****
+ *
+ * An even lighter alternative to a zygote server: `sandbox --pin <dir>` builds the sandbox
+ * as usual, but its init process just sits there, keeping the user, mount and pid (and
+ * network, if it has its own) namespaces alive.  Once the rootfs is in place, its pid (with
+ * its start time, so that a recycled pid can't be mistaken for it) and its cgroup, if it has
+ * one, are recorded in `<dir>/pid`.  Every `sandbox --join <dir> -- <cmd>` then moves into
+ * that cgroup and `setns()`s straight into those namespaces and forks its command there,
+ * skipping the clone, the uid map and all of the mounting.  Unlike with a zygote, the
+ * command remains our own child, with our environment and stdio.
+ */
 
-    // take the path relative to root_dir
-    while (inside[0] == '/') {
-      inside = inside + 1;
+// Keeps reaping whatever gets orphaned within the pinned namespaces; we never return.
+static void pin_main() {
+  sigset_t waitset;
+  sigemptyset(&waitset);
+  sigaddset(&waitset, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &waitset, NULL);
+  for (;;) {
+    int sig;
+    sigwait(&waitset, &sig);
+    while (waitpid(-1, NULL, WNOHANG) > 0) {
     }
-    snprintf(path, sizeof(path), "%s/%s", dest, inside);
+  }
+}
 
-    // bind-mount the outside path to the inside path
-    bind_mount(current_entry->outside_path, path, read_only);
-    current_entry = current_entry->prev;
+// The start time of `pid` (in clock ticks since boot), which tells apart processes that got
+// the same pid one after the other; 0 if there is no such process.
+static unsigned long long proc_start_time(pid_t pid) {
+  char path[PATH_MAX], buff[1024];
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return 0;
+  }
+  ssize_t n = read(fd, buff, sizeof(buff) - 1);
+  close(fd);
+  buff[n > 0 ? n : 0] = '\0';
+
+  // The command name may contain anything, so count fields from its closing parenthesis on;
+  // the start time is the 20th of them.
+  char * fields = strrchr(buff, ')');
+  unsigned long long start_time = 0;
+  if (fields == NULL || sscanf(fields + 1, "%*s %*s %*s %*s %*s %*s %*s %*s %*s %*s "
+                                           "%*s %*s %*s %*s %*s %*s %*s %*s %*s %llu", &start_time) != 1) {
+    return 0;
+  }
+  return start_time;
+}
+
+// Record the (outside) pid of a pinned sandbox, atomically so that joiners never see half of it
+static void write_pin_file(const char * dir, pid_t pid, uid_t uid, gid_t gid) {
+  char path[PATH_MAX], tmp_path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/pid", dir);
+  snprintf(tmp_path, sizeof(tmp_path), "%s/.pid.%d", dir, getpid());
+  FILE * f = fopen(tmp_path, "w");
+  check(f != NULL);
+  fprintf(f, "%d %llu\n%s\n", pid, proc_start_time(pid), cgroup_path != NULL ? cgroup_path : "");
+  check(0 == fclose(f));
+  int ignored = chown(tmp_path, uid, gid);
+  (void)ignored;
+  check(0 == rename(tmp_path, path));
+  if (verbose) {
+    fprintf(stderr, "--> Pinned sandbox %d at %s\n", pid, dir);
   }
 }
 
 /*
- * Helper function that mounts pretty much everything:
- *   - procfs
- *   - our overlay work directory
- *   - the rootfs
- *   - the shards
- *   - the workspace (if given by the user)
+ * Run a command within the namespaces that `sandbox --pin <dir>` is holding on to, as
+ * `dst_uid`/`dst_gid`, returning its exit code.
  */
-static void mount_the_world(const char * root_dir,
-                            struct map_list * shard_maps,
-                            struct map_list * workspaces,
-                            uid_t uid, gid_t gid,
-                            const char * persist_dir) {
-  // If `persist_dir` is specified, it represents a host directory that should
-  // be used to store our overlayfs work data.  This is where modifications to
-  // the rootfs and such will go.  Typically, these should be ephemeral (and if
-  // `persist_dir` is `NULL`, it will be mounted in a `tmpfs` so that the
-  // modifcations are lost immediately) but if `persist_dir` is given, the
-  // mounting will be done with modifications stored in that directory.
-  // The caller will be responsible for cleaning up the `work` and `upper`
-  // directories wtihin `persist_dir`, but subsequent invocations of `sandbox`
-  // with the same `--persist` argument will allow resuming execution inside of
-  // a rootfs with the previous modifications intact.
-  if (persist_dir == NULL) {
-    // We know that `/proc` will always be available on basically any Linux
-    // system, so we mount our tmpfs here.  It's also convenient because we
-    // will mount an actual `procfs` over this at the end of this function, so
-    // the overlayfs work directories are completely hidden from view.
-    persist_dir = "/proc";
+static int join_main(const char * dir, const char * cwd, uid_t dst_uid, gid_t dst_gid, char **argv) {
+  double join_start = timestamp_ms();
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/pid", dir);
+  FILE * f = fopen(path, "r");
+  pid_t pid = -1;
+  unsigned long long start_time = 0;
+  char cgroup[PATH_MAX] = "";
+  if (f != NULL) {
+    if (fscanf(f, "%d %llu\n", &pid, &start_time) != 2) {
+      pid = -1;
+    } else if (fgets(cgroup, sizeof(cgroup), f) != NULL) {
+      cgroup[strcspn(cgroup, "\n")] = '\0';
+    }
+    fclose(f);
+  }
+  if (pid <= 0) {
+    fprintf(stderr, "ERROR: No pinned sandbox found at %s\n", dir);
+    return 1;
+  }
 
-    // Create tmpfs to store ephemeral changes.  These changes are lost once
-    // the `tmpfs` is unmounted, which occurs when all processes within the
-    // namespace exit and the mount namespace is destroyed.
-    check(0 == mount("tmpfs", "/proc", "tmpfs", 0, "size=1G"));
+  // Open everything up front; once we're within the user namespace, our view of it changes.
+  // The root directory matters if the pinned sandbox had to `chroot()` rather than pivot.
+  static const char * ns_names[] = {"user", "net", "mnt", "pid"};
+  static const int ns_types[] = {CLONE_NEWUSER, CLONE_NEWNET, CLONE_NEWNS, CLONE_NEWPID};
+  int ns_fds[4];
+  for (int ns_idx = 0; ns_idx < 4; ++ns_idx) {
+    snprintf(path, sizeof(path), "/proc/%d/ns/%s", pid, ns_names[ns_idx]);
+    ns_fds[ns_idx] = open(path, O_RDONLY | O_CLOEXEC);
+    if (ns_fds[ns_idx] == -1) {
+      fprintf(stderr, "ERROR: Unable to open %s of the sandbox pinned at %s: %s\n", path, dir, strerror(errno));
+      return 1;
+    }
   }
+  snprintf(path, sizeof(path), "/proc/%d/root", pid);
+  int root_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
 
-  if (verbose) {
-    fprintf(stderr, "--> Creating overlay workdir at %s\n", persist_dir);
+  // If the pinned sandbox is still the process with that pid now, it was so all along, and
+  // what we opened above is its.  Otherwise, it's gone and its pid went to somebody else.
+  if (proc_start_time(pid) != start_time) {
+    fprintf(stderr, "ERROR: The sandbox pinned at %s is no longer running\n", dir);
+    return 1;
   }
 
-  // The first thing we do is create an overlay mounting `root_dir` over itself.
-  // `root_dir` is the path to the already loopback-mounted rootfs image, and we
-  // are mounting it as an overlay over itself, so that we can make modifications
-  // without altering the actual rootfs image.  When running in privileged mode,
-  // we're mounting before cloning, in unprivileged mode, we clone before calling
-  // this mehod at all.sta
-  mount_overlay(root_dir, root_dir, "rootfs", persist_dir, uid, gid);
+  // Commands are contained by the sandbox's cgroup like everything else in it; this has to
+  // happen while we can still see the host's cgroup hierarchy, and our children inherit it.
+  if (cgroup[0] != '\0') {
+    char own_pid[32];
+    snprintf(own_pid, sizeof(own_pid), "%d", getpid());
+    if (!write_cgroup_file(cgroup, "cgroup.procs", own_pid)) {
+      fprintf(stderr, "ERROR: Unable to join cgroup %s of the sandbox pinned at %s: %s\n", cgroup, dir, strerror(errno));
+      return 1;
+    }
+    if (verbose) {
+      fprintf(stderr, "--> Joined cgroup %s\n", cgroup);
+    }
+  }
 
-  // Mount all of our read-only mounts
-  mount_maps(root_dir, shard_maps, TRUE);
+  // Sandboxes without `--network` share our network namespace, which we couldn't re-enter
+  // from within their user namespace; but then again, we don't need to.
+  struct stat own_net, pinned_net;
+  if (0 == stat("/proc/self/ns/net", &own_net) && 0 == fstat(ns_fds[1], &pinned_net) &&
+      own_net.st_dev == pinned_net.st_dev && own_net.st_ino == pinned_net.st_ino) {
+    close(ns_fds[1]);
+    ns_fds[1] = -1;
+  }
 
-  // Mount /proc within the sandbox.
-  mount_procfs(root_dir, uid, gid);
+  // The user namespace denies `setgroups()`, so whatever supplementary groups root had out
+  // here would stick with the command; drop them while we still can.
+  if (execution_mode == PRIVILEGED_CONTAINER_MODE) {
+    check(0 == setgroups(0, NULL));
+  }
+  for (int ns_idx = 0; ns_idx < 4; ++ns_idx) {
+    if (ns_fds[ns_idx] == -1) {
+      continue;
+    }
+    if (0 != setns(ns_fds[ns_idx], ns_types[ns_idx])) {
+      fprintf(stderr, "ERROR: Unable to join the %s namespace of the sandbox pinned at %s: %s\n",
+              ns_names[ns_idx], dir, strerror(errno));
+      return 1;
+    }
+    close(ns_fds[ns_idx]);
+  }
+  if (root_fd != -1) {
+    check(0 == fchdir(root_fd));
+    check(0 == chroot("."));
+    close(root_fd);
+  }
+  check(0 == chdir("/"));
 
-  // Mount /dev stuff
-  mount_dev(root_dir);
+  // In privileged mode, we joined as the outside root; become whom the sandbox runs as.
+  // Unprivileged, the calling user already is that user within the namespace.
+  if (execution_mode == PRIVILEGED_CONTAINER_MODE) {
+    check(0 == setgid(dst_gid));
+    check(0 == setuid(dst_uid));
+  }
+  report_phase("join", join_start);
+
+  // Joining a pid namespace only applies to our children, so the command has to be one
+  pid_t child_pid;
+  if ((child_pid = fork()) == 0) {
+    prctl(PR_SET_PDEATHSIG, SIGKILL, 0, 0, 0);
+    if (cwd != NULL) {
+      mkpath(cwd);
+      check(0 == chdir(cwd));
+    }
+    if (verbose) {
+      fprintf(stderr, "About to run `%s` within pinned sandbox\n", argv[0]);
+    }
+    install_seccomp();
+    execve(argv[0], argv, environ);
+    fprintf(stderr, "ERROR: Failed to run %s: %d (%s)\n", argv[0], errno, strerror(errno));
+    fflush(stdout);
+    fflush(stderr);
+    _exit(1);
+  }
+  check(child_pid != -1);
+  forward_signals_to(child_pid);
 
-  // Mount all our read-write mounts (workspaces)
-  mount_maps(root_dir, workspaces, FALSE);
+  int status;
+  struct rusage usage;
+  check(child_pid == wait4(child_pid, &status, 0, &usage));
+  if (trace_fd != -1) {
+    struct trace_event event;
+    trace_begin(&event, "command_exit");
+    trace_integer(&event, "exit_code", WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+    trace_integer(&event, "signal", WIFSIGNALED(status) ? WTERMSIG(status) : 0);
+    trace_rusage(&event, &usage);
+    trace_end(&event);
+  }
+  if (verbose) {
+    fprintf(stderr, "Pinned sandbox child exited, exit code %d\n", exit_code_of(status));
+  }
+  return exit_code_of(status);
+}
 
-  // Once we're done with that, put /proc back in its place in the big world.
-  // This is not strictly necessary since if all goes well, we're going to
-  // `pivot_root()` into the rootfs, but it helps with debugging.
-  if (strcmp(persist_dir, "/proc") == 0) {
-    mount_procfs("", uid, gid);
+/*
+ * How much space the overlayfs changes currently take up.  For a tmpfs this is cheap to ask
+ * the filesystem itself, anywhere else we have to walk the upper directory.
+ */
+static int scratch_is_tmpfs() {
+  struct statfs st;
+  return scratch_fd != -1 && fstatfs(scratch_fd, &st) == 0 && st.f_type == TMPFS_MAGIC;
+}
+
+static uint64_t scratch_usage() {
+  if (scratch_fd == -1) {
+    return 0;
   }
+  if (scratch_is_tmpfs()) {
+    struct statfs st;
+    check(0 == fstatfs(scratch_fd, &st));
+    return (uint64_t)(st.f_blocks - st.f_bfree) * st.f_bsize;
+  }
+  int upper_fd = openat(scratch_fd, "upper", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  return upper_fd == -1 ? 0 : dir_usage(upper_fd);
+}
+
+/* A tmpfs size is a number, optionally followed by a k, m or g suffix, or a percentage */
+static int valid_tmpfs_size(const char * size) {
+  size_t digits = strspn(size, "0123456789");
+  return digits > 0 && (size[digits] == '\0' ||
+                        (strchr("kKmMgG%", size[digits]) != NULL && size[digits + 1] == '\0'));
 }
 
 /*
  * Sets up the chroot jail, then executes the target executable.
  */
-static int sandbox_main(const char * root_dir, const char * new_cd, int sandbox_argc, char **sandbox_argv) {
+static int sandbox_main(const char * root_dir, const char * new_cd, int serve_fd, int pin_fd, int sandbox_argc, char **sandbox_argv) {
   pid_t pid;
   int status;
 
@@ -483,6 +2438,10 @@ static int sandbox_main(const char * root_dir, const char * new_cd, int sandbox_
   if (verbose) {
     fprintf(stderr, "Entering rootfs at %s\n", root_dir);
   }
+  double pivot_start = timestamp_ms();
+
+  // Paths that `mkpath()` knows about are about to mean something else entirely
+  mkpath_cache_clear();
   check(0 == chdir(root_dir));
   if (syscall(SYS_pivot_root, ".", ".") == 0) {
     // Unmount `.`, which will unmount the old root, since that's the first mountpoint in this directory
@@ -504,6 +2463,19 @@ static int sandbox_main(const char * root_dir, const char * new_cd, int sandbox_
     mkpath(new_cd);
     check(0 == chdir(new_cd));
   }
+  report_phase("pivot", pivot_start);
+
+  // If we're a zygote server, we never run a main pid of our own; we just serve.
+  if (serve_fd != -1) {
+    zygote_main(serve_fd);
+  }
+
+  // Likewise if we're pinned; let whoever is waiting for us know that the world is ready
+  if (pin_fd != -1) {
+    check(1 == write(pin_fd, "", 1));
+    close(pin_fd);
+    pin_main();
+  }
 
   // When the main pid dies, we exit.
   pid_t main_pid;
@@ -516,6 +2488,7 @@ static int sandbox_main(const char * root_dir, const char * new_cd, int sandbox_
       }
       fprintf(stderr, "\n");
     }
+    install_seccomp();
     execve(sandbox_argv[0], sandbox_argv, environ);
     fprintf(stderr, "ERROR: Failed to run %s: %d (%s)\n", sandbox_argv[0], errno, strerror(errno));
 
@@ -525,40 +2498,186 @@ static int sandbox_main(const char * root_dir, const char * new_cd, int sandbox_
     _exit(1);
   }
 
+  // When verbose or tracing, keep an eye on how much scratch space the command uses, so that users
+  // can right-size `--tmpfs-size`.  Peaks are only tracked on tmpfs, where sampling is cheap.
+  int report_usage = (verbose || trace_fd != -1) && scratch_fd != -1;
+  int sample_usage = report_usage && scratch_is_tmpfs();
+  uint64_t peak_usage = 0;
+
   // Let's perform normal init functions, handling signals from orphaned
-  // children, etc
+  // children, etc.  As the init of our pid namespace, signals that we don't have a
+  // handler for are dropped rather than queued, so SIGTERM and SIGINT get one that never
+  // runs, as they are blocked and picked up by `sigtimedwait()` along with SIGCHLD.
   sigset_t waitset;
   sigemptyset(&waitset);
   sigaddset(&waitset, SIGCHLD);
+  sigaddset(&waitset, SIGTERM);
+  sigaddset(&waitset, SIGINT);
   sigprocmask(SIG_BLOCK, &waitset, NULL);
+  signal(SIGTERM, exit_on_signal);
+  signal(SIGINT, exit_on_signal);
+  double kill_deadline = -1;
   for (;;) {
-    int sig;
-    sigwait(&waitset, &sig);
+    // A command that didn't exit in time after a SIGTERM takes everything else down with it
+    if (kill_deadline >= 0 && timestamp_ms() >= kill_deadline) {
+      if (verbose) {
+        fprintf(stderr, "--> Command still running %g seconds after SIGTERM, killing the sandbox\n", kill_timeout);
+      }
+      kill(-1, SIGKILL);
+      kill_deadline = -1;
+    }
+
+    siginfo_t info;
+    if (sample_usage || kill_deadline >= 0) {
+      double wait_ms = 100;
+      if (sample_usage) {
+        uint64_t usage = scratch_usage();
+        peak_usage = usage > peak_usage ? usage : peak_usage;
+      }
+      if (kill_deadline >= 0) {
+        double remaining_ms = kill_deadline - timestamp_ms();
+        if (!sample_usage || remaining_ms < wait_ms) {
+          wait_ms = remaining_ms < 1 ? 1 : remaining_ms;
+        }
+      }
+      long wait_ns = (long)(wait_ms * 1000000);
+      struct timespec interval = {wait_ns / 1000000000, wait_ns % 1000000000};
+      if (sigtimedwait(&waitset, &info, &interval) == -1) {
+        continue;
+      }
+    } else if (sigwaitinfo(&waitset, &info) == -1) {
+      continue;
+    }
+
+    if (info.si_signo == SIGTERM || info.si_signo == SIGINT) {
+      if (sent_by_process(&info)) {
+        if (verbose) {
+          fprintf(stderr, "--> Forwarding signal %d to the command\n", info.si_signo);
+        }
+        kill(main_pid, info.si_signo);
+      }
+      if (info.si_signo == SIGTERM && kill_deadline < 0) {
+        kill_deadline = timestamp_ms() + kill_timeout * 1000;
+      }
+      continue;
+    }
 
     pid_t reaped_pid;
-    while ((reaped_pid = waitpid(-1, &status, 0)) != -1) {
+    struct rusage command_usage;
+    while ((reaped_pid = wait4(-1, &status, WNOHANG, &command_usage)) > 0) {
       if (reaped_pid == main_pid) {
         // If it was the main pid that exited, return as well.
-        return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+        if (report_usage) {
+          uint64_t current_usage = scratch_usage();
+          peak_usage = current_usage > peak_usage ? current_usage : peak_usage;
+          if (verbose) {
+            fprintf(stderr, "--> %s scratch usage: %llu bytes\n", sample_usage ? "Peak" : "Final",
+                    (unsigned long long)peak_usage);
+          }
+          if (trace_fd != -1) {
+            struct trace_event event;
+            trace_begin(&event, "scratch");
+            trace_integer(&event, "bytes", (long long)peak_usage);
+            trace_printf(&event, "peak = %s\n", sample_usage ? "true" : "false");
+            trace_end(&event);
+          }
+        }
+        if (trace_fd != -1) {
+          struct trace_event event;
+          trace_begin(&event, "command_exit");
+          trace_integer(&event, "exit_code", WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+          trace_integer(&event, "signal", WIFSIGNALED(status) ? WTERMSIG(status) : 0);
+          trace_rusage(&event, &command_usage);
+          trace_end(&event);
+        }
+
+        // Anything else still running within our pid namespace dies with us anyway; take care
+        // of that ourselves, so that its resource usage is reaped into ours (and our parent's).
+        kill(-1, SIGKILL);
+        while (waitpid(-1, NULL, 0) > 0 || errno == EINTR) {
+        }
+        return exit_code_of(status);
       }
     }
   }
 }
 
+/**** Argument files *****
+ *
+ * Configs with a lot of maps can run into the kernel's limits on the size of our argv, so
+ * instead of being passed directly, our options may be stored in a file of NUL-terminated
+ * arguments; `--args-file <path>` as our very first option splices them in its place.
+ */
+static void splice_args_file(int * argc, char *** argv) {
+  if (*argc < 3 || strcmp((*argv)[1], "--args-file") != 0) {
+    return;
+  }
+  int fd = open((*argv)[2], O_RDONLY | O_CLOEXEC);
+  check(fd != -1);
+  struct stat st;
+  check(fstat(fd, &st) == 0);
+  char * contents = (char *)malloc(st.st_size + 1);
+  check(contents != NULL);
+  check(st.st_size == 0 || read_full(fd, contents, st.st_size));
+  close(fd);
+  contents[st.st_size] = '\0';
+
+  int num_args = 0;
+  for (off_t idx = 0; idx < st.st_size; ++idx) {
+    num_args += contents[idx] == '\0';
+  }
+  if (st.st_size > 0 && contents[st.st_size - 1] != '\0') {
+    num_args += 1;
+  }
+
+  // argv[0], then the spliced arguments, then whatever came after `--args-file <path>`
+  char ** new_argv = (char **)malloc((*argc - 2 + num_args + 1) * sizeof(char *));
+  check(new_argv != NULL);
+  new_argv[0] = (*argv)[0];
+  char * arg = contents;
+  for (int arg_idx = 0; arg_idx < num_args; ++arg_idx) {
+    new_argv[1 + arg_idx] = arg;
+    arg += strlen(arg) + 1;
+  }
+  for (int arg_idx = 3; arg_idx < *argc; ++arg_idx) {
+    new_argv[num_args + arg_idx - 2] = (*argv)[arg_idx];
+  }
+  *argc = *argc - 2 + num_args;
+  new_argv[*argc] = NULL;
+  *argv = new_argv;
+}
+
 static void print_help() {
   fputs("Usage: sandbox --rootfs <dir> [--cd <dir>] ", stderr);
   fputs("[--map <from>:<to>, --map <from>:<to>, ...] ", stderr);
   fputs("[--workspace <from>:<to>, --workspace <from>:<to>, ...] ", stderr);
-  fputs("[--persist <work_dir>] ", stderr);
+  fputs("[--persist <work_dir> | --scratch-dir <dir>] ", stderr);
+  fputs("[--layer <dir>]... ", stderr);
+  fputs("[--tmpfs-size <size>] [--tmpfs-huge] ", stderr);
+  fputs("[--trace-file <path>] ", stderr);
+  fputs("[--cgroup <parent>] [--cpus <n>] [--memory <bytes>] [--io-max \"<maj:min> <limits>\"] ", stderr);
+  fputs("[--cpuset <cpus>] [--numa <nodes>] ", stderr);
+  fputs("[--network none|loopback|veth] [--seccomp <bpf_file>] ", stderr);
+  fputs("[--kill-timeout <seconds>] [--die-with-parent] ", stderr);
   fputs("[--entrypoint <exe_path>] ", stderr);
   fputs("[--verbose] [--help] <cmd>\n", stderr);
+  fputs("       sandbox --rootfs <dir> [...] --serve <socket>\n", stderr);
+  fputs("       sandbox --connect <socket> [--cd <dir>] [--entrypoint <exe_path>] <cmd>\n", stderr);
+  fputs("       sandbox --rootfs <dir> [...] --pin <dir>\n", stderr);
+  fputs("       sandbox --join <dir> [--uid <uid>] [--gid <gid>] [--seccomp <bpf_file>] [--cd <dir>] [--entrypoint <exe_path>] <cmd>\n", stderr);
+  fputs("       sandbox [--verbose] --cleanup <work_dir>\n", stderr);
+  fputs("       sandbox --args-file <file> [<option>...] <cmd>\n", stderr);
+  fputs("\nThe --rootfs, --layer and --map sources may also be squashfs or erofs images.\n", stderr);
+  fputs("Each --layer is stacked on top of the rootfs (and of the layers before it).\n", stderr);
+  fputs("In privileged mode, a --rootfs or --layer owned by another user is idmapped to the caller.\n", stderr);
+  fputs("An --args-file holds NUL-terminated options, which are read as if they had been given in its place.\n", stderr);
+  fputs("SIGTERM and SIGINT are forwarded to <cmd>; --kill-timeout (default 5) seconds after a SIGTERM, the whole sandbox is killed.\n", stderr);
+  fputs("--network gives the sandbox its own network namespace instead of the host's (veth is privileged only).\n", stderr);
   fputs("\nExample:\n", stderr);
   fputs("  mkdir -p /tmp/workspace\n", stderr);
   fputs("  /tmp/sandbox --verbose --rootfs $rootfs_path --workspace /tmp/workspace:/workspace --cd /workspace /bin/bash\n", stderr);
 }
 
-static void sigint_handler() { _exit(0); }
-
 /*
  * Let's get this party started.
  */
@@ -566,6 +2685,9 @@ int main(int sandbox_argc, char **sandbox_argv) {
   int status = 0;
   pid_t pgrp = getpgid(0);
   char * entrypoint = NULL;
+  char * trace_path = NULL;
+  double sandbox_start = timestamp_ms();
+  splice_args_file(&sandbox_argc, &sandbox_argv);
 
   // First, determine our execution mode based on pid and euid (allowing for override)
   const char * forced_mode = getenv("FORCE_SANDBOX_MODE");
@@ -625,6 +2747,26 @@ int main(int sandbox_argc, char **sandbox_argv) {
       {"map",        required_argument, NULL, 'm'},
       {"uid",        required_argument, NULL, 'u'},
       {"gid",        required_argument, NULL, 'g'},
+      {"serve",      required_argument, NULL, 'S'},
+      {"connect",    required_argument, NULL, 'C'},
+      {"tmpfs-size", required_argument, NULL, 'T'},
+      {"tmpfs-huge", no_argument,       NULL, 'H'},
+      {"scratch-dir", required_argument, NULL, 'D'},
+      {"trace-file", required_argument, NULL, 't'},
+      {"cgroup",     required_argument, NULL, 'G'},
+      {"cpus",       required_argument, NULL, 'P'},
+      {"memory",     required_argument, NULL, 'M'},
+      {"io-max",     required_argument, NULL, 'I'},
+      {"cpuset",     required_argument, NULL, 'U'},
+      {"numa",       required_argument, NULL, 'N'},
+      {"cleanup",    required_argument, NULL, 'X'},
+      {"layer",      required_argument, NULL, 'L'},
+      {"pin",        required_argument, NULL, 'K'},
+      {"network",    required_argument, NULL, 'n'},
+      {"seccomp",    required_argument, NULL, 'F'},
+      {"join",       required_argument, NULL, 'J'},
+      {"kill-timeout", required_argument, NULL, 'k'},
+      {"die-with-parent", no_argument,   NULL, 'W'},
       {0, 0, 0, 0}
     };
 
@@ -721,6 +2863,133 @@ int main(int sandbox_argc, char **sandbox_argv) {
       case 'e':
         entrypoint = strdup(optarg);
         break;
+      case 'S':
+        serve_path = strdup(optarg);
+        if (verbose) {
+          fprintf(stderr, "Parsed --serve as \"%s\"\n", serve_path);
+        }
+        break;
+      case 'C':
+        connect_path = strdup(optarg);
+        if (verbose) {
+          fprintf(stderr, "Parsed --connect as \"%s\"\n", connect_path);
+        }
+        break;
+      case 'T':
+        tmpfs_size = strdup(optarg);
+        // It goes into the tmpfs mount options, so don't let it smuggle in any others
+        if (!valid_tmpfs_size(tmpfs_size)) {
+          fprintf(stderr, "ERROR: Invalid --tmpfs-size \"%s\", expected a number with an optional k, m, g or %% suffix\n", tmpfs_size);
+          return 1;
+        }
+        if (verbose) {
+          fprintf(stderr, "Parsed --tmpfs-size as \"%s\"\n", tmpfs_size);
+        }
+        break;
+      case 'H':
+        tmpfs_huge = 1;
+        break;
+      case 'G':
+        cgroup_parent = strdup(optarg);
+        break;
+      case 'P':
+        cgroup_cpus = strdup(optarg);
+        break;
+      case 'M':
+        cgroup_memory = strdup(optarg);
+        break;
+      case 'I':
+        if (cgroup_io_max_count == MAX_IO_LIMITS) {
+          fprintf(stderr, "ERROR: Too many --io-max limits, ignoring \"%s\"\n", optarg);
+          break;
+        }
+        cgroup_io_max[cgroup_io_max_count++] = strdup(optarg);
+        break;
+      case 'U':
+        cgroup_cpuset = strdup(optarg);
+        break;
+      case 'N':
+        cgroup_numa = strdup(optarg);
+        break;
+      case 't':
+        trace_path = strdup(optarg);
+        if (verbose) {
+          fprintf(stderr, "Parsed --trace-file as \"%s\"\n", trace_path);
+        }
+        break;
+      case 'L':
+        if (num_layers == MAX_LAYERS) {
+          fprintf(stderr, "ERROR: Too many --layer directories (at most %d)\n", MAX_LAYERS);
+          return 1;
+        }
+        layers[num_layers] = realpath(optarg, NULL);
+        if (layers[num_layers] == NULL) {
+          fprintf(stderr, "ERROR: Unable to resolve --layer \"%s\": %d (%s)\n", optarg, errno, strerror(errno));
+          return 1;
+        }
+        if (verbose) {
+          fprintf(stderr, "Parsed --layer as \"%s\"\n", layers[num_layers]);
+        }
+        num_layers++;
+        break;
+      case 'K':
+        pin_dir = strdup(optarg);
+        if (verbose) {
+          fprintf(stderr, "Parsed --pin as \"%s\"\n", pin_dir);
+        }
+        break;
+      case 'J':
+        join_dir = strdup(optarg);
+        if (verbose) {
+          fprintf(stderr, "Parsed --join as \"%s\"\n", join_dir);
+        }
+        break;
+      case 'k': {
+        char * end;
+        kill_timeout = strtod(optarg, &end);
+        check(end != optarg && *end == '\0' && kill_timeout >= 0);
+        if (verbose) {
+          fprintf(stderr, "Parsed --kill-timeout as %g seconds\n", kill_timeout);
+        }
+      } break;
+      case 'W':
+        die_with_parent = TRUE;
+        if (verbose) {
+          fprintf(stderr, "Parsed --die-with-parent\n");
+        }
+        break;
+      case 'n':
+        if (strcmp(optarg, "none") == 0) {
+          network_mode = NETWORK_NONE;
+        } else if (strcmp(optarg, "loopback") == 0) {
+          network_mode = NETWORK_LOOPBACK;
+        } else if (strcmp(optarg, "veth") == 0) {
+          network_mode = NETWORK_VETH;
+        } else {
+          fprintf(stderr, "ERROR: Unknown --network mode \"%s\", expected none, loopback or veth\n", optarg);
+          return 1;
+        }
+        if (verbose) {
+          fprintf(stderr, "Parsed --network as \"%s\"\n", optarg);
+        }
+        break;
+      case 'F':
+        if (!load_seccomp(optarg)) {
+          return 1;
+        }
+        break;
+      case 'X':
+        cleanup_path = strdup(optarg);
+        if (verbose) {
+          fprintf(stderr, "Parsed --cleanup as \"%s\"\n", cleanup_path);
+        }
+        break;
+      case 'D':
+        scratch_dir = strdup(optarg);
+        if (verbose) {
+          fprintf(stderr, "Parsed --scratch-dir as \"%s\"\n", scratch_dir);
+        }
+        break;
       default:
         fputs("getoptlong defaulted?!\n", stderr);
         return 1;
@@ -731,6 +3000,20 @@ int main(int sandbox_argc, char **sandbox_argv) {
   sandbox_argv += optind;
   sandbox_argc -= optind;
 
+  // Follow our parent if asked to; should it be gone already, right away
+  if (die_with_parent) {
+    pid_t parent_pid = getppid();
+    check(0 == prctl(PR_SET_PDEATHSIG, SIGKILL, 0, 0, 0));
+    if (getppid() != parent_pid) {
+      _exit(128 + SIGKILL);
+    }
+  }
+
+  // Cleaning up doesn't need a command, or any namespaces
+  if (cleanup_path != NULL) {
+    return cleanup_main(cleanup_path);
+  }
+
   // If we were given an entrypoint, push that onto the front of `sandbox_argv`
   if (entrypoint != NULL) {
     // Yes, we clobber sandbox_argv[-1] here; but we already know that `optind` >= 2
@@ -740,13 +3023,27 @@ int main(int sandbox_argc, char **sandbox_argv) {
     sandbox_argv[0] = entrypoint;
   }
 
-  // If we don't have a command, die
-  if (sandbox_argc == 0) {
+  // If we don't have a command, die (zygote servers receive theirs later, pinned sandboxes never)
+  if (sandbox_argc == 0 && serve_path == NULL && pin_dir == NULL) {
     fputs("No <cmd> given!\n", stderr);
     print_help();
     return 1;
   }
 
+  // Get our maps into mounting order
+  maps = sort_maps(maps);
+  workspaces = sort_maps(workspaces);
+
+  // Zygote clients don't set anything up themselves, they just pass the command along
+  if (connect_path != NULL) {
+    return zygote_client_main(connect_path, new_cd, sandbox_argc, sandbox_argv);
+  }
+
+  // Neither do those joining a pinned sandbox
+  if (join_dir != NULL) {
+    return join_main(join_dir, new_cd, dst_uid, dst_gid, sandbox_argv);
+  }
+
   // If we haven't been given a sandbox root, die
   if (!sandbox_root) {
     fputs("--rootfs is required!\n", stderr);
@@ -754,13 +3051,69 @@ int main(int sandbox_argc, char **sandbox_argv) {
     return 1;
   }
 
+  if (network_mode == NETWORK_VETH && execution_mode != PRIVILEGED_CONTAINER_MODE) {
+    fputs("--network veth requires privileged mode!\n", stderr);
+    return 1;
+  }
+
+  // Events get appended, so that one trace file can collect many runs.  Both the parent and the
+  // child write to it, but it is never inherited by the command that we run.
+  if (trace_path != NULL) {
+    trace_fd = open(trace_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (trace_fd == -1) {
+      fprintf(stderr, "ERROR: Unable to open trace file %s: %s\n", trace_path, strerror(errno));
+      return 1;
+    }
+    // If we're running as root for somebody else, let them have their trace
+    int ignored = fchown(trace_fd, uid, gid);
+    (void)ignored;
+
+    struct trace_event event;
+    trace_begin(&event, "start");
+    trace_integer(&event, "pid", getpid());
+    trace_string(&event, "mode", execution_mode == PRIVILEGED_CONTAINER_MODE ? "privileged" : "unprivileged");
+    trace_end(&event);
+  }
+
+  // A disk-backed scratch directory is just a `--persist` directory that we delete afterwards
+  char * scratch_path = NULL;
+  if (scratch_dir != NULL) {
+    if (persist_dir != NULL) {
+      fputs("--persist and --scratch-dir are mutually exclusive!\n", stderr);
+      return 1;
+    }
+    char template[PATH_MAX];
+    snprintf(template, sizeof(template), "%s/sandbox-scratch-XXXXXX", scratch_dir);
+    mkpath(scratch_dir);
+    check(NULL != mkdtemp(template));
+    scratch_path = strdup(template);
+    persist_dir = scratch_path;
+    if (verbose) {
+      fprintf(stderr, "--> Using scratch directory %s\n", scratch_path);
+    }
+  }
+
+  // Set up our cgroup while we can still see the host's cgroup hierarchy
+  if (use_cgroup()) {
+    create_cgroup();
+  }
+
+  // If we're going to be a zygote server, start listening before we lose sight of the host
+  int serve_fd = -1;
+  if (serve_path != NULL) {
+    serve_fd = zygote_listen(serve_path, uid, gid);
+  }
+
   // If we're running in one of the container modes, we're going to syscall() ourselves a
   // new, cloned process that is in a container process. We will use a pipe for synchronization.
   // The regular SIGSTOP method does not work because container-inits don't receive STOP or KILL
   // signals from within their own pid namespace.
-  int child_block[2], parent_block[2];
+  int child_block[2], parent_block[2], pin_block[2] = {-1, -1};
   check(0 == pipe(child_block));
   check(0 == pipe(parent_block));
+  if (pin_dir != NULL) {
+    check(0 == pipe(pin_block));
+  }
   pid_t pid;
 
   if (execution_mode == PRIVILEGED_CONTAINER_MODE) {
@@ -774,19 +3127,40 @@ int main(int sandbox_argc, char **sandbox_argv) {
     // any subtrees of `/` (e.g. everything) from propagating back to the outside `/`.
     check(0 == mount(NULL, "/", NULL, MS_PRIVATE|MS_REC, NULL));
 
+    // Make trees that belong to somebody else look like they belong to the calling user
+    // (and therefore to `dst_uid` within the sandbox).  This has to happen before the
+    // tmpfs for our changes covers up `/proc`.
+    double idmap_start = timestamp_ms();
+    idmap_in_place(sandbox_root, uid, gid);
+    for (int layer_idx = 0; layer_idx < num_layers; ++layer_idx) {
+      idmap_in_place(layers[layer_idx], uid, gid);
+    }
+    report_phase("idmap", idmap_start);
+
     // Mount the rootfs, shards, and workspace.  We do this here because, on this machine,
     // we may not have permissions to mount overlayfs within user namespaces.
-    mount_the_world(sandbox_root, maps, workspaces, uid, gid, persist_dir);
+    sandbox_root = mount_the_world(sandbox_root, maps, workspaces, uid, gid, persist_dir);
+
+    // Our child inherits our supplementary groups, and can't drop them itself once it is in
+    // its user namespace (which denies `setgroups()`), so do it for it.
+    check(0 == setgroups(0, NULL));
   }
 
   // We want to request a new PID space, a new mount space, and a new user space
+  double clone_start = timestamp_ms();
   int clone_flags = CLONE_NEWPID | CLONE_NEWNS | CLONE_NEWUSER | SIGCHLD;
+  if (network_mode != NETWORK_HOST) {
+    clone_flags |= CLONE_NEWNET;
+  }
   if ((pid = syscall(SYS_clone, clone_flags, 0, 0, 0, 0)) == 0) {
     // If we're in here, we have become the "child" process, within the container.
 
     // Get rid of the ends of the synchronization pipe that I'm not going to use
     close(child_block[1]);
     close(parent_block[0]);
+    if (pin_block[0] != -1) {
+      close(pin_block[0]);
+    }
 
     // N.B: Capabilities in the original user namespaces are now dropped
     // The kernel may have decided to reset our dumpability, because of
@@ -795,21 +3169,31 @@ int main(int sandbox_argc, char **sandbox_argv) {
     // to configure the sandbox, so reset dumpability.
     prctl(PR_SET_DUMPABLE, 1, 0, 0, 0);
 
-    // Make sure ^C actually kills this process. By default init ignores
-    // all signals.
-    signal(SIGINT, sigint_handler);
+    // Make sure ^C (or a SIGTERM) actually kills this process while we are setting up.
+    // By default init ignores all signals.
+    signal(SIGINT, exit_on_signal);
+    signal(SIGTERM, exit_on_signal);
 
     // Tell the parent we're ready, and wait until it signals that it's done
-    // setting up our PID/GID mapping in configure_user_namespace()
+    // setting up our PID/GID mapping in configure_user_namespace(), by telling us
+    // what our pid is out there.
     close(parent_block[1]);
-    check(0 == read(child_block[0], NULL, 1));
+    pid_t outside_pid;
+    check(sizeof(outside_pid) == read(child_block[0], &outside_pid, sizeof(outside_pid)));
+
+    // We still have all capabilities within our namespaces, whatever uid we will end up as
+    double network_start = timestamp_ms();
+    configure_network_inside(outside_pid);
+    if (network_mode != NETWORK_HOST) {
+      report_phase("network", network_start);
+    }
 
     if (execution_mode == PRIVILEGED_CONTAINER_MODE) {
       // If we are in privileged container mode, let's go ahead and drop back
       // to the original calling user's UID and GID, which has been mapped to
       // the requested uid/gids (defaulting to zero) within this container.
-      check(0 == setuid(dst_uid));
       check(0 == setgid(dst_gid));
+      check(0 == setuid(dst_uid));
 
       // The /proc mountpoint previously mounted is in the wrong PID namespace;
       // mount a new procfs over it to to get better values:
@@ -817,11 +3201,17 @@ int main(int sandbox_argc, char **sandbox_argv) {
     } else if (execution_mode == UNPRIVILEGED_CONTAINER_MODE) {
       // If we're in unprivileged container mode, mount the world now that we
       // have supreme cosmic power.
-      mount_the_world(sandbox_root, maps, workspaces, dst_uid, dst_gid, persist_dir);
+      sandbox_root = mount_the_world(sandbox_root, maps, workspaces, dst_uid, dst_gid, persist_dir);
     }
 
+    // Make sure that we (and with us, everything in the sandbox) die along with the
+    // `sandbox` process that our caller is tracking, even if it gets SIGKILLed, rather than
+    // lingering on forever; zygote servers in particular outlive any single command.
+    // Note that this must happen after `setuid()`, which clears the parent death signal.
+    prctl(PR_SET_PDEATHSIG, SIGKILL, 0, 0, 0);
+
     // Finally, we begin invocation of the target program.
-    return sandbox_main(sandbox_root, new_cd, sandbox_argc, sandbox_argv);
+    return sandbox_main(sandbox_root, new_cd, serve_fd, pin_block[1], sandbox_argc, sandbox_argv);
   }
 
   // If we're out here, we are still the "parent" process.  The Prestige lives on.
@@ -830,26 +3220,96 @@ int main(int sandbox_argc, char **sandbox_argv) {
   check(pid != -1);
 
   // Get rid of the ends of the synchronization pipe that I'm not going to use.
+  if (serve_fd != -1) {
+    close(serve_fd);
+  }
   close(child_block[0]);
   close(parent_block[1]);
 
   // Wait until the child is ready to be configured.
   check(0 == read(parent_block[0], NULL, 1));
+  report_phase("clone", clone_start);
+  if (trace_fd != -1) {
+    struct trace_event event;
+    trace_begin(&event, "child");
+    trace_integer(&event, "pid", pid);
+    trace_end(&event);
+  }
   if (verbose) {
     fprintf(stderr, "Child Process PID is %d\n", pid);
   }
 
   // Configure user namespace for the child PID.
+  double uid_map_start = timestamp_ms();
   configure_user_namespace(pid, uid, gid, dst_uid, dst_gid);
+  report_phase("uid map", uid_map_start);
+
+  // The child is still waiting on us, so it (and everything it will start) is contained right
+  // from the beginning.  If we can't contain it, it must not run at all.
+  if (cgroup_path != NULL) {
+    double cgroup_start = timestamp_ms();
+    char pid_str[32];
+    snprintf(pid_str, sizeof(pid_str), "%d", pid);
+    if (!write_cgroup_file(cgroup_path, "cgroup.procs", pid_str)) {
+      fprintf(stderr, "ERROR: Unable to move the sandbox into cgroup %s: %s\n", cgroup_path, strerror(errno));
+      kill(pid, SIGKILL);
+      waitpid(pid, NULL, 0);
+      rmdir(cgroup_path);
+      return 1;
+    }
+    report_phase("cgroup", cgroup_start);
+  }
+
+  // Connect the child to the host, if asked to
+  double network_start = timestamp_ms();
+  configure_network_outside(pid);
+  if (network_mode == NETWORK_VETH) {
+    report_phase("veth", network_start);
+  }
 
   // Signal to the child that it can now continue running.
+  check(sizeof(pid) == write(child_block[1], &pid, sizeof(pid)));
   close(child_block[1]);
 
-  // Wait until the child exits.
-  check(pid == waitpid(pid, &status, 0));
-  check(WIFEXITED(status));
+  // A pinned sandbox can be joined once it has pivoted into its rootfs; if it dies before
+  // that, we just never record it, and end up reporting its exit code below.
+  if (pin_dir != NULL) {
+    close(pin_block[1]);
+    char ready;
+    if (1 == read(pin_block[0], &ready, 1)) {
+      write_pin_file(pin_dir, pid, uid, gid);
+    }
+    close(pin_block[0]);
+  }
+
+  // If we get terminated, pass it on to the sandbox and let it wind down (rather than just
+  // dying and orphaning it), so that we still get to clean up afterwards.
+  forward_signals_to(pid);
+
+  // Wait until the child exits.  Its resource usage includes that of everything it reaped,
+  // which as the init of its pid namespace, is everything that ran within the sandbox.
+  struct rusage usage;
+  check(pid == wait4(pid, &status, 0, &usage));
+  if (cgroup_path != NULL) {
+    finish_cgroup();
+  }
+  if (trace_fd != -1) {
+    struct trace_event event;
+    trace_begin(&event, "exit");
+    trace_integer(&event, "exit_code", WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+    trace_integer(&event, "signal", WIFSIGNALED(status) ? WTERMSIG(status) : 0);
+    trace_number(&event, "wall_ms", timestamp_ms() - sandbox_start);
+    trace_rusage(&event, &usage);
+    trace_end(&event);
+  }
+  if (scratch_path != NULL) {
+    if (verbose) {
+      fprintf(stderr, "--> Removing scratch directory %s\n", scratch_path);
+    }
+    remove_tree_at(AT_FDCWD, scratch_path);
+  }
   if (verbose) {
-    fprintf(stderr, "Child Process exited, exit code %d\n", WEXITSTATUS(status));
+    fprintf(stderr, "Child Process exited, exit code %d\n", exit_code_of(status));
   }
 
   // Give back the terminal to the parent
@@ -857,5 +3317,5 @@ int main(int sandbox_argc, char **sandbox_argv) {
   tcsetpgrp(0, pgrp);
 
   // Return the error code of the child
-  return WEXITSTATUS(status);
+  return exit_code_of(status);
 }
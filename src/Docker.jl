@@ -1,11 +1,30 @@
-using Random, Tar
+using Random, Tar, SHA
 
+"""
+    DockerExecutor(; label, privileges = :privileged, reuse_container = false)
+
+Runs each command in a docker container built from the config's rootfs.  By default
+every command is a fresh `docker run`; with `reuse_container = true` the executor keeps
+one long-running container (with `sleep infinity` as PID 1) per set of mounts, limits,
+network and seccomp policy, and issues commands to it with `docker exec`.  As with
+zygotes, all commands share that container's filesystem, so changes made by one run are
+visible to the next until `cleanup()` removes the container.
+"""
 Base.@kwdef struct DockerExecutor <: SandboxExecutor
     label::String = Random.randstring(10)
     privileges::Symbol = :privileged
+    reuse_container::Bool = false
+    containers::Dict{UInt64,String} = Dict{UInt64,String}()
+    containers_lock::ReentrantLock = ReentrantLock()
 end
 
 function cleanup(exe::DockerExecutor)
+    lock(exe.containers_lock) do
+        if !isempty(exe.containers)
+            success(`docker rm --force $(collect(values(exe.containers)))`)
+            empty!(exe.containers)
+        end
+    end
     success(`docker system prune --force --filter=label=$(docker_image_label(exe))`)
 end
 
@@ -27,8 +46,10 @@ function executor_available(::Type{DockerExecutor}; verbose::Bool = false)
         end
         return false
     end
-    return with_executor(DockerExecutor) do exe
-        return probe_executor(exe; test_read_only_map=true, test_read_write_map=true, verbose)
+    return cached_availability(DockerExecutor) do
+        with_executor(DockerExecutor) do exe
+            return probe_executor(exe; test_read_only_map=true, test_read_write_map=true, verbose)
+        end
     end
 end
 
@@ -57,53 +78,331 @@ function save_timestamp(image_name::String, timestamp::Float64)
     end
 end
 
-docker_image_name(root_path::String, uid::Cint, gid::Cint) = "sandbox_rootfs:$(string(Base._crc32c(root_path), base=16))-$(uid)-$(gid)"
+# Alongside the timestamps, we keep the full `scan_directory()` index that each image
+# was built from, so that we can tell exactly which subtrees changed since then.
+rootfs_indices_path() = joinpath(@get_scratch!("docker_timestamp_hashes"), "rootfs_indices.toml")
+function load_rootfs_indices()
+    path = rootfs_indices_path()
+    if !isfile(path)
+        return Dict{String,Any}()
+    end
+    try
+        return TOML.parsefile(path)
+    catch e
+        @error("couldn't load $(path)", exception=e)
+        return Dict{String,Any}()
+    end
+end
+
+function load_rootfs_index(image_name::String)
+    index = Dict{String,SubtreeFingerprint}()
+    for (name, fp) in get(load_rootfs_indices(), image_name, Dict{String,Any}())
+        try
+            index[name] = SubtreeFingerprint(
+                fp["num_entries"],
+                fp["total_size"],
+                fp["max_ctime"],
+                parse(UInt64, fp["inode_hash"]; base=16),
+            )
+        catch
+            # If we can't make sense of an entry, it simply counts as changed
+        end
+    end
+    return index
+end
+
+function save_rootfs_index(image_name::String, index::Dict{String,SubtreeFingerprint})
+    indices_toml = sprint() do io
+        indices = load_rootfs_indices()
+        indices[image_name] = Dict(name => Dict(
+            "num_entries" => fp.num_entries,
+            "total_size" => fp.total_size,
+            "max_ctime" => fp.max_ctime,
+            "inode_hash" => string(fp.inode_hash, base=16),
+        ) for (name, fp) in index)
+        TOML.print(io, indices)
+    end
+    open(rootfs_indices_path(), write=true) do io
+        write(io, indices_toml)
+    end
+end
+
+function docker_image_name(root_path::String, uid::Cint, gid::Cint; rootfs_layers::Vector{String} = String[])
+    return "sandbox_rootfs:$(string(Base._crc32c(join([root_path; rootfs_layers], ":")), base=16))-$(uid)-$(gid)"
+end
 docker_image_label(exe::DockerExecutor) = string("org.julialang.sandbox.jl=", exe.label)
-function should_build_docker_image(root_path::String, uid::Cint, gid::Cint)
-    # If the image doesn't exist at all, always return true
-    image_name = docker_image_name(root_path, uid, gid)
+
+# A layered rootfs is indexed as a whole, with the entries of every layer kept apart by
+# prefixing them with the number of their layer.
+function rootfs_index(tree_indices::Vector{Dict{String,SubtreeFingerprint}})
+    index = copy(first(tree_indices))
+    for (layer_idx, tree_index) in enumerate(tree_indices[2:end])
+        for (name, fp) in tree_index
+            index["layer-$(layer_idx)/$(name)"] = fp
+        end
+    end
+    return index
+end
+rootfs_index(root_path::String, rootfs_layers::Vector{String}) = rootfs_index([scan_directory(tree) for tree in [root_path; rootfs_layers]])
+
+"""
+    docker_image_changes(root_path::String, uid::Cint, gid::Cint; rootfs_layers = String[],
+                         index = rootfs_index(root_path, rootfs_layers))
+
+Returns the top-level entries of `root_path` (and of its `rootfs_layers`) that changed
+since the docker image for it was last built, or `nothing` if that image does not exist.
+"""
+function docker_image_changes(root_path::String, uid::Cint, gid::Cint;
+                              rootfs_layers::Vector{String} = String[],
+                              index::Dict{String,SubtreeFingerprint} = rootfs_index(root_path, rootfs_layers))
+    image_name = docker_image_name(root_path, uid, gid; rootfs_layers)
     if !success(`docker image inspect $(image_name)`)
-        return true
+        return nothing
     end
 
-    # If this image has been built before, compare its historical timestamp to the current one
-    curr_ctime = max_directory_ctime(root_path)
-    prev_ctime = get(load_timestamps(), image_name, 0.0)
-    return curr_ctime != prev_ctime
+    # If this image has been built before, compare its historical index to the current one
+    return changed_subtrees(load_rootfs_index(image_name), index)
+end
+
+function should_build_docker_image(root_path::String, uid::Cint, gid::Cint;
+                                   rootfs_layers::Vector{String} = String[],
+                                   index::Dict{String,SubtreeFingerprint} = rootfs_index(root_path, rootfs_layers))
+    # If the image doesn't exist at all, always return true
+    changes = docker_image_changes(root_path, uid, gid; rootfs_layers, index)
+    return changes === nothing || !isempty(changes)
+end
+
+docker_layers_dir() = @get_scratch!("docker_layers")
+
+# Group the top-level entries of a rootfs into layers; every directory gets a layer of
+# its own, while the root itself and all other top-level entries share the first one.
+function docker_layer_groups(root_path::String, index::Dict{String,SubtreeFingerprint})
+    names = sort!(collect(keys(index)))
+    dirs = filter(name -> isdir(lstat(joinpath(root_path, name))), names)
+    return [[".", setdiff(names, dirs)...], [[d] for d in dirs]...]
+end
+
+fingerprint_hash(fp::SubtreeFingerprint) = hash((fp.num_entries, fp.total_size, fp.max_ctime, fp.inode_hash))
+
+# Sizes and ids in tar headers are NUL- or space-terminated octal, or big-endian base-256
+# when the top bit of their first byte is set.
+function tar_header_number(header::Vector{UInt8}, range::UnitRange{Int})
+    field = view(header, range)
+    if field[1] & 0x80 != 0
+        return foldl((n, b) -> (n << 8) | b, field[2:end]; init=Int(field[1] & 0x7f))
+    end
+    digits = strip(String(copy(field)), ['\0', ' '])
+    return isempty(digits) ? 0 : parse(Int, digits; base=8)
+end
+
+function tar_header_number!(header::Vector{UInt8}, range::UnitRange{Int}, value::Integer)
+    digits = string(value, base=8, pad=length(range)-1)
+    if length(digits) >= length(range)
+        throw(ArgumentError("$(value) does not fit into a tar header"))
+    end
+    header[range] .= UInt8[codeunits(digits)..., 0x00]
 end
 
 """
-    build_docker_image(root_path::String)
+    retar_with_owner(src::String, dst::String, uid::Integer, gid::Integer)
+
+Copies the uncompressed GNU tarball `src` to `dst`, with every entry now owned by
+`uid`/`gid`, and returns the `sha256` digest of the result.  Only the headers change,
+so this is a lot cheaper than tarring up the original tree again just for another owner.
+"""
+function retar_with_owner(src::String, dst::String, uid::Integer, gid::Integer)
+    ctx = SHA2_256_CTX()
+    header = Vector{UInt8}(undef, 512)
+    buffer = Vector{UInt8}(undef, 1024*1024)
+    open(src) do in_io
+        open(dst; write=true) do out_io
+            while readbytes!(in_io, header, 512) == 512
+                if !all(iszero, header)
+                    data_size = cld(tar_header_number(header, 125:136), 512) * 512
+                    tar_header_number!(header, 109:116, uid)
+                    tar_header_number!(header, 117:124, gid)
+                    # No user or group names, so that nothing maps them back to other ids
+                    header[266:329] .= 0x00
+                    header[149:156] .= UInt8(' ')
+                    tar_header_number!(header, 149:155, sum(Int, header))
+                else
+                    data_size = 0
+                end
+                update!(ctx, header)
+                write(out_io, header)
+
+                while data_size > 0
+                    nbytes = readbytes!(in_io, buffer, min(data_size, length(buffer)))
+                    if nbytes == 0
+                        throw(ArgumentError("$(src) is truncated"))
+                    end
+                    chunk = view(buffer, 1:nbytes)
+                    update!(ctx, chunk)
+                    write(out_io, chunk)
+                    data_size -= nbytes
+                end
+            end
+        end
+    end
+    return bytes2hex(digest!(ctx))
+end
+
+"""
+    docker_layer(root_path, names, index, uid, gid; verbose = false)
+
+Returns the path to a layer tarball (owned by `uid`/`gid`) containing the top-level
+entries `names` of `root_path`, along with its `sha256` digest.  Layers are cached in a
+scratch space keyed by the fingerprint of their contents, so only layers whose content
+changed since the last build ever get tarred up again.  The tree itself is only ever
+tarred up once, owned by root; the layers for other users are derived from that one by
+rewriting its headers.
+"""
+function docker_layer(root_path::String, names::Vector{String}, index::Dict{String,SubtreeFingerprint},
+                      uid::Cint, gid::Cint; verbose::Bool = false)
+    layer_prefix = "$(string(Base._crc32c(root_path), base=16))-$(string(hash(names), base=16))-"
+    layer_name = "$(layer_prefix)$(string(hash([fingerprint_hash(index[name]) for name in names if name != "."]), base=16))"
+    root_tarball = joinpath(docker_layers_dir(), "$(layer_name).tar")
+
+    if !isfile(root_tarball) || !isfile("$(root_tarball).sha256")
+        if verbose
+            @info("Building docker layer for $(join(names, ", "))")
+        end
+        # we need to record permisions, so can't use Tar.jl.  The root entry itself must
+        # not pull in the whole rootfs, so we turn off recursion just for that one.
+        tar_args = String[]
+        for name in names
+            if name == "."
+                append!(tar_args, ["--no-recursion", ".", "--recursion"])
+            else
+                push!(tar_args, "./$(name)")
+            end
+        end
+        tmp_tarball = "$(root_tarball).partial"
+        run(`tar -c --format=gnu --numeric-owner --owner=0 --group=0 -f $(tmp_tarball) -C $(root_path) $(tar_args)`)
+        digest = open(io -> bytes2hex(sha256(io)), tmp_tarball)
+        mv(tmp_tarball, root_tarball; force=true)
+        write("$(root_tarball).sha256", digest)
+
+        # Drop stale versions of this layer (for any owner), they will never be used again
+        for f in readdir(docker_layers_dir())
+            if startswith(f, layer_prefix) && !startswith(f, "$(layer_name).") && !startswith(f, "$(layer_name)-")
+                rm(joinpath(docker_layers_dir(), f); force=true)
+            end
+        end
+    end
+
+    tarball = root_tarball
+    if uid != 0 || gid != 0
+        tarball = joinpath(docker_layers_dir(), "$(layer_name)-$(uid)-$(gid).tar")
+        if !isfile(tarball) || !isfile("$(tarball).sha256")
+            tmp_tarball = "$(tarball).partial"
+            digest = retar_with_owner(root_tarball, tmp_tarball, uid, gid)
+            mv(tmp_tarball, tarball; force=true)
+            write("$(tarball).sha256", digest)
+        end
+    end
+    return tarball, String(read("$(tarball).sha256"))
+end
+
+docker_architecture() = get(Dict(
+    :x86_64 => "amd64",
+    :aarch64 => "arm64",
+    :armv7l => "arm",
+    :i686 => "386",
+    :powerpc64le => "ppc64le",
+), Sys.ARCH, string(Sys.ARCH))
+
+"""
+    load_docker_image(image_name, layers; verbose = false)
+
+Assembles an image out of the given `(tarball, digest)` layers (ordered from the bottom
+up) and feeds it to `docker load`, so that layers docker already has are shared with
+every other image that uses them, rather than everything being flattened into one.
+"""
+function load_docker_image(image_name::String, layers::Vector{Tuple{String,String}}; verbose::Bool = false)
+    mktempdir() do staging_dir
+        layer_paths = String[]
+        for (tarball, digest) in layers
+            if !ispath(joinpath(staging_dir, digest))
+                mkpath(joinpath(staging_dir, digest))
+                symlink(tarball, joinpath(staging_dir, digest, "layer.tar"))
+            end
+            push!(layer_paths, "\"$(digest)/layer.tar\"")
+        end
+        diff_ids = ["\"sha256:$(digest)\"" for (_, digest) in layers]
+        config_json = """
+        {"architecture": "$(docker_architecture())", "os": "linux", "config": {},
+         "rootfs": {"type": "layers", "diff_ids": [$(join(diff_ids, ", "))]}}
+        """
+        config_name = "$(bytes2hex(sha256(config_json))).json"
+        write(joinpath(staging_dir, config_name), config_json)
+        write(joinpath(staging_dir, "manifest.json"), """
+        [{"Config": "$(config_name)", "RepoTags": ["$(image_name)"], "Layers": [$(join(layer_paths, ", "))]}]
+        """)
+
+        # Follow our symlinks, so that the layers themselves end up in the stream
+        open(`docker load`, "w", verbose ? stdout : devnull) do io
+            run(pipeline(`tar -c -h -C $(staging_dir) .`, stdout=io))
+        end
+    end
+end
+
+"""
+    build_docker_image(root_path::String, uid::Cint, gid::Cint; rootfs_layers = String[], verbose = false)
 
 Docker doesn't like volume mounts within volume mounts, like we do with `sandbox`.
 So we do things "the docker way", where we construct a rootfs docker image, then mount
 things on top of that, with no recursive mounting.  We cut down on unnecessary work
-somewhat by quick-scanning the directory for changes and only rebuilding if changes
-are detected.
+somewhat by quick-scanning the directory for changes (walking it only once, in
+parallel) and only rebuilding if changes are detected.  The image is made up of one
+layer per top-level directory, and only layers whose contents changed get rebuilt.
+Any `rootfs_layers` are stacked on top in the same way, so that their common base is
+shared between every image built on top of it.
 """
-function build_docker_image(root_path::String, uid::Cint, gid::Cint; verbose::Bool = false)
-    image_name = docker_image_name(root_path, uid, gid)
-    if should_build_docker_image(root_path, uid, gid)
-        max_ctime = max_directory_ctime(root_path)
+function build_docker_image(root_path::String, uid::Cint, gid::Cint;
+                            rootfs_layers::Vector{String} = String[], verbose::Bool = false)
+    image_name = docker_image_name(root_path, uid, gid; rootfs_layers)
+    trees = [root_path; rootfs_layers]
+    tree_indices = [scan_directory(tree) for tree in trees]
+    index = rootfs_index(tree_indices)
+    if should_build_docker_image(root_path, uid, gid; rootfs_layers, index)
+        max_ctime = max_directory_ctime(root_path; index)
         if verbose
             @info("Building docker image $(image_name) with max timestamp $(max_ctime)")
         end
 
-        # Build the docker image
-        open(`docker import - $(image_name)`, "w", verbose ? stdout : devnull) do io
-            # we need to record permisions, so can't use Tar.jl
-            cd(root_path) do
-                run(pipeline(`tar -c --owner=$(uid) --group=$(gid) .`, stdout=io))
+        # Build the docker image out of one layer per top-level directory of every tree
+        layers = Tuple{String,String}[]
+        for (tree_idx, (tree, tree_index)) in enumerate(zip(trees, tree_indices))
+            for names in docker_layer_groups(tree, tree_index)
+                # The root directory itself comes from the rootfs, not from whatever its layers are
+                if tree_idx > 1
+                    names = filter(!=("."), names)
+                    isempty(names) && continue
+                end
+                push!(layers, docker_layer(tree, names, tree_index, uid, gid; verbose))
             end
         end
+        load_docker_image(image_name, layers; verbose)
 
         # Record that we built it
         save_timestamp(image_name, max_ctime)
+        save_rootfs_index(image_name, index)
     end
 
     return image_name
 end
 
+# Building the image for a rootfs is the expensive part of a first run, so do it up front
+function warm!(exe::DockerExecutor, config::SandboxConfig)
+    image_name = build_docker_image(config.read_only_maps["/"], config.uid, config.gid;
+                                    rootfs_layers=config.rootfs_layers, verbose=config.verbose)
+    if exe.reuse_container
+        get_container!(exe, config, image_name)
+    end
+    return nothing
+end
+
 function commit_previous_run(exe::DockerExecutor, image_name::String)
     ids = split(readchomp(`docker ps -a --filter label=$(docker_image_label(exe)) --format "{{.ID}}"`))
     if isempty(ids)
@@ -116,18 +415,8 @@ function commit_previous_run(exe::DockerExecutor, image_name::String)
     return image_name
 end
 
-function build_executor_command(exe::DockerExecutor, config::SandboxConfig, user_cmd::Cmd)
-    # Build the docker image that corresponds to this rootfs
-    image_name = build_docker_image(config.read_only_maps["/"], config.uid, config.gid; verbose=config.verbose)
-
-    if config.persist
-        # If this is a persistent run, check to see if any previous runs have happened from
-        # this executor, and if they have, we'll commit that previous run as a new image and
-        # use it instead of the "base" image.
-        image_name = commit_previous_run(exe, image_name)
-    end
-
-    # Begin building `docker` args
+# The `docker run` arguments that are fixed for the lifetime of a container
+function docker_container_args(exe::DockerExecutor, config::SandboxConfig)
     if exe.privileges === :privileged  # this is the default
         # pros: allows you to do nested execution. e.g. the ability to run `Sandbox` inside `Sandbox`
         # cons: may allow processes inside the Docker container to access secure environment variables of processes outside the container
@@ -142,15 +431,33 @@ function build_executor_command(exe::DockerExecutor, config::SandboxConfig, user
     else
         throw(ArgumentError("invalid value for exe.privileges: $(exe.privileges)"))
     end
-    cmd_string = String["docker", "run", privilege_args..., "-i", "--label", docker_image_label(exe)]
+    cmd_string = String[privilege_args..., "--label", docker_image_label(exe)]
 
-    # If we're doing a fully-interactive session, tell it to allocate a psuedo-TTY
-    if all(isa.((config.stdin, config.stdout, config.stderr), Base.TTY))
-        push!(cmd_string, "-t")
+    # Resource limits; docker creates the cgroup itself, so `io_max` and `cgroup` don't apply
+    if config.cpus !== nothing
+        append!(cmd_string, ["--cpus", string(config.cpus)])
+    end
+    if config.memory !== nothing
+        append!(cmd_string, ["--memory", string(config.memory)])
+    end
+    if config.cpuset !== nothing
+        append!(cmd_string, ["--cpuset-cpus", config.cpuset])
+    end
+    if config.numa_nodes !== nothing
+        append!(cmd_string, ["--cpuset-mems", config.numa_nodes])
     end
 
-    # Start in the right directory
-    append!(cmd_string, ["-w", config.pwd])
+    # Docker's `none` network still has a loopback interface; for anything else we let
+    # containers have the default bridge network (also for `:host`, for compatibility).
+    if config.network === :none || config.network === :loopback
+        append!(cmd_string, ["--network", "none"])
+    elseif config.network === :veth
+        append!(cmd_string, ["--network", "bridge"])
+    end
+
+    if config.seccomp !== nothing
+        append!(cmd_string, ["--security-opt", "seccomp=$(docker_seccomp_profile(config.seccomp))"])
+    end
 
     # Add in read-only mappings (skipping the rootfs)
     for (dst, src) in config.read_only_maps
@@ -164,6 +471,73 @@ function build_executor_command(exe::DockerExecutor, config::SandboxConfig, user
     for (dst, src) in config.read_write_maps
         append!(cmd_string, ["-v", "$(src):$(dst)"])
     end
+    return cmd_string
+end
+
+# Everything `docker_container_args()` depends on, so that we only reuse a container for
+# commands that would have gotten an identical one from `docker run`.
+function container_key(exe::DockerExecutor, config::SandboxConfig, image_name::String)
+    return hash((image_name, exe.privileges, sort(collect(config.read_only_maps)),
+                 sort(collect(config.read_write_maps)), config.cpus, config.memory,
+                 config.cpuset, config.numa_nodes, config.network, config.seccomp))
+end
+
+"""
+    get_container!(exe::DockerExecutor, config::SandboxConfig, image_name::String)
+
+Return the ID of the long-running container that `exe` keeps for `config`, starting it
+with `docker run --detach` if this is its first use.
+"""
+function get_container!(exe::DockerExecutor, config::SandboxConfig, image_name::String)
+    key = container_key(exe, config, image_name)
+    lock(exe.containers_lock) do
+        return get!(exe.containers, key) do
+            if config.verbose
+                @info("Starting reusable docker container from $(image_name)")
+            end
+            return readchomp(Cmd(String["docker", "run", "--detach", docker_container_args(exe, config)...,
+                                        "--user", "$(config.uid):$(config.gid)",
+                                        "--entrypoint", "sleep", image_name, "infinity"]))
+        end
+    end
+end
+
+# Docker doesn't tell us anything about how it sets up its containers, so `trace_path` is ignored
+function build_executor_command(exe::DockerExecutor, config::SandboxConfig, user_cmd::Cmd;
+                                trace_path::Union{String,Nothing} = nothing)
+    # Docker can only bind-mount directories, it has no way to mount filesystem images for us
+    for (dst, src) in config.read_only_maps
+        fstype = filesystem_image_type(src)
+        if fstype !== nothing
+            throw(ArgumentError("DockerExecutor cannot mount the $(fstype) image $(src) at $(dst); unpack it to a directory first"))
+        end
+    end
+
+    # Build the docker image that corresponds to this rootfs
+    image_name = build_docker_image(config.read_only_maps["/"], config.uid, config.gid;
+                                    rootfs_layers=config.rootfs_layers, verbose=config.verbose)
+
+    if exe.reuse_container
+        # A reused container keeps its filesystem from one command to the next, so there
+        # is nothing to commit; we just `exec` in it with this command's settings.
+        cmd_string = String["docker", "exec", "-i"]
+    else
+        if config.persist
+            # If this is a persistent run, check to see if any previous runs have happened from
+            # this executor, and if they have, we'll commit that previous run as a new image and
+            # use it instead of the "base" image.
+            image_name = commit_previous_run(exe, image_name)
+        end
+        cmd_string = String["docker", "run", "-i", docker_container_args(exe, config)...]
+    end
+
+    # If we're doing a fully-interactive session, tell it to allocate a psuedo-TTY
+    if all(isa.((config.stdin, config.stdout, config.stderr), Base.TTY))
+        push!(cmd_string, "-t")
+    end
+
+    # Start in the right directory
+    append!(cmd_string, ["-w", config.pwd])
 
     # Apply environment mappings, first from `config`, next from `user_cmd`.
     for (k, v) in config.env
@@ -175,16 +549,24 @@ function build_executor_command(exe::DockerExecutor, config::SandboxConfig, user
         end
     end
 
-    # Add in entrypoint, if it is set
-    if config.entrypoint !== nothing
-        append!(cmd_string, ["--entrypoint", config.entrypoint])
-    end
-
     # Set the user and group
     append!(cmd_string, ["--user", "$(config.uid):$(config.gid)"])
 
-    # Finally, append the docker image name user-requested command string
-    push!(cmd_string, image_name)
+    if exe.reuse_container
+        # `docker exec` has no `--entrypoint`, so it just goes in front of the command
+        push!(cmd_string, get_container!(exe, config, image_name))
+        if config.entrypoint !== nothing
+            push!(cmd_string, config.entrypoint)
+        end
+    else
+        # Add in entrypoint, if it is set
+        if config.entrypoint !== nothing
+            append!(cmd_string, ["--entrypoint", config.entrypoint])
+        end
+
+        # Finally, append the docker image name user-requested command string
+        push!(cmd_string, image_name)
+    end
     append!(cmd_string, user_cmd.exec)
 
     docker_cmd = Cmd(cmd_string)
@@ -287,3 +669,175 @@ function pull_docker_image(image_name::String,
     # Once the image is pulled, export it to given output directory
     return export_docker_image(image_name, output_dir; force, verbose)
 end
+
+docker_image_layers_dir() = @get_scratch!("docker_image_layers")
+
+# The OCI chain id of a layer identifies it together with everything beneath it
+function chain_ids(diff_ids::Vector{String})
+    ids = String[]
+    for diff_id in diff_ids
+        push!(ids, isempty(ids) ? diff_id : "sha256:" * bytes2hex(sha256("$(last(ids)) $(diff_id)")))
+    end
+    return ids
+end
+
+# Creates an overlayfs whiteout (a 0:0 character device) at `path`
+function make_whiteout(path::String)
+    # Older glibcs only have `__xmknod()`, in which case (or without glibc) we shell out
+    libc = Libdl.dlopen("libc.so.6"; throw_error=false)
+    mknod = libc === nothing ? nothing : Libdl.dlsym(libc, :mknod; throw_error=false)
+    if mknod === nothing || ccall(mknod, Cint, (Cstring, Cuint, Culong), path, 0o020000, 0) != 0
+        run(`mknod $(path) c 0 0`)
+    end
+end
+
+"""
+    convert_docker_whiteouts(layer_dir::String, lower_dirs::Vector{String})
+
+Docker image layers mark deleted files with `.wh.<name>` files and directories whose
+previous contents are hidden with a `.wh..wh..opq` file.  Turns those into what overlayfs
+understands, with the latter emulated by whiting out everything in `lower_dirs` (the
+already converted layers beneath this one) explicitly, so that we don't need to be able
+to set `trusted.*` extended attributes.
+"""
+function convert_docker_whiteouts(layer_dir::String, lower_dirs::Vector{String})
+    for (root, dirs, files) in walkdir(layer_dir)
+        for name in files
+            if !startswith(name, ".wh.")
+                continue
+            end
+            rm(joinpath(root, name))
+            if name == ".wh..wh..opq"
+                rel_dir = relpath(root, layer_dir)
+                for lower_dir in lower_dirs
+                    lower_path = joinpath(lower_dir, rel_dir)
+                    isdir(lower_path) || continue
+                    for lower_name in readdir(lower_path)
+                        if !ispath(joinpath(root, lower_name)) && !islink(joinpath(root, lower_name))
+                            make_whiteout(joinpath(root, lower_name))
+                        end
+                    end
+                end
+            else
+                make_whiteout(joinpath(root, name[5:end]))
+            end
+        end
+    end
+end
+
+# Extracts only `members` out of the stream of `docker save`, so that nothing else hits the
+# disk.  tar complains about (and fails on) members that aren't in there, which is how we
+# probe for the archive layout, so its verdict is left to our callers.
+function extract_docker_save(image_name::String, dir::String, members::Vector{String})
+    tar_cmd = pipeline(ignorestatus(`tar -x -C $(dir) $(members)`); stderr=devnull)
+    run(pipeline(`docker save $(image_name)`, tar_cmd))
+end
+
+"""
+    export_docker_image_layers(image_name::String,
+                               layers_dir::String = <default scratch location>;
+                               verbose::Bool = false)
+
+Exports the given (already pulled) docker image as one directory per image layer,
+returning their paths from the bottom-most up; use the first of them as the rootfs and
+the rest as `rootfs_layers` of a `SandboxConfig`.  Layers are stored by their OCI chain
+id, so that any layer that was exported before (by this or any other image) is skipped,
+and the remaining ones are extracted in parallel, straight out of `docker save`.  Docker
+whiteouts are converted to overlayfs ones, which only `UserNamespacesExecutor`s honour.
+Returns `nothing` if the image can't be found.
+"""
+function export_docker_image_layers(image_name::String,
+                                    layers_dir::String = docker_image_layers_dir();
+                                    verbose::Bool = false)
+    inspect_output = IOBuffer()
+    if !success(pipeline(`docker image inspect --format "{{json .RootFS.Layers}}" $(image_name)`; stdout=inspect_output, stderr=devnull))
+        if verbose
+            @warn("Unable to inspect $(image_name)")
+        end
+        return nothing
+    end
+    diff_ids = String[m.match for m in eachmatch(r"sha256:[0-9a-f]{64}", String(take!(inspect_output)))]
+    layer_paths = [joinpath(layers_dir, last(split(id, ':'))) for id in chain_ids(diff_ids)]
+    missing_idxs = findall(!isdir, layer_paths)
+    if verbose
+        @info("Exporting $(image_name)", layers=length(layer_paths), missing_layers=length(missing_idxs))
+    end
+    if isempty(missing_idxs)
+        return layer_paths
+    end
+
+    mkpath(layers_dir)
+    mktempdir(layers_dir) do staging_dir
+        # `docker save` gives us every layer as a tarball of its own, listed in its manifest
+        # in the same order as the image's diff ids.  We only pick the ones that we're missing
+        # out of its stream; in the OCI layout of newer dockers, they are named after their
+        # (uncompressed) digest, which is their diff id.
+        blob_names = ["blobs/sha256/$(last(split(diff_ids[idx], ':')))" for idx in missing_idxs]
+        extract_docker_save(image_name, staging_dir, ["manifest.json"; blob_names])
+        manifest = String(read(joinpath(staging_dir, "manifest.json")))
+        layers_list = match(r"\"Layers\"\s*:\s*\[([^\]]*)\]", manifest)
+        layer_tarballs = String[m[1] for m in eachmatch(r"\"([^\"]+)\"", layers_list[1])]
+        if length(layer_tarballs) != length(diff_ids)
+            error("$(image_name) has $(length(diff_ids)) layers, but `docker save` gave us $(length(layer_tarballs))")
+        end
+
+        # Older dockers name them after made-up v1 ids instead, which we only learn from the
+        # manifest at the very end of the archive, and symlink identical layers to each other,
+        # so for those we have to go through it once more (or twice, for the link targets)
+        for _ in 1:2
+            wanted = String[]
+            for name in layer_tarballs[missing_idxs]
+                path = joinpath(staging_dir, name)
+                if isfile(path)
+                    continue
+                elseif islink(path)
+                    push!(wanted, normpath(joinpath(dirname(name), readlink(path))))
+                else
+                    push!(wanted, name)
+                end
+            end
+            isempty(wanted) && break
+            extract_docker_save(image_name, staging_dir, unique(wanted))
+        end
+
+        asyncmap(missing_idxs; ntasks=Sys.CPU_THREADS) do idx
+            partial_dir = joinpath(staging_dir, "layer-$(idx)")
+            mkpath(partial_dir)
+            run(`tar -x --no-same-owner -f $(joinpath(staging_dir, layer_tarballs[idx])) -C $(partial_dir)`)
+        end
+
+        # Whiteouts are converted bottom-up, as they may depend on the layers beneath them
+        store = shard_store_dir()
+        for idx in missing_idxs
+            partial_dir = joinpath(staging_dir, "layer-$(idx)")
+            convert_docker_whiteouts(partial_dir, layer_paths[1:idx-1])
+            if store !== nothing
+                dedup_tree(partial_dir, store; verbose)
+            end
+            mv(partial_dir, layer_paths[idx]; force=true)
+        end
+    end
+    return layer_paths
+end
+
+"""
+    pull_docker_image_layers(image_name::String,
+                             layers_dir::String = <default scratch location>;
+                             verbose::Bool = false)
+
+Like `pull_docker_image()`, but exports the image as separate layers through
+`export_docker_image_layers()`, returning their paths (or `nothing` if it can't be pulled).
+"""
+function pull_docker_image_layers(image_name::String,
+                                  layers_dir::String = docker_image_layers_dir();
+                                  verbose::Bool = false)
+    try
+        run(`docker pull $(image_name)`)
+    catch
+        if verbose
+            @warn("Cannot pull", image_name)
+        end
+        return nothing
+    end
+    return export_docker_image_layers(image_name, layers_dir; verbose)
+end
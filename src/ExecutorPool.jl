@@ -0,0 +1,183 @@
+export ExecutorPool, checkout, checkin, fanout
+
+"""
+    ExecutorPool(T::Type{<:SandboxExecutor} = preferred_executor(); size::Int = Threads.nthreads(),
+                 warm_config::Union{SandboxConfig,Nothing} = nothing, kwargs...)
+
+A pool of `size` long-lived executors of type `T` (each constructed as `T(; kwargs...)`),
+that concurrently running tasks can `checkout()` and `checkin()` again (or simply use
+through `with_executor(f, pool)`), instead of constructing and cleaning up an executor
+for every run.  Executors keep their state between checkouts, such as their persistence
+directory or the zygote servers of executors constructed with `zygote = true`.
+
+If `warm_config` is given, every executor is warmed up for it ahead of time, e.g. by
+starting its zygote server or building its docker image, so that the first runs against
+that config don't pay for it either.
+
+Call `cleanup(pool)` once done with it; this cleans up all of its executors.
+"""
+struct ExecutorPool{T <: SandboxExecutor}
+    executors::Vector{T}
+    available::Channel{T}
+end
+
+function ExecutorPool(::Type{T} = preferred_executor(); size::Int = Threads.nthreads(),
+                      warm_config::Union{SandboxConfig,Nothing} = nothing,
+                      kwargs...) where {T <: SandboxExecutor}
+    if size < 1
+        throw(ArgumentError("ExecutorPool size must be at least 1"))
+    end
+    if !executor_available(T)
+        error("Cannot create a pool of $(T), as it is not available on this system")
+    end
+    executors = T[T(; kwargs...) for _ in 1:size]
+    available = Channel{T}(size)
+    for exe in executors
+        if warm_config !== nothing
+            warm!(exe, warm_config)
+        end
+        put!(available, exe)
+    end
+    return ExecutorPool{T}(executors, available)
+end
+
+Base.show(io::IO, pool::ExecutorPool{T}) where {T} = write(io, "ExecutorPool{$(T)} ($(length(pool.executors)) executors)")
+
+"""
+    checkout(pool::ExecutorPool)
+
+Takes an executor out of `pool`, waiting for one to be returned if all of them are in use.
+Every checked out executor must be returned with `checkin()`.
+"""
+checkout(pool::ExecutorPool) = take!(pool.available)
+
+"""
+    checkin(pool::ExecutorPool, exe::SandboxExecutor)
+
+Returns an executor that was taken out of `pool` with `checkout()`.
+"""
+function checkin(pool::ExecutorPool{T}, exe::T) where {T}
+    if !any(e -> e === exe, pool.executors)
+        throw(ArgumentError("$(exe) does not belong to $(pool)"))
+    end
+    put!(pool.available, exe)
+    return nothing
+end
+
+"""
+    with_executor(f::Function, pool::ExecutorPool)
+
+Runs `f` with an executor checked out of `pool`, returning it to the pool afterwards.
+"""
+function with_executor(f::F, pool::ExecutorPool) where {F <: Function}
+    exe = checkout(pool)
+    try
+        return f(exe)
+    finally
+        checkin(pool, exe)
+    end
+end
+
+function cleanup(pool::ExecutorPool)
+    close(pool.available)
+    for exe in pool.executors
+        cleanup(exe)
+    end
+end
+
+# Executors that can do some of the work for a config ahead of time override this
+warm!(exe::SandboxExecutor, config::SandboxConfig) = nothing
+
+"""
+    fanout(f::Function, inputs, config::SandboxConfig;
+           executor::Type{<:SandboxExecutor} = preferred_executor(),
+           concurrency::Int = default_concurrency(config), numa::Bool = false, kwargs...)
+
+Runs `f(exe, config, input)` (which typically does `run(exe, config, ...)` with some
+command built from `input`) for every one of `inputs`, on `concurrency` workers that each
+have an executor of their own (constructed as `executor(; kwargs...)`, so that each has
+its own persistence directory, zygote, etc...).  Inputs are handed out to workers in order,
+as soon as the previous one they took on is done.
+
+Returns a `Channel` that yields an `idx => result` pair for every input as soon as it is
+done (so not necessarily in order), where `idx` counts the inputs in the order that they
+were taken from `inputs`.  At most `concurrency` results are kept waiting for you to take
+them; workers stop taking on more inputs until you do.  Close the channel to stop early.
+Once all inputs are done, or as soon as any `f` throws (which the channel then throws
+as well), the executors are cleaned up.
+
+By default, `concurrency` is as many runs as fit into the CPU budget of the cgroup we're
+running in, at `config.cpus` CPUs per run (or one, if that isn't set).  With `numa`, every
+worker keeps its runs on a NUMA node of its own (round-robin, by setting the `cpuset` and
+`numa_nodes` of its `config`), so that they don't pay for memory accesses across nodes;
+user namespace executors then need `config.cgroup` to point at a delegated cgroup (see
+`SandboxConfig`).
+
+```julia
+for (idx, result) in fanout(inputs, config) do exe, config, input
+        run(exe, config, `/bin/build \$(input)`)
+    end
+    @info("Finished building \$(inputs[idx])")
+end
+```
+"""
+function fanout(f::Function, inputs, config::SandboxConfig;
+                executor::Type{<:SandboxExecutor} = preferred_executor(),
+                concurrency::Int = default_concurrency(config), numa::Bool = false, kwargs...)
+    if concurrency < 1
+        throw(ArgumentError("fanout concurrency must be at least 1"))
+    end
+    if !executor_available(executor)
+        error("Cannot fan out over $(executor), as it is not available on this system")
+    end
+    configs = numa ? numa_configs(config, concurrency) : fill(config, concurrency)
+    executors = [executor(; kwargs...) for _ in 1:concurrency]
+    for (exe, worker_config) in zip(executors, configs)
+        warm!(exe, worker_config)
+    end
+
+    work = Channel{Pair{Int,Any}}(concurrency)
+    results = Channel{Pair{Int,Any}}(concurrency)
+    task = @async try
+        @sync begin
+            @async try
+                for (idx, input) in enumerate(inputs)
+                    put!(work, idx => input)
+                end
+            finally
+                close(work)
+            end
+            for (exe, worker_config) in zip(executors, configs)
+                @async try
+                    for (idx, input) in work
+                        put!(results, idx => f(exe, worker_config, input))
+                    end
+                catch e
+                    # Don't let the other workers carry on with inputs that nobody will see
+                    close(work, e)
+                    rethrow()
+                end
+            end
+        end
+    finally
+        foreach(cleanup, executors)
+    end
+    bind(results, task)
+    return results
+end
+
+# As many runs as fit into our CPU budget, at their own CPU limit each
+function default_concurrency(config::SandboxConfig)
+    return max(1, floor(Int, cpu_budget() / something(config.cpus, 1.0)))
+end
+
+# Spread workers across the NUMA nodes that we have, round-robin
+function numa_configs(config::SandboxConfig, concurrency::Int)
+    nodes = sort!(collect(numa_node_cpus()); by=first)
+    if length(nodes) <= 1
+        return fill(config, concurrency)
+    end
+    return [SandboxConfig(config; cpuset=nodes[mod1(idx, length(nodes))][2],
+                          numa_nodes=string(nodes[mod1(idx, length(nodes))][1]))
+            for idx in 1:concurrency]
+end
@@ -0,0 +1,108 @@
+# These are the same on every architecture that we run on
+const O_CLOEXEC = 0o2000000
+const POSIX_FADV_WILLNEED = 3
+const POSIX_FADV_DONTNEED = 4
+const PROT_READ = 1
+const MAP_SHARED = 1
+const MAP_FAILED = reinterpret(Ptr{Cvoid}, -1)
+
+# Everything a sandbox of `config` reads from; only images are mounted from files
+function prewarm_files(config::SandboxConfig)
+    files = String[]
+    for tree in vcat(collect(values(config.read_only_maps)), config.rootfs_layers)
+        if isfile(tree)
+            push!(files, tree)
+            continue
+        end
+        for (root, dirs, names) in walkdir(tree)
+            for name in names
+                path = joinpath(root, name)
+                if isfile(lstat(path))
+                    push!(files, path)
+                end
+            end
+        end
+    end
+    return files
+end
+
+function fadvise(path::String, advice::Cint)
+    fd = ccall(:open, Cint, (Cstring, Cint), path, O_CLOEXEC)
+    if fd == -1
+        return false
+    end
+    ret = ccall(:posix_fadvise, Cint, (Cint, Int, Int, Cint), fd, 0, 0, advice)
+    ccall(:close, Cint, (Cint,), fd)
+    return ret == 0
+end
+
+# How many pages of `path` are currently in the page cache, without faulting any of them in
+function resident_pages(path::String)
+    size = filesize(path)
+    fd = ccall(:open, Cint, (Cstring, Cint), path, O_CLOEXEC)
+    if fd == -1 || size == 0
+        fd != -1 && ccall(:close, Cint, (Cint,), fd)
+        return 0
+    end
+    addr = ccall(:mmap, Ptr{Cvoid}, (Ptr{Cvoid}, Csize_t, Cint, Cint, Cint, Int),
+                 C_NULL, size, PROT_READ, MAP_SHARED, fd, 0)
+    ccall(:close, Cint, (Cint,), fd)
+    if addr == MAP_FAILED
+        return 0
+    end
+    pages = zeros(UInt8, cld(size, ccall(:getpagesize, Cint, ())))
+    resident = 0
+    if ccall(:mincore, Cint, (Ptr{Cvoid}, Csize_t, Ptr{UInt8}), addr, size, pages) == 0
+        resident = count(page -> page & 0x1 != 0, pages)
+    end
+    ccall(:munmap, Cint, (Ptr{Cvoid}, Csize_t), addr, size)
+    return resident
+end
+
+"""
+    record_accesses(exe::SandboxExecutor, config::SandboxConfig, user_cmd::Cmd; evict::Bool = false)
+
+Runs `user_cmd` once, as a representative of the jobs that are to come, and returns the
+files of the read-only maps and rootfs layers of `config` that it read something from, for
+`prewarm()` to warm up later.  Those are found by comparing which of their pages are in the
+page cache before and after the run, so only cold files are seen; with `evict`, the page
+cache is dropped for all of them first (which also affects anybody else using them).  This
+walks every read-only tree of `config`, so it is meant to be done once, up front.
+
+Only `UserNamespacesExecutor`s read straight from these trees; docker containers run off
+of a copy of them.
+"""
+function record_accesses(exe::SandboxExecutor, config::SandboxConfig, user_cmd::Cmd; evict::Bool = false)
+    files = prewarm_files(config)
+    if evict
+        for path in files
+            fadvise(path, Cint(POSIX_FADV_DONTNEED))
+        end
+    end
+    before = resident_pages.(files)
+    run(exe, config, user_cmd)
+    after = resident_pages.(files)
+    return [files[idx] for idx in eachindex(files) if after[idx] > before[idx]]
+end
+
+"""
+    prewarm(config::SandboxConfig; accesses::Union{Vector{String},Nothing} = nothing)
+
+Gets the files that sandboxes of `config` will read into the page cache (and their inodes and
+directory entries into the dentry cache) ahead of time, so that a burst of jobs doesn't have
+to fault them in from disk one page at a time.  `accesses` is a list of files as recorded by
+`record_accesses()`; without one, every file of the read-only maps and rootfs layers of
+`config` is warmed up.  The readahead itself happens asynchronously in the kernel, so this
+returns quickly, with the number of bytes that were asked for.
+"""
+function prewarm(config::SandboxConfig; accesses::Union{Vector{String},Nothing} = nothing)
+    files = accesses === nothing ? prewarm_files(config) : accesses
+    sizes = zeros(Int, length(files))
+    Threads.@threads for idx in eachindex(files)
+        st = lstat(files[idx])
+        if isfile(st) && fadvise(files[idx], Cint(POSIX_FADV_WILLNEED))
+            sizes[idx] = st.size
+        end
+    end
+    return sum(sizes)
+end
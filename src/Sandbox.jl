@@ -2,8 +2,8 @@ module Sandbox
 using Preferences, Scratch, LazyArtifacts, TOML, Libdl
 
 import Base: run, success
-export SandboxExecutor, DockerExecutor, UserNamespacesExecutor, SandboxConfig,
-       preferred_executor, executor_available, probe_executor, run, cleanup, with_executor
+export SandboxExecutor, DockerExecutor, UserNamespacesExecutor, SandboxConfig, SandboxResult, SandboxTrace, SandboxUsage, LineCallback,
+       SandboxRun, preferred_executor, executor_available, probe_executor, run, run_async, cancel, cleanup, with_executor
 using Base.BinaryPlatforms
 
 # Include some utilities for things like file manipulation, uname() parsing, etc...
@@ -20,12 +20,15 @@ Valid concrete subtypes must implement at least the following methods:
 * `executor_available(::DataType{T})`: Checks whether executor type `T` is available
   on this system.  For example, `UserNamespacesExecutor`s are only available on
   Linux, and even then only on certain kernels.  Availablility checks may run a
-  program to determine whether that executor is actually available.
+  program to determine whether that executor is actually available, so implementations
+  should cache their answer for the rest of the process via `cached_availability()`.
 
 * `build_executor_command(exe::T, config::SandboxConfig, cmd::Cmd)`: Builds the
   `Cmd` object that, when run, executes the user's desired command within the given
   sandbox.  The `config` object contains all necessary metadata such as shard
   mappings, environment variables, `stdin`/`stdout`/`stderr` redirection, etc...
+  Executors that can record a trace of how they set up the sandbox should also accept
+  a `trace_path` keyword argument, naming the file that the trace should be written to.
 
 * `cleanup(exe::T)`: Cleans up any persistent data storage that this executor may
   have built up over the course of its execution.
@@ -39,14 +42,24 @@ that users instead make use of the `with_executor()` convenience function:
 """
 abstract type SandboxExecutor; end
 
+include("Seccomp.jl")
 include("SandboxConfig.jl")
 
+# Load the shard store that rootfs trees can be deduplicated into
+include("ShardStore.jl")
+
 # Load the Docker executor
 include("Docker.jl")
 
 # Load the UserNamespace executor
 include("UserNamespaces.jl")
 
+# Load executor pooling
+include("ExecutorPool.jl")
+
+# Load page cache prewarming
+include("Prewarm.jl")
+
 all_executors = Type{<:SandboxExecutor}[
     # We always prefer the UserNamespaces executor, if we can use it,
     # and the unprivileged one most of all.  Only after that do we try `docker`.
@@ -85,6 +98,15 @@ function select_executor(verbose::Bool)
     error("Could not find any available executors for $(triplet(HostPlatform()))!")
 end
 
+# Probing starts up an actual sandbox, so we only ever do it once per executor type
+const _executor_availability = Dict{Type,Bool}()
+const _executor_availability_lock = ReentrantLock()
+function cached_availability(probe::Function, ::Type{T}) where {T <: SandboxExecutor}
+    lock(_executor_availability_lock) do
+        return get!(probe, _executor_availability, T)
+    end
+end
+
 _preferred_executor = nothing
 const _preferred_executor_lock = ReentrantLock()
 function preferred_executor(;verbose::Bool = false)
@@ -109,17 +131,332 @@ function warn_priviledged(::PrivilegedUserNamespacesExecutor)
 end
 warn_priviledged(::SandboxExecutor) = nothing
 
-for f in (:run, :success)
-    @eval begin
-        function $f(exe::SandboxExecutor, config::SandboxConfig, user_cmd::Cmd; kwargs...)
-            cmd = pipeline(build_executor_command(exe, config, user_cmd); config.stdin, config.stdout, config.stderr)
-            if config.verbose
-                @info("Running sandboxed command", user_cmd.exec)
+function sandbox_pipeline(exe::SandboxExecutor, config::SandboxConfig, user_cmd::Cmd;
+                          trace_path::Union{String,Nothing} = nothing)
+    # Only executors that can trace need to know about `trace_path`
+    sandbox_cmd = if trace_path === nothing
+        build_executor_command(exe, config, user_cmd)
+    else
+        build_executor_command(exe, config, user_cmd; trace_path)
+    end
+    cmd = pipeline(sandbox_cmd; config.stdin, config.stdout, config.stderr)
+    if config.verbose
+        @info("Running sandboxed command", user_cmd.exec)
+    end
+    warn_priviledged(exe)
+    return cmd
+end
+
+# Once a command has finished, any unterminated last line it wrote has to be passed on
+function flush_line_callbacks(config::SandboxConfig)
+    for io in (config.stdout, config.stderr)
+        if isa(io, LineCallback)
+            flush(io)
+        end
+    end
+end
+
+function success(exe::SandboxExecutor, config::SandboxConfig, user_cmd::Cmd; kwargs...)
+    try
+        return success(sandbox_pipeline(exe, config, user_cmd); kwargs...)
+    finally
+        flush_line_callbacks(config)
+    end
+end
+
+"""
+    run(exe::SandboxExecutor, config::SandboxConfig, user_cmd::Cmd; trace::Bool = false, kwargs...)
+
+Runs `user_cmd` within the sandbox described by `config`, returning the `Process`.  If
+`trace` is set, the sandbox records what it spent its time on, and a `SandboxTrace` of
+that (which also holds the `Process`) is returned instead.  Traced runs must be waited on.
+With `wait = false`, it is up to the caller to `flush()` any `LineCallback`s of `config`
+once the command has finished.
+"""
+function run(exe::SandboxExecutor, config::SandboxConfig, user_cmd::Cmd; trace::Bool = false, kwargs...)
+    if !trace
+        if !get(kwargs, :wait, true)
+            return run(sandbox_pipeline(exe, config, user_cmd); kwargs...)
+        end
+        try
+            return run(sandbox_pipeline(exe, config, user_cmd); kwargs...)
+        finally
+            flush_line_callbacks(config)
+        end
+    end
+    if !get(kwargs, :wait, true)
+        throw(ArgumentError("Traced sandbox runs must be waited on"))
+    end
+    return mktempdir() do dir
+        trace_path = joinpath(dir, "trace.toml")
+        try
+            process = run(sandbox_pipeline(exe, config, user_cmd; trace_path); kwargs...)
+            return SandboxTrace(process, isfile(trace_path) ? String(read(trace_path)) : "")
+        finally
+            flush_line_callbacks(config)
+        end
+    end
+end
+
+"""
+    SandboxRun
+
+A sandboxed command that is running in the background, as started by `run_async()`.
+`wait()` on it to get its `Process` once it has finished, or `cancel()` it; `cancelled`
+records whether that happened (which includes running into its timeout).  Commands that
+were killed by a signal exit with 128 plus its number, like they would in a shell.
+"""
+mutable struct SandboxRun
+    process::Base.Process
+    config::SandboxConfig
+    kill_timeout::Float64
+    cancelled::Bool
+    timer::Union{Timer,Nothing}
+end
+
+"""
+    run_async(exe::SandboxExecutor, config::SandboxConfig, user_cmd::Cmd;
+              timeout = nothing, kill_timeout = 10)
+
+Starts `user_cmd` within a sandbox without waiting for it, returning a `SandboxRun`.  If a
+`timeout` (in seconds) is given, the run gets `cancel()`ed if it is still going by then.
+"""
+function run_async(exe::SandboxExecutor, config::SandboxConfig, user_cmd::Cmd;
+                   timeout::Union{Real,Nothing} = nothing, kill_timeout::Real = 10)
+    process = run(sandbox_pipeline(exe, config, user_cmd); wait=false)
+    sandbox_run = SandboxRun(process, config, Float64(kill_timeout), false, nothing)
+    if timeout !== nothing
+        sandbox_run.timer = Timer(_ -> cancel(sandbox_run), timeout)
+    end
+    return sandbox_run
+end
+
+"""
+    cancel(sandbox_run::SandboxRun; kill_timeout = sandbox_run.kill_timeout)
+
+Asks a sandboxed command to stop by sending SIGTERM, without waiting for it to do so.
+`UserNamespacesExecutor`s pass that on to the command, and kill everything else within the
+sandbox once it exits (or, if it doesn't, after `sandbox --kill-timeout`, 5 seconds by
+default).  Should the sandbox still be around `kill_timeout` seconds from now, it gets
+SIGKILLed, which takes down everything within it as well (for privileged executors, by way
+of the `sudo` it runs under).  Zygote clients pass both on to their command's process group.
+Note that `DockerExecutor`s have no way of telling a container to wind down through
+`docker exec`.
+"""
+function cancel(sandbox_run::SandboxRun; kill_timeout::Real = sandbox_run.kill_timeout)
+    process = sandbox_run.process
+    if process_running(process)
+        sandbox_run.cancelled = true
+        kill(process, Base.SIGTERM)
+        Timer(kill_timeout) do _
+            if process_running(process)
+                kill(process, Base.SIGKILL)
+            end
+        end
+    end
+    return sandbox_run
+end
+
+function Base.wait(sandbox_run::SandboxRun)
+    wait(sandbox_run.process)
+    if sandbox_run.timer !== nothing
+        close(sandbox_run.timer)
+    end
+    flush_line_callbacks(sandbox_run.config)
+    return sandbox_run.process
+end
+Base.process_running(sandbox_run::SandboxRun) = process_running(sandbox_run.process)
+success(sandbox_run::SandboxRun) = success(wait(sandbox_run))
+
+"""
+    SandboxMount
+
+A single mount performed while setting up a sandbox, as recorded in a `SandboxTrace`:
+what `kind` of mount it was (`"bind"`, `"bind-ro"`, `"overlay"`, `"proc"`, ...), its
+`source` and `target`, and how long it took.
+"""
+struct SandboxMount
+    kind::String
+    source::String
+    target::String
+    duration_ms::Float64
+end
+
+"""
+    SandboxUsage
+
+The resource usage of a sandboxed process tree, accumulated over every process that ran
+within the sandbox (as reported by `wait4()`):
+
+- `user_ms`, `system_ms`: CPU time spent in user and kernel mode.
+- `max_rss_kb`: the largest resident set size of any single process, in KiB.
+- `minor_faults`, `major_faults`: page faults served without and with I/O, respectively.
+- `read_bytes`, `write_bytes`: block I/O done on behalf of the processes.
+- `voluntary_switches`, `involuntary_switches`: context switches.
+- `memory_peak`, `cgroup_read_bytes`, `cgroup_write_bytes`: peak memory use (page cache
+  included) and I/O as accounted by the cgroup the sandbox ran in, when it ran in one.
+"""
+struct SandboxUsage
+    user_ms::Float64
+    system_ms::Float64
+    max_rss_kb::Int
+    minor_faults::Int
+    major_faults::Int
+    read_bytes::Int
+    write_bytes::Int
+    voluntary_switches::Int
+    involuntary_switches::Int
+    memory_peak::Union{Int,Nothing}
+    cgroup_read_bytes::Union{Int,Nothing}
+    cgroup_write_bytes::Union{Int,Nothing}
+end
+
+function SandboxUsage(event::Dict{String,Any}, cgroup_event::Union{Dict{String,Any},Nothing} = nothing)
+    cgroup_event = something(cgroup_event, Dict{String,Any}())
+    return SandboxUsage(
+        Float64(event["user_ms"]),
+        Float64(event["system_ms"]),
+        get(event, "max_rss_kb", 0),
+        get(event, "minor_faults", 0),
+        get(event, "major_faults", 0),
+        # `getrusage()` counts I/O in 512-byte blocks, whatever the actual block size
+        get(event, "read_blocks", 0) * 512,
+        get(event, "write_blocks", 0) * 512,
+        get(event, "voluntary_switches", 0),
+        get(event, "involuntary_switches", 0),
+        get(cgroup_event, "memory_peak", nothing),
+        get(cgroup_event, "io_read_bytes", nothing),
+        get(cgroup_event, "io_write_bytes", nothing),
+    )
+end
+
+"""
+    SandboxTrace
+
+What a traced `run()` found out about the sandbox it ran a command in:
+
+- `process`: the `Process` that was run.
+- `pid`: the host pid of the sandbox init process, if known.
+- `exitcode`: the exit code of the command, if it exited normally.
+- `phases`: how long each setup phase (`"clone"`, `"uid map"`, `"overlay"`, `"maps"`,
+  `"dev"`, `"pivot"`, ...) took in milliseconds, in the order they ran.
+- `mounts`: every mount that was made, with how long it took.
+- `wall_ms`: wall-clock time of the whole sandbox invocation.
+- `usage`: the `SandboxUsage` of everything that ran within the sandbox, if known.
+- `scratch_bytes`: how much scratch space the changes to the rootfs took up.
+- `events`: every raw trace event, for anything not covered above.
+
+Executors that can't trace (e.g. `DockerExecutor`) return a trace without any events.
+"""
+struct SandboxTrace
+    process::Base.Process
+    pid::Union{Int,Nothing}
+    exitcode::Union{Int,Nothing}
+    phases::Vector{Pair{String,Float64}}
+    mounts::Vector{SandboxMount}
+    wall_ms::Float64
+    usage::Union{SandboxUsage,Nothing}
+    scratch_bytes::Union{Int,Nothing}
+    events::Vector{Dict{String,Any}}
+end
+
+function SandboxTrace(process::Base.Process, trace_data::String)
+    events = Dict{String,Any}[]
+    try
+        append!(events, get(TOML.parse(trace_data), "event", Dict{String,Any}[]))
+    catch e
+        @error("Unable to parse sandbox trace", exception=e)
+    end
+
+    pid = nothing
+    exitcode = nothing
+    phases = Pair{String,Float64}[]
+    mounts = SandboxMount[]
+    wall_ms = 0.0
+    usage = nothing
+    cgroup_event = nothing
+    scratch_bytes = nothing
+    for event in events
+        type = get(event, "type", "")
+        if type == "child"
+            pid = event["pid"]
+        elseif type == "phase"
+            push!(phases, event["name"] => Float64(event["duration_ms"]))
+        elseif type == "mount"
+            push!(mounts, SandboxMount(event["kind"], event["source"], event["target"], Float64(event["duration_ms"])))
+        elseif type == "cgroup"
+            cgroup_event = event
+        elseif type == "scratch"
+            scratch_bytes = event["bytes"]
+        elseif type == "exit"
+            exitcode = event["exit_code"] >= 0 ? event["exit_code"] : nothing
+            wall_ms = Float64(event["wall_ms"])
+            usage = SandboxUsage(event, cgroup_event)
+        end
+    end
+    return SandboxTrace(process, pid, exitcode, phases, mounts, wall_ms, usage, scratch_bytes, events)
+end
+success(trace::SandboxTrace) = success(trace.process)
+
+"""
+    SandboxResult
+
+The outcome of a single command from a batched `run()`: the `cmd` that was run,
+its `exitcode`, and everything it wrote to `stdout` and `stderr`.
+"""
+struct SandboxResult
+    cmd::Cmd
+    exitcode::Int
+    stdout::String
+    stderr::String
+end
+success(result::SandboxResult) = result.exitcode == 0
+
+# Executors that can share one sandbox setup across many commands override this;
+# `f` gets passed a function that builds the `Cmd` to run for each user command.
+with_batch(f::Function, exe::SandboxExecutor, config::SandboxConfig) = f(user_cmd -> build_executor_command(exe, config, user_cmd))
+
+"""
+    run(exe::SandboxExecutor, config::SandboxConfig, user_cmds::Vector{Cmd}; parallelism::Int = 1)
+
+Runs a batch of commands against the same `config`, at most `parallelism` at a time,
+returning a `SandboxResult` for each one (in the same order as `user_cmds`).  Rather
+than being redirected to `config.stdout`/`config.stderr`, the output of each command is
+captured into its result, and commands read from `devnull`.  A failing command does
+not stop the rest of the batch from running.
+
+Executors that support it (e.g. `UserNamespacesExecutor`s with a `sandbox` that has
+zygote support) set up the sandbox only once for the whole batch; this also means
+that the commands in a batch share a single rootfs overlay, even without `persist`.
+"""
+function run(exe::SandboxExecutor, config::SandboxConfig, user_cmds::Vector{Cmd}; parallelism::Int = 1)
+    if parallelism < 1
+        throw(ArgumentError("parallelism must be at least 1"))
+    end
+    if config.verbose
+        @info("Running batch of $(length(user_cmds)) sandboxed commands", parallelism)
+    end
+    warn_priviledged(exe)
+
+    results = Vector{SandboxResult}(undef, length(user_cmds))
+    with_batch(exe, config) do build_cmd
+        sem = Base.Semaphore(parallelism)
+        @sync for (idx, user_cmd) in enumerate(user_cmds)
+            @async begin
+                Base.acquire(sem)
+                try
+                    cmd_stdout = IOBuffer()
+                    cmd_stderr = IOBuffer()
+                    cmd = pipeline(build_cmd(ignorestatus(user_cmd)); stdin=devnull, stdout=cmd_stdout, stderr=cmd_stderr)
+                    p = run(cmd)
+                    results[idx] = SandboxResult(user_cmd, p.exitcode, String(take!(cmd_stdout)), String(take!(cmd_stderr)))
+                finally
+                    Base.release(sem)
+                end
             end
-            warn_priviledged(exe)
-            return $f(cmd; kwargs...)
         end
     end
+    return results
 end
 
 """
@@ -254,10 +591,11 @@ function probe_executor(executor::SandboxExecutor; verbose::Bool = false, test_r
     end
 end
 
-# Convenience function for other users who want to do some testing
-alpine_rootfs() = artifact"alpine-rootfs"
-julia_alpine_rootfs() = artifact"julia-alpine-rootfs"
-debian_rootfs() = artifact"debian-minimal-rootfs"
-julia_python3_rootfs() = artifact"debian-julia-python3-rootfs"
+# Convenience function for other users who want to do some testing; these share their
+# common files through the shard store, if it is enabled (see `shard_store_dir()`).
+alpine_rootfs() = shared_rootfs(artifact"alpine-rootfs")
+julia_alpine_rootfs() = shared_rootfs(artifact"julia-alpine-rootfs")
+debian_rootfs() = shared_rootfs(artifact"debian-minimal-rootfs")
+julia_python3_rootfs() = shared_rootfs(artifact"debian-julia-python3-rootfs")
 
 end # module
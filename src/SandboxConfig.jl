@@ -1,4 +1,49 @@
-const AnyRedirectable = Union{Base.AbstractCmd, Base.TTY, <:IO}
+"""
+    LineCallback(f::Function)
+
+An `IO` that calls `f(line::String)` with every line written to it (without its trailing
+newline), to look at the output of a sandboxed command as it is produced without keeping
+all of it around, e.g. `SandboxConfig(...; stdout = LineCallback(line -> ...))`.  A final
+line that lacks a trailing newline is passed on by `flush()`, which `run()` and `success()`
+do for you once the command has finished.
+"""
+mutable struct LineCallback{F} <: IO
+    f::F
+    partial::Vector{UInt8}
+    lock::ReentrantLock
+end
+LineCallback(f::F) where {F} = LineCallback{F}(f, UInt8[], ReentrantLock())
+
+function Base.unsafe_write(io::LineCallback, p::Ptr{UInt8}, n::UInt)
+    data = unsafe_wrap(Array, p, n)
+    lock(io.lock) do
+        start = 1
+        while (newline = findnext(isequal(UInt8('\n')), data, start)) !== nothing
+            append!(io.partial, view(data, start:newline-1))
+            line = String(io.partial)
+            io.partial = UInt8[]
+            io.f(line)
+            start = newline + 1
+        end
+        append!(io.partial, view(data, start:length(data)))
+    end
+    return Int(n)
+end
+Base.write(io::LineCallback, b::UInt8) = write(io, UInt8[b])
+Base.iswritable(::LineCallback) = true
+Base.isopen(::LineCallback) = true
+
+function Base.flush(io::LineCallback)
+    lock(io.lock) do
+        if !isempty(io.partial)
+            line = String(io.partial)
+            io.partial = UInt8[]
+            io.f(line)
+        end
+    end
+end
+
+const AnyRedirectable = Union{Base.AbstractCmd, Base.TTY, <:IO, AbstractString}
 
 """
     SandboxConfig(read_only_maps, read_write_maps, env)
@@ -8,6 +53,16 @@ Sandbox executors require a configuration to set up the environment properly.
 - `read_only_maps`: Directories that are mapped into the sandbox as read-only mappings.
    - Specified as pairs, e.g. `sandbox_path => host_path`.  All paths must be absolute.
    - Must always include a mapping for root, e.g. `"/" => rootfs_path`.
+   - Host paths may also be squashfs or EROFS image files, which are mounted read-only
+     in place of a directory (not supported by the `DockerExecutor`).
+
+- `rootfs_layers`: Directories stacked on top of the rootfs, bottom-most first.
+   - Files in a layer add to or replace those of the rootfs and of the layers below it,
+     so a common base rootfs can be shared by many variants of it that each only carry
+     their differences.  All paths must be absolute.
+   - User namespace executors merge them with overlayfs, where layers may also be images
+     and honour overlayfs whiteouts (so they can hide files, too).  The `DockerExecutor`
+     turns each of them into image layers of their own on top of those of the rootfs.
 
 - `read_write_maps`: Directories that are mapped into the sandbox as read-write mappings.
    - Specified as pairs, e.g. `sandbox_path => host_path`.  All paths must be absolute.
@@ -27,13 +82,50 @@ Sandbox executors require a configuration to set up the environment properly.
   - This is a boolean value, it is up to interpretation by the executor.
   - Persistence is a property of an individual executor and changes live only as long
     as the executor object itself.
-  - You cannot transfer persistent changes from one executor to another.
+  - You cannot transfer persistent changes from one executor to another, but
+    `UserNamespacesExecutor`s can freeze them into a `SandboxSnapshot` that other
+    executors are then based on, see `snapshot()`.
+
+- `tmpfs_size`, `tmpfs_huge`, `scratch_dir`: Control where non-persistent changes to the rootfs live.
+  - By default, these are kept in a `tmpfs` of at most 1GB.  `tmpfs_size` changes that limit,
+    and takes either a number of bytes or a `tmpfs` size string such as `"4G"` or `"50%"`.
+  - `tmpfs_huge` backs that `tmpfs` with transparent huge pages (`huge=within_size`).
+  - `scratch_dir` instead keeps changes on disk, in a temporary directory created within
+    `scratch_dir` that is deleted once the command finishes.  Cannot be combined with `persist`.
+  - Running with `verbose` reports how much scratch space the command used.
+  - These are ignored by the `DockerExecutor`, which uses docker's own storage.
+
+- `cpus`, `memory`, `io_max`, `cpuset`, `numa_nodes`: Resource limits for the sandboxed process tree.
+  - `cpus` is how many CPUs worth of time it may use (e.g. `1.5`), `memory` is a limit in bytes.
+  - `io_max` lists cgroup v2 `io.max` lines, e.g. `["8:0 rbps=10485760 wbps=10485760"]`.
+  - `cpuset` and `numa_nodes` pin it to CPUs and memory nodes, given as lists like `"0-3,8"`.
+  - User namespace executors enforce these with a cgroup v2 created for every run beneath
+    `cgroup`, which must be delegated to us and is required with any of these limits (the
+    cgroup Julia runs in can't be used, as it has processes of its own).  Setting just
+    `cgroup` still runs in a fresh cgroup, for its resource accounting.
+  - The `DockerExecutor` maps `cpus`, `memory`, `cpuset` and `numa_nodes` onto `docker run`
+    flags, and ignores `io_max` and `cgroup`.
+
+- `network`: Which network the sandboxed processes see.
+  - `:host` (the default) shares the host's network.  `:none` gives the sandbox a network of
+    its own without any usable interface, `:loopback` one with just `lo`, and `:veth` one
+    that is also connected to the host through a veth pair (`eth0` within the sandbox, with
+    a default route through the host end), which only privileged executors can set up.
+  - The `DockerExecutor` runs `:none` and `:loopback` with `--network none`, and `:veth`
+    on docker's default bridge network, which is also what it uses for `:host`.
+
+- `seccomp`: A `SeccompPolicy` listing syscalls that should fail within the sandbox.
+  - By default (`nothing`), no syscalls are filtered.
 
 - `uid` and `gid`: Numeric user and group identifiers to spawn the sandboxed process as.
   - By default, these are both `0`, signifying `root` inside the sandbox.
 
 - `stdin`, `stdout`, `stderr`: input/output streams for the sandboxed process.
   - Can be any kind of `IO`, `TTY`, `devnull`, etc...
+  - Files, either given as a path or as an `IOStream` (e.g. from `open(path, "w")`, which
+    may also be a memfd), are handed to the sandboxed process as they are, so that its
+    output goes straight to them rather than being copied through Julia.
+  - A `LineCallback` gets to see the output one line at a time instead.
 
 - `verbose`: Set whether the sandbox construction process should be more or less verbose.
 """
@@ -41,11 +133,23 @@ struct SandboxConfig
     read_only_maps::Dict{String,String}
     read_write_maps::Dict{String,String}
     env::Dict{String,String}
+    rootfs_layers::Vector{String}
     entrypoint::Union{String,Nothing}
     pwd::String
     persist::Bool
     uid::Cint
     gid::Cint
+    tmpfs_size::Union{String,Nothing}
+    tmpfs_huge::Bool
+    scratch_dir::Union{String,Nothing}
+    cgroup::Union{String,Nothing}
+    cpus::Union{Float64,Nothing}
+    memory::Union{Int,Nothing}
+    io_max::Vector{String}
+    cpuset::Union{String,Nothing}
+    numa_nodes::Union{String,Nothing}
+    network::Symbol
+    seccomp::Union{SeccompPolicy,Nothing}
 
     stdin::AnyRedirectable
     stdout::AnyRedirectable
@@ -55,36 +159,93 @@ struct SandboxConfig
     function SandboxConfig(read_only_maps::Dict{String,String},
                            read_write_maps::Dict{String,String} = Dict{String,String}(),
                            env::Dict{String,String} = Dict{String,String}();
+                           rootfs_layers::Vector{String} = String[],
                            entrypoint::Union{String,Nothing} = nothing,
                            pwd::String = "/",
                            persist::Bool = false,
                            uid::Integer=0,
                            gid::Integer=0,
+                           tmpfs_size::Union{Integer,AbstractString,Nothing} = nothing,
+                           tmpfs_huge::Bool = false,
+                           scratch_dir::Union{String,Nothing} = nothing,
+                           cgroup::Union{String,Nothing} = nothing,
+                           cpus::Union{Real,Nothing} = nothing,
+                           memory::Union{Integer,Nothing} = nothing,
+                           io_max::Vector{String} = String[],
+                           cpuset::Union{String,Nothing} = nothing,
+                           numa_nodes::Union{String,Nothing} = nothing,
+                           network::Symbol = :host,
+                           seccomp::Union{SeccompPolicy,Nothing} = nothing,
                            stdin::AnyRedirectable = Base.devnull,
                            stdout::AnyRedirectable = Base.stdout,
                            stderr::AnyRedirectable = Base.stderr,
                            verbose::Bool = false)
         # Lint the maps to ensure that all are absolute paths:
         for path in [keys(read_only_maps)..., values(read_only_maps)...,
-                     keys(read_write_maps)..., values(read_write_maps)...,
-                     something(entrypoint, "/"), pwd]
+                     keys(read_write_maps)..., values(read_write_maps)..., rootfs_layers...,
+                     something(entrypoint, "/"), pwd, something(scratch_dir, "/"), something(cgroup, "/")]
             if !startswith(path, "/")
                 throw(ArgumentError("Path mapping $(path) is not absolute!"))
             end
         end
 
         # Don't touch anything that is encrypted; it doesn't play well with user namespaces or docker
-        for path in [values(read_only_maps)...; values(read_write_maps)...]
+        for path in [values(read_only_maps)...; values(read_write_maps)...; rootfs_layers...]
             crypt, mountpoint = is_ecryptfs(path; verbose)
             if crypt
                 throw(ArgumentError("Path $(path) is mounted on the ecryptfs filesystem $(mountpoint)!"))
             end
         end
 
+        if scratch_dir !== nothing && persist
+            throw(ArgumentError("Cannot use a scratch directory together with persist!"))
+        end
+        if isa(tmpfs_size, Integer)
+            if tmpfs_size <= 0
+                throw(ArgumentError("tmpfs_size must be positive!"))
+            end
+            tmpfs_size = string(tmpfs_size)
+        end
+        # This ends up in the mount options of the tmpfs, so it mustn't be able to add any
+        if tmpfs_size !== nothing && !occursin(r"^\d+[kKmMgG%]?$", tmpfs_size)
+            throw(ArgumentError("Invalid tmpfs_size $(repr(tmpfs_size)), expected a number of bytes, optionally with a k, m, g or % suffix!"))
+        end
+
+        if cpus !== nothing && cpus <= 0
+            throw(ArgumentError("cpus must be positive!"))
+        end
+        if memory !== nothing && memory <= 0
+            throw(ArgumentError("memory must be positive!"))
+        end
+
+        if network ∉ (:host, :none, :loopback, :veth)
+            throw(ArgumentError("Unknown network $(network), expected one of :host, :none, :loopback or :veth!"))
+        end
+
         # Ensure that read_only_maps contains a mapping for the root in the guest:
         if !haskey(read_only_maps, "/")
             throw(ArgumentError("Must provide a read-only root mapping!"))
         end
-        return new(read_only_maps, read_write_maps, env, entrypoint, pwd, persist, Cint(uid), Cint(gid), stdin, stdout, stderr, verbose)
+        return new(read_only_maps, read_write_maps, env, rootfs_layers, entrypoint, pwd, persist, Cint(uid), Cint(gid), tmpfs_size, tmpfs_huge, scratch_dir,
+                   cgroup, cpus === nothing ? nothing : Float64(cpus), memory === nothing ? nothing : Int(memory),
+                   io_max, cpuset, numa_nodes, network, seccomp, stdin, stdout, stderr, verbose)
     end
 end
+
+"""
+    SandboxConfig(config::SandboxConfig; kwargs...)
+
+A copy of `config`, with any of its settings replaced by those given as keyword arguments
+(which include `read_only_maps`, `read_write_maps` and `env`), e.g.
+`SandboxConfig(config; pwd = "/workspace", stdout = io)`.
+"""
+function SandboxConfig(config::SandboxConfig; read_only_maps::Dict{String,String} = copy(config.read_only_maps),
+                       read_write_maps::Dict{String,String} = copy(config.read_write_maps),
+                       env::Dict{String,String} = copy(config.env), kwargs...)
+    settings = Dict{Symbol,Any}(name => getfield(config, name) for name in fieldnames(SandboxConfig)
+                                if name ∉ (:read_only_maps, :read_write_maps, :env))
+    settings[:rootfs_layers] = copy(config.rootfs_layers)
+    settings[:io_max] = copy(config.io_max)
+    merge!(settings, Dict{Symbol,Any}(kwargs))
+    return SandboxConfig(read_only_maps, read_write_maps, env; settings...)
+end
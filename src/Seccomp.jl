@@ -0,0 +1,287 @@
+export SeccompPolicy
+
+"""
+    SeccompPolicy(denied::Vector; errno::Integer = 1)
+
+A seccomp policy that makes the syscalls in `denied` (given by name, e.g. `"ptrace"`, or
+by number) fail with `errno` (by default `EPERM`) within the sandbox, while allowing all
+others.  Pass it to `SandboxConfig(...; seccomp = policy)`.
+
+User namespace executors run the sandboxed command under a seccomp-BPF filter compiled
+from this policy, which is compiled only once and cached in a scratch space.  The filter
+also sets `no_new_privs`, so setuid executables lose their powers within the sandbox.
+On `x86_64`, 32-bit executables get the same syscalls denied by name (those given by
+number only apply to 64-bit ones; on i386, the socket syscalls can also be made through
+`"socketcall"`), and those of the x32 ABI all fail with `errno`.  Syscalls made through
+any other foreign ABI kill the process, as the filter cannot tell what they are.  The `DockerExecutor`
+hands the policy to docker as a seccomp profile, which docker ignores for `:privileged`
+containers.
+"""
+struct SeccompPolicy
+    denied::Vector{Union{String,Int}}
+    errno::Int
+
+    function SeccompPolicy(denied::Vector; errno::Integer = 1)
+        if !(0 < errno < 4096)
+            throw(ArgumentError("errno must be within 1:4095!"))
+        end
+        for syscall in denied
+            if !isa(syscall, Union{AbstractString,Integer}) || (isa(syscall, Integer) && syscall < 0)
+                throw(ArgumentError("Invalid syscall $(repr(syscall)), expected a name or a number!"))
+            end
+        end
+        denied = Union{String,Int}[isa(s, Integer) ? Int(s) : String(s) for s in denied]
+        return new(unique(denied), Int(errno))
+    end
+end
+
+Base.:(==)(a::SeccompPolicy, b::SeccompPolicy) = a.denied == b.denied && a.errno == b.errno
+Base.hash(policy::SeccompPolicy, h::UInt) = hash((policy.denied, policy.errno), hash(SeccompPolicy, h))
+
+# The syscalls that are most commonly denied, and those that are most commonly made,
+# for the architectures that `sandbox` supports.  Anything else can be given by number.
+const SYSCALL_NUMBERS = Dict{Symbol,Dict{String,Int}}(
+    :x86_64 => Dict(
+        "read" => 0, "write" => 1, "open" => 2, "close" => 3, "stat" => 4, "fstat" => 5,
+        "lstat" => 6, "poll" => 7, "lseek" => 8, "mmap" => 9, "mprotect" => 10, "munmap" => 11,
+        "brk" => 12, "rt_sigaction" => 13, "rt_sigprocmask" => 14, "ioctl" => 16,
+        "pread64" => 17, "pwrite64" => 18, "readv" => 19, "writev" => 20, "access" => 21,
+        "madvise" => 28, "socket" => 41, "connect" => 42, "accept" => 43, "sendto" => 44,
+        "recvfrom" => 45, "bind" => 49, "listen" => 50, "clone" => 56, "fork" => 57,
+        "vfork" => 58, "execve" => 59, "kill" => 62, "fcntl" => 72, "getdents64" => 217,
+        "ptrace" => 101, "syslog" => 103, "setuid" => 105, "setgid" => 106,
+        "personality" => 135, "vhangup" => 153, "pivot_root" => 155, "prctl" => 157,
+        "adjtimex" => 159, "chroot" => 161, "acct" => 163, "settimeofday" => 164,
+        "mount" => 165, "umount2" => 166, "swapon" => 167, "swapoff" => 168, "reboot" => 169,
+        "sethostname" => 170, "setdomainname" => 171, "iopl" => 172, "ioperm" => 173,
+        "init_module" => 175, "delete_module" => 176, "quotactl" => 179, "futex" => 202,
+        "lookup_dcookie" => 212, "clock_settime" => 227, "clock_gettime" => 228,
+        "kexec_load" => 246, "add_key" => 248, "request_key" => 249, "keyctl" => 250,
+        "openat" => 257, "newfstatat" => 262, "unshare" => 272, "move_pages" => 279,
+        "perf_event_open" => 298, "name_to_handle_at" => 303, "open_by_handle_at" => 304,
+        "clock_adjtime" => 305, "setns" => 308, "process_vm_readv" => 310,
+        "process_vm_writev" => 311, "kcmp" => 312, "finit_module" => 313, "seccomp" => 317,
+        "kexec_file_load" => 320, "bpf" => 321, "userfaultfd" => 323, "statx" => 332,
+        "io_uring_setup" => 425, "io_uring_enter" => 426, "io_uring_register" => 427,
+        "open_tree" => 428, "move_mount" => 429, "fsopen" => 430, "fsconfig" => 431,
+        "fsmount" => 432, "fspick" => 433, "clone3" => 435, "mount_setattr" => 442,
+    ),
+    :aarch64 => Dict(
+        "lookup_dcookie" => 18, "ioctl" => 29, "umount2" => 39, "mount" => 40,
+        "pivot_root" => 41, "chroot" => 51, "openat" => 56, "close" => 57, "vhangup" => 58,
+        "quotactl" => 60, "getdents64" => 61, "lseek" => 62, "read" => 63, "write" => 64,
+        "readv" => 65, "writev" => 66, "pread64" => 67, "pwrite64" => 68, "newfstatat" => 79,
+        "fstat" => 80, "acct" => 89, "personality" => 92, "unshare" => 97, "futex" => 98,
+        "kexec_load" => 104, "init_module" => 105, "delete_module" => 106,
+        "clock_settime" => 112, "clock_gettime" => 113, "syslog" => 116, "ptrace" => 117,
+        "kill" => 129, "rt_sigaction" => 134, "rt_sigprocmask" => 135, "reboot" => 142,
+        "setgid" => 144, "setuid" => 146, "sethostname" => 161, "setdomainname" => 162,
+        "prctl" => 167, "settimeofday" => 170, "adjtimex" => 171, "socket" => 198,
+        "bind" => 200, "listen" => 201, "accept" => 202, "connect" => 203, "sendto" => 206,
+        "recvfrom" => 207, "brk" => 214, "munmap" => 215, "add_key" => 217,
+        "request_key" => 218, "keyctl" => 219, "clone" => 220, "execve" => 221, "mmap" => 222,
+        "swapon" => 224, "swapoff" => 225, "mprotect" => 226, "madvise" => 233,
+        "move_pages" => 239, "perf_event_open" => 241, "name_to_handle_at" => 264,
+        "open_by_handle_at" => 265, "clock_adjtime" => 266, "setns" => 268,
+        "process_vm_readv" => 270, "process_vm_writev" => 271, "kcmp" => 272,
+        "finit_module" => 273, "seccomp" => 277, "bpf" => 280, "userfaultfd" => 282,
+        "statx" => 291, "kexec_file_load" => 294, "io_uring_setup" => 425,
+        "io_uring_enter" => 426, "io_uring_register" => 427, "open_tree" => 428,
+        "move_mount" => 429, "fsopen" => 430, "fsconfig" => 431, "fsmount" => 432,
+        "fspick" => 433, "clone3" => 435, "mount_setattr" => 442,
+    ),
+)
+
+# The i386 ABI, which 32-bit executables use on `x86_64` hosts; this has everything the
+# `x86_64` table does, except for those syscalls that don't exist there.
+const I386_SYSCALL_NUMBERS = Dict(
+    "fork" => 2, "read" => 3, "write" => 4, "open" => 5, "close" => 6, "execve" => 11,
+    "lseek" => 19, "mount" => 21, "setuid" => 23, "ptrace" => 26, "access" => 33,
+    "kill" => 37, "brk" => 45, "setgid" => 46, "acct" => 51, "umount2" => 52, "ioctl" => 54,
+    "fcntl" => 55, "chroot" => 61, "sethostname" => 74, "settimeofday" => 79, "swapon" => 87,
+    "reboot" => 88, "mmap" => 90, "munmap" => 91, "ioperm" => 101, "socketcall" => 102,
+    "syslog" => 103, "stat" => 106, "lstat" => 107, "fstat" => 108, "iopl" => 110,
+    "vhangup" => 111, "swapoff" => 115, "clone" => 120, "setdomainname" => 121,
+    "adjtimex" => 124, "mprotect" => 125, "init_module" => 128, "delete_module" => 129,
+    "quotactl" => 131, "personality" => 136, "readv" => 145, "writev" => 146, "poll" => 168,
+    "prctl" => 172, "rt_sigaction" => 174, "rt_sigprocmask" => 175, "pread64" => 180,
+    "pwrite64" => 181, "vfork" => 190, "mmap2" => 192, "fstat64" => 197, "setuid32" => 213,
+    "setgid32" => 214, "pivot_root" => 217, "madvise" => 219, "getdents64" => 220,
+    "futex" => 240, "lookup_dcookie" => 253, "clock_settime" => 264, "clock_gettime" => 265,
+    "kexec_load" => 283, "add_key" => 286, "request_key" => 287, "keyctl" => 288,
+    "openat" => 295, "newfstatat" => 300, "unshare" => 310, "move_pages" => 317,
+    "perf_event_open" => 336, "name_to_handle_at" => 341, "open_by_handle_at" => 342,
+    "clock_adjtime" => 343, "setns" => 346, "process_vm_readv" => 347,
+    "process_vm_writev" => 348, "kcmp" => 349, "finit_module" => 350, "seccomp" => 354,
+    "bpf" => 357, "socket" => 359, "bind" => 361, "connect" => 362, "listen" => 363,
+    "sendto" => 369, "recvfrom" => 371, "userfaultfd" => 374, "statx" => 383,
+    "io_uring_setup" => 425, "io_uring_enter" => 426, "io_uring_register" => 427,
+    "open_tree" => 428, "move_mount" => 429, "fsopen" => 430, "fsconfig" => 431,
+    "fsmount" => 432, "fspick" => 433, "clone3" => 435, "mount_setattr" => 442,
+)
+const I386_MISSING_SYSCALLS = ["accept", "kexec_file_load"]
+
+# Every syscall that isn't denied has to make it past all of the checks for those that are,
+# so we let the ones that programs make all the time skip straight to the end.
+const HOT_SYSCALLS = ["read", "write", "futex", "close", "mmap", "openat", "newfstatat",
+                      "fstat", "lseek", "rt_sigprocmask", "brk", "munmap"]
+
+# Bump this whenever `compile_seccomp()` changes what it generates, to invalidate old caches
+const SECCOMP_FILTER_VERSION = 2
+
+const AUDIT_ARCH = Dict(:x86_64 => 0xc000003e, :aarch64 => 0xc00000b7)
+const AUDIT_ARCH_I386 = 0x40000003
+const X32_SYSCALL_BIT = 0x40000000
+
+# Classic BPF, as used by seccomp
+const BPF_LD_W_ABS = 0x20
+const BPF_JEQ_K = 0x15
+const BPF_JGE_K = 0x35
+const BPF_RET_K = 0x06
+const SECCOMP_RET_KILL_PROCESS = 0x80000000
+const SECCOMP_RET_ERRNO = 0x00050000
+const SECCOMP_RET_ALLOW = 0x7fff0000
+
+struct BPFInstruction
+    code::UInt16
+    jt::UInt8
+    jf::UInt8
+    k::UInt32
+end
+
+function syscall_number(syscall::Union{String,Int}, arch::Symbol)
+    isa(syscall, Int) && return syscall
+    nr = get(SYSCALL_NUMBERS[arch], syscall, nothing)
+    if nr === nothing
+        throw(ArgumentError("Unknown $(arch) syscall \"$(syscall)\"; give it by number instead"))
+    end
+    return nr
+end
+
+"""
+    compile_seccomp(policy::SeccompPolicy; arch::Symbol = Sys.ARCH)
+
+Compiles `policy` into the seccomp-BPF program that `sandbox --seccomp` installs, returned
+as the raw bytes of its `struct sock_filter` instructions.
+"""
+function compile_seccomp(policy::SeccompPolicy; arch::Symbol = Sys.ARCH)
+    if !haskey(AUDIT_ARCH, arch)
+        throw(ArgumentError("Seccomp policies are not supported on $(arch)"))
+    end
+    denied = sort!(unique!([syscall_number(s, arch) for s in policy.denied]))
+
+    # Jumps are relative, and can only go forward; everything ends up at one of the two
+    # returns at the very end, so we note where each jump wants to go and fix them up later.
+    prog = BPFInstruction[]
+    targets = Tuple{Int,Symbol}[]
+    function emit!(code, k, target = nothing)
+        push!(prog, BPFInstruction(code, 0, 0, k))
+        if target !== nothing
+            push!(targets, (length(prog), target))
+        end
+    end
+
+    function emit_checks!(numbers, denied)
+        hot = [numbers[s] for s in HOT_SYSCALLS if haskey(numbers, s)]
+        for nr in unique!(filter(nr -> nr ∉ denied, hot))
+            emit!(BPF_JEQ_K, nr, :allow)
+        end
+        for nr in denied
+            emit!(BPF_JEQ_K, nr, :deny)
+        end
+    end
+
+    # Syscall numbers mean nothing unless we know which architecture they are for
+    emit!(BPF_LD_W_ABS, 4)
+    if arch === :x86_64
+        push!(prog, BPFInstruction(BPF_JEQ_K, 2, 0, AUDIT_ARCH[arch]))
+        emit!(BPF_JEQ_K, AUDIT_ARCH_I386, :i386)
+    else
+        push!(prog, BPFInstruction(BPF_JEQ_K, 1, 0, AUDIT_ARCH[arch]))
+    end
+    emit!(BPF_RET_K, SECCOMP_RET_KILL_PROCESS)
+    emit!(BPF_LD_W_ABS, 0)
+    if arch === :x86_64
+        # The x32 ABI shares our architecture, but uses its own syscall numbers
+        emit!(BPF_JGE_K, X32_SYSCALL_BIT, :deny)
+    end
+    emit_checks!(SYSCALL_NUMBERS[arch], denied)
+    labels = Dict{Symbol,Int}()
+    if arch === :x86_64
+        # 32-bit executables use the i386 ABI, whose numbers we only know the names for
+        emit!(BPF_RET_K, SECCOMP_RET_ALLOW)
+        labels[:i386] = length(prog) + 1
+        emit!(BPF_LD_W_ABS, 0)
+        i386_denied = [I386_SYSCALL_NUMBERS[s] for s in policy.denied if haskey(I386_SYSCALL_NUMBERS, s)]
+        emit_checks!(I386_SYSCALL_NUMBERS, sort!(unique!(i386_denied)))
+    end
+    emit!(BPF_RET_K, SECCOMP_RET_ALLOW)
+    emit!(BPF_RET_K, SECCOMP_RET_ERRNO | policy.errno)
+
+    labels[:allow] = length(prog) - 1
+    labels[:deny] = length(prog)
+    for (idx, target) in targets
+        offset = labels[target] - idx - 1
+        if offset > typemax(UInt8)
+            throw(ArgumentError("Seccomp policy denies too many syscalls"))
+        end
+        prog[idx] = BPFInstruction(prog[idx].code, offset, 0, prog[idx].k)
+    end
+
+    io = IOBuffer()
+    for insn in prog
+        write(io, insn.code, insn.jt, insn.jf, insn.k)
+    end
+    return take!(io)
+end
+
+"""
+    seccomp_filter_path(policy::SeccompPolicy)
+
+Returns the path to the compiled seccomp-BPF program for `policy`, compiling it (just the
+once) into a scratch space if need be.
+"""
+function seccomp_filter_path(policy::SeccompPolicy)
+    key = string(hash((policy, SECCOMP_FILTER_VERSION)); base=16)
+    path = joinpath(@get_scratch!("seccomp"), "$(key)-$(Sys.ARCH).bpf")
+    if !isfile(path)
+        # Others may be compiling the very same policy, so each of us writes a file of its own
+        tmp_path, io = mktemp(dirname(path))
+        write(io, compile_seccomp(policy))
+        close(io)
+        mv(tmp_path, path; force=true)
+    end
+    return path
+end
+
+"""
+    docker_seccomp_profile(policy::SeccompPolicy)
+
+Returns the path to a docker seccomp profile (JSON) that denies the same syscalls as
+`policy`, writing it into a scratch space if need be.
+"""
+function docker_seccomp_profile(policy::SeccompPolicy)
+    path = joinpath(@get_scratch!("seccomp"), "$(string(hash(policy); base=16)).json")
+    if !isfile(path)
+        numbers = get(SYSCALL_NUMBERS, Sys.ARCH, nothing)
+        names = String[]
+        for syscall in policy.denied
+            if isa(syscall, Int)
+                # Docker only knows syscalls by name
+                name = numbers === nothing ? nothing : findfirst(==(syscall), numbers)
+                if name === nothing
+                    throw(ArgumentError("Cannot give docker syscall $(syscall) by number"))
+                end
+                syscall = name
+            end
+            push!(names, syscall)
+        end
+        tmp_path, io = mktemp(dirname(path))
+        print(io, """{"defaultAction": "SCMP_ACT_ALLOW", "syscalls": [{"names": [""")
+        join(io, ["\"$(name)\"" for name in names], ", ")
+        print(io, """], "action": "SCMP_ACT_ERRNO", "errnoRet": $(policy.errno)}]}""")
+        close(io)
+        mv(tmp_path, path; force=true)
+    end
+    return path
+end
@@ -0,0 +1,136 @@
+using SHA
+
+# Files smaller than this aren't worth hashing; they hardly take up any page cache
+const SHARD_STORE_MIN_SIZE = 4096
+const EXDEV = 18
+
+"""
+    shard_store_dir()
+
+Returns the directory of the shard store that rootfs trees get deduplicated into, or
+`nothing` if the store is disabled.  It is enabled through the `shard_store` preference,
+which may either be `true` (for a scratch space of its own) or a path, which has to be
+on the same filesystem as the artifacts and scratch spaces that get deduplicated:
+
+```julia
+using Preferences, Sandbox
+set_preferences!(Sandbox, "shard_store" => true)
+```
+"""
+function shard_store_dir()
+    store = @load_preference("shard_store", false)
+    if store === true
+        return @get_scratch!("shard_store")
+    elseif isa(store, String)
+        return store
+    end
+    return nothing
+end
+
+_deduplicated_trees = Set{String}()
+const _deduplicated_trees_lock = ReentrantLock()
+
+"""
+    dedup_tree(tree::String, store::String = shard_store_dir(); verbose::Bool = false)
+
+Replaces every regular file (of at least `SHARD_STORE_MIN_SIZE` bytes) within `tree` with
+a hardlink into the content-addressed `store`, keyed by its SHA256, permissions and
+modification time (to the second), so that linking a file changes nothing about it.  Trees
+that contain the same files, such as the different rootfs artifacts or the layers of docker
+images built on the same base, then share their inodes, and with them their page cache
+when many sandboxes use them at once.  (Reflinks would share disk blocks, but not the page
+cache, which is why we hardlink.)
+
+Only deduplicate trees that never change, such as artifacts and docker image layers: a
+write to any of those files would show up in every tree that shares it.  To guard against
+that, only files that are read-only (for everybody) already get shared; this covers all of
+an artifact, as those are installed read-only, but only some of a docker image's files.
+
+Returns the number of bytes that are now shared with the store rather than stored twice.
+Files owned by other users are left alone, as is everything if `store` turns out to live on
+a different filesystem than `tree`.
+"""
+function dedup_tree(tree::String, store::String = shard_store_dir(); verbose::Bool = false)
+    mkpath(store)
+    saved = 0
+    uid = getuid()
+    for (root, dirs, files) in walkdir(tree)
+        candidates = String[]
+        for name in files
+            st = lstat(joinpath(root, name))
+            if isfile(st) && st.size >= SHARD_STORE_MIN_SIZE && st.uid == uid && st.nlink == 1 &&
+               filemode(st) & 0o222 == 0
+                push!(candidates, name)
+            end
+        end
+        isempty(candidates) && continue
+
+        # Artifacts are read-only, so we need to be able to swap files out from under them
+        dir_mode = filemode(root)
+        if dir_mode & 0o200 == 0
+            chmod(root, dir_mode | 0o200)
+        end
+        try
+            for name in candidates
+                path = joinpath(root, name)
+                st = lstat(path)
+                mode = filemode(st) & 0o7777
+                digest = open(io -> bytes2hex(sha256(io)), path)
+                shard = joinpath(store, digest[1:2], "$(digest)-$(string(mode; base=8))-$(round(Int, st.mtime))")
+                mkpath(dirname(shard))
+
+                # The first tree to have this file donates it to the store
+                if ccall(:link, Cint, (Cstring, Cstring), path, shard) == 0
+                    continue
+                end
+                err = Libc.errno()
+                if err == EXDEV
+                    if verbose
+                        @warn("Shard store $(store) is not on the same filesystem as $(tree); not deduplicating it")
+                    end
+                    return saved
+                elseif !isfile(shard)
+                    Base.systemerror("link", err)
+                end
+
+                # Everybody else swaps it out for the one in the store atomically; one left
+                # behind by an earlier run that got interrupted would be in the way of that.
+                partial_path = "$(path).partial"
+                rm(partial_path; force=true)
+                if ccall(:link, Cint, (Cstring, Cstring), shard, partial_path) != 0
+                    Base.systemerror("link", Libc.errno())
+                end
+                Base.Filesystem.rename(partial_path, path)
+                saved += filesize(shard)
+            end
+        finally
+            if dir_mode & 0o200 == 0
+                chmod(root, dir_mode)
+            end
+        end
+    end
+    if verbose
+        @info("Deduplicated $(tree) into $(store)", saved_bytes=saved)
+    end
+    return saved
+end
+
+# Rootfs artifacts never change, so each of them only needs to be deduplicated once
+function shared_rootfs(tree::String)
+    store = shard_store_dir()
+    if store === nothing
+        return tree
+    end
+    lock(_deduplicated_trees_lock) do
+        if tree ∉ _deduplicated_trees
+            marker = joinpath(store, "trees", bytes2hex(sha256(tree)))
+            if !isfile(marker)
+                dedup_tree(tree, store)
+                mkpath(dirname(marker))
+                touch(marker)
+            end
+            push!(_deduplicated_trees, tree)
+        end
+    end
+    return tree
+end
@@ -1,7 +1,8 @@
 using UserNSSandbox_jll
 
 # Use User Namespaces to provide isolation on Linux hosts whose kernels support it
-export UserNamespacesExecutor, UnprivilegedUserNamespacesExecutor, PrivilegedUserNamespacesExecutor
+export UserNamespacesExecutor, UnprivilegedUserNamespacesExecutor, PrivilegedUserNamespacesExecutor,
+       SandboxSnapshot, snapshot, SandboxChange, list_changes, extract_changes
 
 abstract type UserNamespacesExecutor <: SandboxExecutor; end
 
@@ -35,26 +36,159 @@ function chmod_recursive(root::String, perms, use_sudo::Bool)
 end
 
 
-function cleanup(exe::UserNamespacesExecutor)
-    if exe.persistence_dir !== nothing && isdir(exe.persistence_dir)
-        # Because a lot of these files are unreadable, we must `chmod +r` them before deleting
-        chmod_recursive(exe.persistence_dir, 0o777, isa(exe, PrivilegedUserNamespacesExecutor))
-        try
-            rm(exe.persistence_dir; force=true, recursive=true)
-        catch
+# Deletes a directory full of files written from within a sandbox
+function remove_sandbox_tree(path::String, privileged::Bool)
+    if !isdir(path)
+        return
+    end
+
+    # Newer `sandbox` builds delete the whole tree in one (possibly `sudo`'ed) call
+    if sandbox_supports("--cleanup")
+        cleanup_cmd = `$(UserNSSandbox_jll.sandbox_path) --cleanup $(path)`
+        if privileged && getuid() != 0
+            cleanup_cmd = `$(sudo_cmd()) $(cleanup_cmd)`
         end
+        if success(cleanup_cmd)
+            return
+        end
+    end
+
+    # Because a lot of these files are unreadable, we must `chmod +r` them before deleting
+    chmod_recursive(path, 0o777, privileged)
+    try
+        rm(path; force=true, recursive=true)
+    catch
+    end
+end
+
+function stop_zygotes(exe)
+    for zygote in values(exe.zygotes)
+        stop_zygote(zygote)
+    end
+    empty!(exe.zygotes)
+end
+
+function clear_templates!(exe)
+    empty!(exe.templates)
+    if exe.args_dir !== nothing
+        rm(exe.args_dir; force=true, recursive=true)
+        exe.args_dir = nothing
     end
 end
 
+function cleanup(exe::UserNamespacesExecutor)
+    # Shut down any zygote servers first, as they may be keeping the persistence dir busy
+    stop_zygotes(exe)
+    clear_templates!(exe)
+
+    if exe.persistence_dir !== nothing
+        remove_sandbox_tree(exe.persistence_dir, isa(exe, PrivilegedUserNamespacesExecutor))
+    end
+end
+
+"""
+    SandboxSnapshot
+
+The rootfs changes of a persistent `UserNamespacesExecutor`, frozen by `snapshot()` into
+read-only overlay layers.  Any number of executors constructed with `snapshot = snap`
+then run on top of those layers, each with its own fresh set of changes, without the
+snapshotted files ever being copied.  Snapshots only make sense on top of the same
+rootfs that they were taken against, and are not removed by cleaning up the executors
+that use them; call `cleanup(snap)` once none of them are running anymore.
+"""
+struct SandboxSnapshot
+    # The directory this snapshot owns, holding its topmost layer
+    path::String
+    # All of the layers, bottom-most first (those of the snapshots it was based on included)
+    layers::Vector{String}
+    privileged::Bool
+end
+
+Base.show(io::IO, snap::SandboxSnapshot) = write(io, "SandboxSnapshot($(length(snap.layers)) layers at $(snap.path))")
+
+cleanup(snap::SandboxSnapshot) = remove_sandbox_tree(snap.path, snap.privileged)
+
+# A long-lived `sandbox --serve` process, holding a fully set-up sandbox that
+# `sandbox --connect` clients can cheaply fork commands off of.  For `join` executors
+# this is a `sandbox --pin` process instead, and `socket_path` is the file that it
+# records its pid in, for `sandbox --join` to find its namespaces by.
+struct ZygoteServer
+    process::Base.Process
+    socket_path::String
+end
+
+function stop_zygote(zygote::ZygoteServer)
+    if process_running(zygote.process)
+        kill(zygote.process)
+    end
+    try
+        wait(zygote.process)
+    catch
+    end
+    rm(dirname(zygote.socket_path); force=true, recursive=true)
+end
+
+# Everything about a `sandbox` invocation that only depends on the executor and the config,
+# worked out the first time a config is run and reused for every command after that.  The
+# first `sudo_len` entries of `args` are the `sudo` prefix (with the environment of the
+# config, if we pass it through `sudo -E`) that the environment of `user_cmd` goes after,
+# and `env` is the environment `sandbox` itself is started with (which that of `user_cmd`
+# is merged into if `user_env` is set).
+struct SandboxCommandTemplate
+    args::Vector{String}
+    sudo_len::Int
+    sudo_env::Bool
+    env::Vector{String}
+    user_env::Bool
+    args_file::Union{String,Nothing}
+end
+
 # Because we can run in "privileged" or "unprivileged" mode, let's treat
 # these as two separate, but very similar, executors.
+#
+# If `zygote` is set, the executor builds the sandbox for a given config only once,
+# keeping a `sandbox --serve` process around that every subsequent run against the
+# same mappings forks off of.  Note that those runs then share the rootfs overlay of
+# that zygote, so changes made by one command are visible to the next even without
+# `persist`, until the executor is cleaned up.
+#
+# If `join` is set as well, commands don't get forked by the zygote, but enter its
+# namespaces directly through `setns()` (`sandbox --join`).  They then run as children
+# of their own `sandbox` process, inheriting its environment and stdio (and moving into
+# the zygote's cgroup, if it has one), which makes them a little cheaper still;
+# privileged executors need `sudo` for every run though, as only root may join
+# namespaces that root created.
+#
+# If `snapshot` is set, the rootfs of every run starts out with the changes frozen into
+# that `SandboxSnapshot`, see `snapshot()`.
+#
+# The `sandbox` arguments for a config are only built the first time it is run, and are
+# looked up by the contents of the config after that, so that equal configs share them.
 mutable struct UnprivilegedUserNamespacesExecutor <: UserNamespacesExecutor
     persistence_dir::Union{String,Nothing}
-    UnprivilegedUserNamespacesExecutor() = new(nothing)
+    zygote::Bool
+    join::Bool
+    zygotes::Dict{UInt64,ZygoteServer}
+    snapshot::Union{SandboxSnapshot,Nothing}
+    templates::Dict{UInt64,SandboxCommandTemplate}
+    args_dir::Union{String,Nothing}
+    UnprivilegedUserNamespacesExecutor(; zygote::Bool = false, join::Bool = false,
+                                  snapshot::Union{SandboxSnapshot,Nothing} = nothing) =
+        new(nothing, zygote || join, join, Dict{UInt64,ZygoteServer}(), snapshot,
+            Dict{UInt64,SandboxCommandTemplate}(), nothing)
 end
 mutable struct PrivilegedUserNamespacesExecutor <: UserNamespacesExecutor
     persistence_dir::Union{String,Nothing}
-    PrivilegedUserNamespacesExecutor() = new(nothing)
+    zygote::Bool
+    join::Bool
+    zygotes::Dict{UInt64,ZygoteServer}
+    snapshot::Union{SandboxSnapshot,Nothing}
+    templates::Dict{UInt64,SandboxCommandTemplate}
+    args_dir::Union{String,Nothing}
+    PrivilegedUserNamespacesExecutor(; zygote::Bool = false, join::Bool = false,
+                                  snapshot::Union{SandboxSnapshot,Nothing} = nothing) =
+        new(nothing, zygote || join, join, Dict{UInt64,ZygoteServer}(), snapshot,
+            Dict{UInt64,SandboxCommandTemplate}(), nothing)
 end
 
 Base.show(io::IO, exe::UnprivilegedUserNamespacesExecutor) = write(io, "Unprivileged User Namespaces Executor")
@@ -65,9 +199,11 @@ function executor_available(::Type{T}; verbose::Bool=false) where {T <: UserName
     if !UserNSSandbox_jll.is_available()
         return false
     end
-    return with_executor(T) do exe
-        return check_kernel_version(;verbose) &&
-               probe_executor(exe; test_read_only_map=true, test_read_write_map=true, verbose)
+    return cached_availability(T) do
+        with_executor(T) do exe
+            return check_kernel_version(;verbose) &&
+                   probe_executor(exe; test_read_only_map=true, test_read_write_map=true, verbose)
+        end
     end
 end
 
@@ -98,8 +234,27 @@ function check_kernel_version(;verbose::Bool = false)
     return true
 end
 
-function build_executor_command(exe::UserNamespacesExecutor, config::SandboxConfig, user_cmd::Cmd)
-    # Check to make sure that 
+_sandbox_help = nothing
+"""
+    sandbox_supports(option::String)
+
+Checks whether the `sandbox` binary we are using understands the given command-line
+option (e.g. `"--serve"`), by looking for it in its `--help` output.  Useful because
+`UserNSSandbox_jll` may lag behind a locally-built `sandbox`.
+"""
+function sandbox_supports(option::String)
+    global _sandbox_help
+    if _sandbox_help === nothing
+        help_output = IOBuffer()
+        success(pipeline(`$(UserNSSandbox_jll.sandbox_path) --help`; stdout=help_output, stderr=help_output))
+        _sandbox_help = String(take!(help_output))
+    end
+    return occursin(option, _sandbox_help)
+end
+
+# Builds the arguments to `sandbox` that describe the world our command will be run in;
+# this is everything except the command itself and where within the sandbox it runs.
+function sandbox_world_args(exe::UserNamespacesExecutor, config::SandboxConfig)
     # While we would usually prefer to use the `executable_product()` function to get a
     # `Cmd` object that has all of the `PATH` and `LD_LIBRARY_PATH` environment variables
     # set properly so that the executable product can be run, we are careful to ensure
@@ -110,13 +265,19 @@ function build_executor_command(exe::UserNamespacesExecutor, config::SandboxConf
     if config.verbose
         push!(cmd_string, "--verbose")
     end
+    append!(cmd_string, die_with_parent_args(exe))
+
+    # Filesystem images are mounted by `sandbox` itself, which older builds can't do
+    for src in values(config.read_only_maps)
+        fstype = filesystem_image_type(src)
+        if fstype !== nothing && !sandbox_supports("squashfs or erofs images")
+            throw(ArgumentError("This `sandbox` build cannot mount the $(fstype) image $(src)"))
+        end
+    end
 
     # Extract the rootfs, as it's treated specially
     append!(cmd_string, ["--rootfs", config.read_only_maps["/"]])
 
-    # Add our `--cd` command
-    append!(cmd_string, ["--cd", config.pwd])
-
     # Add in read-only mappings (skipping the rootfs)
     for (dst, src) in config.read_only_maps
         if dst == "/"
@@ -130,9 +291,17 @@ function build_executor_command(exe::UserNamespacesExecutor, config::SandboxConf
         append!(cmd_string, ["--workspace", "$(src):$(dst)"])
     end
 
-    # Add in entrypoint, if it is set
-    if config.entrypoint !== nothing
-        append!(cmd_string, ["--entrypoint", config.entrypoint])
+    # Stack the rootfs layers on top of the rootfs, and those of our snapshot (if any,
+    # which was taken on top of them) on top of that.
+    layers = config.rootfs_layers
+    if exe.snapshot !== nothing
+        layers = vcat(layers, exe.snapshot.layers)
+    end
+    if !isempty(layers) && !sandbox_supports("--layer")
+        error("$(UserNSSandbox_jll.sandbox_path) does not support rootfs layers or snapshots; build a newer one with `deps/build_local_sandbox.jl`")
+    end
+    for layer in layers
+        append!(cmd_string, ["--layer", layer])
     end
 
     # If we have a `--persist` argument, check to see if we already have a persistence_dir
@@ -146,44 +315,520 @@ function build_executor_command(exe::UserNamespacesExecutor, config::SandboxConf
         append!(cmd_string, ["--persist", exe.persistence_dir])
     end
 
+    # Configure where non-persistent changes go, but only when asked to, so that older
+    # `sandbox` builds keep working with the defaults.
+    if config.tmpfs_size !== nothing || config.tmpfs_huge || config.scratch_dir !== nothing
+        if !sandbox_supports("--tmpfs-size")
+            error("$(UserNSSandbox_jll.sandbox_path) does not support configuring its scratch space; build a newer one with `deps/build_local_sandbox.jl`")
+        end
+        if config.tmpfs_size !== nothing
+            append!(cmd_string, ["--tmpfs-size", config.tmpfs_size])
+        end
+        if config.tmpfs_huge
+            push!(cmd_string, "--tmpfs-huge")
+        end
+        if config.scratch_dir !== nothing
+            append!(cmd_string, ["--scratch-dir", config.scratch_dir])
+        end
+    end
+
+    # Contain the sandbox within its own cgroup, if any limits (or a cgroup) were asked for
+    if uses_cgroup(config)
+        if !sandbox_supports("--cgroup")
+            error("$(UserNSSandbox_jll.sandbox_path) does not support cgroups; build a newer one with `deps/build_local_sandbox.jl`")
+        end
+        if config.cgroup === nothing
+            throw(ArgumentError("Resource limits need a delegated `cgroup` to create the sandbox's cgroup in!"))
+        end
+        append!(cmd_string, ["--cgroup", config.cgroup])
+        if config.cpus !== nothing
+            append!(cmd_string, ["--cpus", string(config.cpus)])
+        end
+        if config.memory !== nothing
+            append!(cmd_string, ["--memory", string(config.memory)])
+        end
+        for io_max in config.io_max
+            append!(cmd_string, ["--io-max", io_max])
+        end
+        if config.cpuset !== nothing
+            append!(cmd_string, ["--cpuset", config.cpuset])
+        end
+        if config.numa_nodes !== nothing
+            append!(cmd_string, ["--numa", config.numa_nodes])
+        end
+    end
+
+    # Give the sandbox a network of its own, if asked to
+    if config.network !== :host
+        if !sandbox_supports("--network")
+            error("$(UserNSSandbox_jll.sandbox_path) does not support network namespaces; build a newer one with `deps/build_local_sandbox.jl`")
+        end
+        if config.network === :veth && isa(exe, UnprivilegedUserNamespacesExecutor)
+            throw(ArgumentError("$(exe) cannot connect the sandbox to the host through a veth pair; use a privileged executor"))
+        end
+        append!(cmd_string, ["--network", string(config.network)])
+    end
+
+    append!(cmd_string, seccomp_args(config))
+
     # Set the user and group, if requested
     append!(cmd_string, ["--uid", string(config.uid), "--gid", string(config.gid)])
+    return cmd_string
+end
+
+function seccomp_args(config::SandboxConfig)
+    if config.seccomp === nothing
+        return String[]
+    end
+    if !sandbox_supports("--seccomp")
+        error("$(UserNSSandbox_jll.sandbox_path) does not support seccomp filters; build a newer one with `deps/build_local_sandbox.jl`")
+    end
+    return ["--seccomp", seccomp_filter_path(config.seccomp)]
+end
+
+# `sudo` can't pass a SIGKILL on to us, so privileged sandboxes follow it down if it gets one
+function die_with_parent_args(exe::UserNamespacesExecutor)
+    if isa(exe, PrivilegedUserNamespacesExecutor) && getuid() != 0 && sandbox_supports("--die-with-parent")
+        return ["--die-with-parent"]
+    end
+    return String[]
+end
+
+uses_cgroup(config::SandboxConfig) = config.cgroup !== nothing || config.cpus !== nothing ||
+                                     config.memory !== nothing || !isempty(config.io_max) ||
+                                     config.cpuset !== nothing || config.numa_nodes !== nothing
+
+# Zygotes can only be shared between configs that build the same world
+zygote_key(config::SandboxConfig) = hash((config.read_only_maps, config.read_write_maps, config.rootfs_layers,
+                                          config.persist, config.uid, config.gid, config.tmpfs_size,
+                                          config.tmpfs_huge, config.scratch_dir, config.cgroup, config.cpus,
+                                          config.memory, config.io_max, config.cpuset, config.numa_nodes,
+                                          config.network, config.seccomp, config.verbose))
+
+# Templates can be shared between configs that only differ in their stdio
+template_key(config::SandboxConfig) = hash((zygote_key(config), config.env, config.pwd, config.entrypoint))
+
+# How many templates an executor holds on to before it starts over
+const MAX_TEMPLATES = 64
+
+function get_zygote!(exe::UserNamespacesExecutor, config::SandboxConfig)
+    key = zygote_key(config)
+    zygote = get(exe.zygotes, key, nothing)
+    if zygote !== nothing && process_running(zygote.process)
+        return zygote
+    end
+
+    if !sandbox_supports(exe.join ? "--pin" : "--serve")
+        error("$(UserNSSandbox_jll.sandbox_path) does not support zygote mode; build a newer one with `deps/build_local_sandbox.jl`")
+    end
+
+    cmd_string = sandbox_world_args(exe, config)
+    if exe.join
+        socket_path = joinpath(mktempdir(), "pid")
+        append!(cmd_string, ["--pin", dirname(socket_path)])
+    else
+        socket_path = joinpath(mktempdir(), "zygote.sock")
+        append!(cmd_string, ["--serve", socket_path])
+    end
+    if isa(exe, PrivilegedUserNamespacesExecutor) && getuid() != 0
+        prepend!(cmd_string, sudo_cmd())
+    end
+    if config.verbose
+        @info("Starting zygote server", socket_path)
+    end
+    warn_priviledged(exe)
+
+    # The zygote never talks to our command's stdio (clients hand theirs over directly),
+    # so only its own diagnostic output needs to go anywhere.
+    server_stderr = config.verbose ? Base.stderr : IOBuffer()
+    server_cmd = pipeline(setenv(Cmd(cmd_string), String[]); stdin=devnull, stdout=devnull, stderr=server_stderr)
+    process = run(server_cmd; wait=false)
+
+    # The listening socket is created before the sandbox is built, and clients simply queue
+    # up until the zygote gets around to accepting them, so we only wait for it to appear.
+    # Pinned sandboxes only record their pid once they are ready to be joined.
+    t_start = time()
+    while !ispath(socket_path)
+        if !process_running(process) || time() - t_start > 60
+            kill(process)
+            rm(dirname(socket_path); force=true, recursive=true)
+            server_output = isa(server_stderr, IOBuffer) ? String(take!(server_stderr)) : ""
+            error("Unable to start zygote server: $(server_output)")
+        end
+        sleep(0.01)
+    end
+
+    zygote = ZygoteServer(process, socket_path)
+    exe.zygotes[key] = zygote
+    return zygote
+end
+
+function build_zygote_command(exe::UserNamespacesExecutor, config::SandboxConfig, user_cmd::Cmd)
+    zygote = get_zygote!(exe, config)
+    if exe.join
+        return build_join_command(exe, config, user_cmd, zygote)
+    end
+
+    # Clients need no privileges at all; they just pass their command, environment,
+    # working directory and stdio along to the zygote.
+    cmd_string = String[UserNSSandbox_jll.sandbox_path]
+    if config.verbose
+        push!(cmd_string, "--verbose")
+    end
+    append!(cmd_string, ["--connect", zygote.socket_path, "--cd", config.pwd])
+    if config.entrypoint !== nothing
+        append!(cmd_string, ["--entrypoint", config.entrypoint])
+    end
+    push!(cmd_string, "--")
+    append!(cmd_string, user_cmd.exec)
+
+    sandbox_cmd = setenv(Cmd(cmd_string), config.env)
+    if user_cmd.env !== nothing
+        sandbox_cmd = addenv(sandbox_cmd, user_cmd.env)
+    end
+    if user_cmd.ignorestatus
+        sandbox_cmd = ignorestatus(sandbox_cmd)
+    end
+    return sandbox_cmd
+end
+
+# Joining a pinned sandbox only takes a user, a working directory and a command; the
+# environment is passed along like it is for a regular run.
+function build_join_command(exe::UserNamespacesExecutor, config::SandboxConfig, user_cmd::Cmd,
+                            zygote::ZygoteServer)
+    cmd_string = String[UserNSSandbox_jll.sandbox_path]
+    if config.verbose
+        push!(cmd_string, "--verbose")
+    end
+    append!(cmd_string, ["--join", dirname(zygote.socket_path), "--cd", config.pwd])
+    append!(cmd_string, ["--uid", string(config.uid), "--gid", string(config.gid)])
+    append!(cmd_string, seccomp_args(config))
+    append!(cmd_string, die_with_parent_args(exe))
+    if config.entrypoint !== nothing
+        append!(cmd_string, ["--entrypoint", config.entrypoint])
+    end
+    return finish_sandbox_command(exe, config, user_cmd, cmd_string)
+end
+
+"""
+    snapshot(exe::UserNamespacesExecutor)
+
+Freezes the rootfs changes that persistent runs (`persist = true`) on `exe` have made so
+far into a new `SandboxSnapshot`, in which they become a read-only overlay layer.  `exe`
+itself carries on from that snapshot with a fresh persistence directory, so nothing changes
+from its point of view; other executors can branch off of the same state by being
+constructed with `snapshot = snap`:
+
+```julia
+with_executor() do exe
+    run(exe, SandboxConfig(...; persist=true), `install-toolchain`)
+    snap = snapshot(exe)
+    pool = ExecutorPool(typeof(exe); size=8, snapshot=snap)
+    ...
+end
+```
+
+Any zygote servers of `exe` are stopped, as they may still be writing to its changes.
+"""
+function snapshot(exe::UserNamespacesExecutor)
+    stop_zygotes(exe)
+    persistence_dir = exe.persistence_dir
+    if persistence_dir === nothing || !isdir(joinpath(persistence_dir, "upper", "rootfs"))
+        error("$(exe) has no persisted rootfs changes to snapshot; run something with `persist=true` first")
+    end
+
+    # Move the changes out of the way within the same filesystem, which is instantaneous.
+    # Privileged sandboxes leave them owned by root, so we need to be root to move them.
+    privileged = isa(exe, PrivilegedUserNamespacesExecutor)
+    snapshot_dir = mktempdir(dirname(persistence_dir))
+    layer = joinpath(snapshot_dir, "rootfs")
+    if privileged && getuid() != 0
+        run(`$(sudo_cmd()) mv $(joinpath(persistence_dir, "upper", "rootfs")) $(layer)`)
+    else
+        mv(joinpath(persistence_dir, "upper", "rootfs"), layer)
+    end
+
+    # Whatever is left (overlayfs work directories, mounted images) is not needed anymore
+    remove_sandbox_tree(persistence_dir, privileged)
+    exe.persistence_dir = nothing
+    clear_templates!(exe)
+
+    parent_layers = exe.snapshot === nothing ? String[] : exe.snapshot.layers
+    exe.snapshot = SandboxSnapshot(snapshot_dir, vcat(parent_layers, layer), privileged)
+    return exe.snapshot
+end
+
+"""
+    SandboxChange
+
+A change that persistent runs made to the rootfs of an executor, as listed by
+`list_changes()`: its `path` within the sandbox, and what `kind` of change it is.  That is
+`:file`, `:symlink` or `:directory` for things that were created or modified, `:opaque` for
+directories that replaced a previous one as a whole (so that nothing that used to be in
+them is left), and `:deleted` for things that were removed.  FIFOs, sockets and device
+nodes are listed as `:special`, but never extracted.
+"""
+struct SandboxChange
+    path::String
+    kind::Symbol
+end
+
+# overlayfs marks opaque directories with an extended attribute; `trusted.*` ones are only
+# visible to root, `user.*` ones are what it uses when mounted with `userxattr`.
+function is_overlay_opaque(path::String)
+    value = Ref{UInt8}(0)
+    for name in ("trusted.overlay.opaque", "user.overlay.opaque")
+        if ccall(:lgetxattr, Cssize_t, (Cstring, Cstring, Ptr{UInt8}, Csize_t), path, name, value, 1) == 1 &&
+           value[] == UInt8('y')
+            return true
+        end
+    end
+    return false
+end
+
+function changes_dir(exe::UserNamespacesExecutor)
+    persistence_dir = exe.persistence_dir
+    if persistence_dir === nothing || !isdir(joinpath(persistence_dir, "upper", "rootfs"))
+        error("$(exe) has no persisted rootfs changes; run something with `persist=true` first")
+    end
+    return joinpath(persistence_dir, "upper", "rootfs")
+end
+
+function collect_changes!(changes::Vector{SandboxChange}, upper::String, path::String)
+    st = lstat(path)
+    sandbox_path = path == upper ? "/" : "/" * relpath(path, upper)
+    if isdir(st)
+        if path != upper
+            push!(changes, SandboxChange(sandbox_path, is_overlay_opaque(path) ? :opaque : :directory))
+        end
+        for name in readdir(path)
+            collect_changes!(changes, upper, joinpath(path, name))
+        end
+    elseif ischardev(st) && st.rdev == 0
+        push!(changes, SandboxChange(sandbox_path, :deleted))
+    elseif islink(st)
+        push!(changes, SandboxChange(sandbox_path, :symlink))
+    elseif isfile(st)
+        push!(changes, SandboxChange(sandbox_path, :file))
+    elseif ispath(st)
+        push!(changes, SandboxChange(sandbox_path, :special))
+    end
+    return changes
+end
+
+"""
+    list_changes(exe::UserNamespacesExecutor; prefix::String = "/")
+
+Lists the changes that persistent runs (`persist = true`) on `exe` have made to the rootfs
+at or beneath `prefix`, as `SandboxChange`s.  Only the overlayfs upper directory that holds
+those changes is walked, so this takes time in proportion to how much was changed rather
+than to the size of the rootfs.  Directories are listed before what is in them.  The
+changes of privileged executors are owned by root, so this needs to run as root for them.
+"""
+function list_changes(exe::UserNamespacesExecutor; prefix::String = "/")
+    upper = changes_dir(exe)
+    path = joinpath(upper, lstrip(prefix, '/'))
+    if !ispath(path) && !islink(path)
+        return SandboxChange[]
+    end
+    return collect_changes!(SandboxChange[], upper, rstrip(path, '/'))
+end
+
+"""
+    extract_changes(exe::UserNamespacesExecutor, output_dir::String;
+                    prefix::String = "/", whiteouts::Bool = false)
+    extract_changes(io::IO, exe::UserNamespacesExecutor; prefix::String = "/")
+
+Recreates what `list_changes()` lists beneath `output_dir`, at the same paths as within the
+sandbox.  Files are hardlinked to the changes of `exe` where possible (so they must not be
+modified in place), and copied otherwise; `:special` files are skipped.  Deletions and
+opaque directories are only recorded if `whiteouts` is set, as OCI-style `.wh.<name>` and
+`.wh..wh..opq` files.
+
+Given an `IO` instead, the changes are written to it as a tarball, with whiteouts, like a
+docker image layer.
+"""
+function extract_changes(exe::UserNamespacesExecutor, output_dir::String;
+                         prefix::String = "/", whiteouts::Bool = false)
+    upper = changes_dir(exe)
+    mkpath(output_dir)
+    for change in list_changes(exe; prefix)
+        src = joinpath(upper, lstrip(change.path, '/'))
+        dst = joinpath(output_dir, lstrip(change.path, '/'))
+        # There is nothing in FIFOs and the like to copy (opening them may even block)
+        if change.kind === :special
+            continue
+        elseif change.kind === :directory || change.kind === :opaque
+            mkpath(dst)
+            if whiteouts && change.kind === :opaque
+                touch(joinpath(dst, ".wh..wh..opq"))
+            end
+            continue
+        end
+        mkpath(dirname(dst))
+        if change.kind === :deleted
+            if whiteouts
+                touch(joinpath(dirname(dst), ".wh." * basename(dst)))
+            end
+        elseif change.kind === :symlink
+            symlink(readlink(src), dst)
+        elseif ccall(:link, Cint, (Cstring, Cstring), src, dst) != 0
+            cp(src, dst)
+        end
+    end
+    return output_dir
+end
+
+function extract_changes(io::IO, exe::UserNamespacesExecutor; prefix::String = "/")
+    # Stage the tarball's contents next to the changes, so that it's all hardlinks
+    changes_dir(exe)
+    mktempdir(dirname(exe.persistence_dir)) do staging_dir
+        extract_changes(exe, staging_dir; prefix, whiteouts=true)
+        Tar.create(staging_dir, io)
+    end
+    return io
+end
+
+# Zygote executors can get their zygote server going ahead of time
+function warm!(exe::UserNamespacesExecutor, config::SandboxConfig)
+    if exe.zygote
+        get_zygote!(exe, config)
+    end
+    return nothing
+end
+
+# Batches are run through a zygote, so that we only set up the sandbox once.  If the
+# executor isn't a zygote executor, the zygote is torn down again after the batch.
+function with_batch(f::Function, exe::UserNamespacesExecutor, config::SandboxConfig)
+    if !sandbox_supports("--serve")
+        return f(user_cmd -> build_executor_command(exe, config, user_cmd))
+    end
+
+    # Start the zygote up front, so that parallel commands don't race to create it
+    get_zygote!(exe, config)
+    try
+        return f(user_cmd -> build_zygote_command(exe, config, user_cmd))
+    finally
+        if !exe.zygote
+            stop_zygote(pop!(exe.zygotes, zygote_key(config)))
+        end
+    end
+end
+
+function build_executor_command(exe::UserNamespacesExecutor, config::SandboxConfig, user_cmd::Cmd;
+                                trace_path::Union{String,Nothing} = nothing)
+    # Zygote runs don't set anything up themselves, so there is nothing of interest to trace
+    if exe.zygote
+        return build_zygote_command(exe, config, user_cmd)
+    end
+    key = template_key(config)
+    if !haskey(exe.templates, key) && length(exe.templates) >= MAX_TEMPLATES
+        empty!(exe.templates)
+    end
+    template = get!(exe.templates, key) do
+        cmd_string = sandbox_world_args(exe, config)
+
+        # Add our `--cd` command
+        append!(cmd_string, ["--cd", config.pwd])
+
+        # Add in entrypoint, if it is set
+        if config.entrypoint !== nothing
+            append!(cmd_string, ["--entrypoint", config.entrypoint])
+        end
+        return command_template(exe, config, cmd_string; key)
+    end
+
+    # Record our setup and teardown, if asked to and if this `sandbox` knows how
+    if trace_path !== nothing && sandbox_supports("--trace-file")
+        return sandbox_command(template, user_cmd, ["--trace-file", trace_path])
+    end
+    return sandbox_command(template, user_cmd)
+end
+
+# Past this many bytes of arguments, we hand them to `sandbox` through an `--args-file`
+const ARGS_FILE_THRESHOLD = 64 * 1024
+
+# Wraps up the `sandbox` arguments in `cmd_string` into a `SandboxCommandTemplate`, with the
+# environment of `config` making it through `sudo` if need be.
+#
+# Templates that are cached under a `key` put huge map lists into a file named after that
+# key, so that they don't run into the limits on argv.  Those files are kept until the
+# executor is cleaned up even once their templates are dropped, as commands built from them
+# may not have started yet, and are reused when an equal config comes along again.
+function command_template(exe::UserNamespacesExecutor, config::SandboxConfig, cmd_string::Vector{String};
+                          key::Union{UInt64,Nothing} = nothing)
+    args_file = nothing
+    if key !== nothing && sum(sizeof, cmd_string) > ARGS_FILE_THRESHOLD && sandbox_supports("--args-file")
+        if exe.args_dir === nothing
+            exe.args_dir = mktempdir(; cleanup=false)
+        end
+        args_file = joinpath(exe.args_dir, string(key; base=16))
+        if !isfile(args_file)
+            open("$(args_file).partial", "w") do io
+                for arg in cmd_string[2:end]
+                    write(io, arg, '\0')
+                end
+            end
+            mv("$(args_file).partial", args_file)
+        end
+        cmd_string = [cmd_string[1], "--args-file", args_file]
+    end
 
     # If we're running in privileged mode, we need to add `sudo` (or `su`, if `sudo` doesn't exist)
+    sudo_len = 0
+    sudo_env = false
     if isa(exe, PrivilegedUserNamespacesExecutor) && getuid() != 0
         # Next, prefer `sudo`, but allow fallback to `su`. Also, force-set our
         # environmental mappings with sudo, because many of these are often  lost
         # and forgotten due to `sudo` restrictions on setting `LD_LIBRARY_PATH`, etc...
-        if sudo_cmd()[1] == "sudo"
-            sudo_envs = vcat([["-E", "$k=$(config.env[k])"] for k in keys(config.env)]...)
-            if user_cmd.env !== nothing
-                append!(sudo_envs, vcat([["-E", pair] for pair in user_cmd.env]...))
-            end
-            prepend!(cmd_string, String[sudo_cmd()..., sudo_envs...])
-        else
-            prepend!(cmd_string, sudo_cmd())
+        sudo_prefix = sudo_cmd()
+        if sudo_prefix[1] == "sudo"
+            sudo_prefix = String[sudo_prefix..., vcat(String[], [["-E", "$k=$(config.env[k])"] for k in keys(config.env)]...)...]
+            sudo_env = true
         end
+        cmd_string = String[sudo_prefix..., cmd_string...]
+        sudo_len = length(sudo_prefix)
     end
 
-    # Finally, append the user-requested command string
-    push!(cmd_string, "--")
-    append!(cmd_string, user_cmd.exec)
+    # `sandbox` gets the SandboxConfig's env (if this is an unprivileged runner)
+    env = String[]
+    user_env = isa(exe, UnprivilegedUserNamespacesExecutor)
+    if user_env
+        env = ["$(k)=$(v)" for (k, v) in config.env]
+    end
+    return SandboxCommandTemplate(cmd_string, sudo_len, sudo_env, env, user_env, args_file)
+end
 
-    # Construct a `Cmd` object off of those, with the SandboxConfig's env (if this is an unprivileged runner):
-    sandbox_cmd = setenv(Cmd(cmd_string), String[])
-    if isa(exe, UnprivilegedUserNamespacesExecutor)
-        sandbox_cmd = setenv(sandbox_cmd, config.env)
+# Builds the `Cmd` that runs `user_cmd` from a `SandboxCommandTemplate`, passing along any
+# `extra_args` to `sandbox` itself.
+function sandbox_command(template::SandboxCommandTemplate, user_cmd::Cmd,
+                         extra_args::Vector{String} = String[])
+    user_env = something(user_cmd.env, String[])
+    sudo_args = view(template.args, 1:template.sudo_len)
+    sandbox_args = view(template.args, template.sudo_len+1:length(template.args))
+    if template.sudo_env
+        cmd_string = String[sudo_args..., vcat(String[], [["-E", pair] for pair in user_env]...)...,
+                            sandbox_args..., extra_args..., "--", user_cmd.exec...]
+    else
+        cmd_string = String[sudo_args..., sandbox_args..., extra_args..., "--", user_cmd.exec...]
+    end
 
-        # If the user has provided an environment with their command, merge that in as well
-        if user_cmd.env !== nothing
-            sandbox_cmd = addenv(sandbox_cmd, user_cmd.env)
-        end
+    # Construct a `Cmd` object off of those, with the environment of `user_cmd` merged in
+    sandbox_cmd = setenv(Cmd(cmd_string), template.env)
+    if template.user_env && user_cmd.env !== nothing
+        sandbox_cmd = addenv(sandbox_cmd, user_cmd.env)
     end
 
     # If the user has asked that this command be allowed to fail silently, pass that on
     if user_cmd.ignorestatus
         sandbox_cmd = ignorestatus(sandbox_cmd)
     end
-
     return sandbox_cmd
 end
+
+# Wraps up the `sandbox` arguments in `cmd_string` into a `Cmd` that runs `user_cmd`, for
+# commands that aren't worth caching a template for.
+function finish_sandbox_command(exe::UserNamespacesExecutor, config::SandboxConfig, user_cmd::Cmd,
+                                cmd_string::Vector{String})
+    return sandbox_command(command_template(exe, config, cmd_string), user_cmd)
+end
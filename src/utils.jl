@@ -1,17 +1,198 @@
 """
-    max_directory_ctime(prefix::String)
+    SubtreeFingerprint
+
+A cheap summary of the `lstat()` of every file and directory within a subtree: how
+many entries there are, their total size, their maximum ctime, and an order-independent
+hash of each entry's `(inode, ctime, size)`.  Any change to the contents or metadata of
+the subtree (including creating, deleting or renaming entries) changes its fingerprint.
+"""
+struct SubtreeFingerprint
+    num_entries::Int
+    total_size::Int
+    max_ctime::Float64
+    inode_hash::UInt64
+end
+SubtreeFingerprint() = SubtreeFingerprint(0, 0, 0.0, UInt64(0))
+
+function Base.merge(a::SubtreeFingerprint, b::SubtreeFingerprint)
+    return SubtreeFingerprint(
+        a.num_entries + b.num_entries,
+        a.total_size + b.total_size,
+        max(a.max_ctime, b.max_ctime),
+        a.inode_hash ⊻ b.inode_hash,
+    )
+end
+
+function fingerprint_entry(st::Base.StatStruct)
+    return SubtreeFingerprint(1, st.size, st.ctime, hash((st.inode, st.ctime, st.size)))
+end
+
+# Fingerprint `path` itself, and if `recursive` is set, everything beneath it.
+function fingerprint_tree(path::String, recursive::Bool)
+    fp = fingerprint_entry(lstat(path))
+    stack = recursive && isdir(lstat(path)) ? [path] : String[]
+    while !isempty(stack)
+        dir = pop!(stack)
+        entries = try
+            readdir(dir)
+        catch e
+            if !isa(e, Base.IOError)
+                rethrow(e)
+            end
+            continue
+        end
+        for entry in entries
+            entry_path = joinpath(dir, entry)
+            st = lstat(entry_path)
+            fp = merge(fp, fingerprint_entry(st))
+            # `lstat()` means we never descend through symlinks
+            if isdir(st)
+                push!(stack, entry_path)
+            end
+        end
+    end
+    return fp
+end
+
+"""
+    scan_directory(prefix::String)
+
+Fingerprints every top-level entry of `prefix`, returning a dictionary mapping each
+entry name to its `SubtreeFingerprint`.  The tree is walked in parallel (split up by
+second-level entries) across all available Julia threads.
+"""
+function scan_directory(prefix::String)
+    # Break the tree up into units of work; each top-level entry itself, plus one
+    # unit for each entry directly beneath a top-level directory.
+    units = Tuple{String,String,Bool}[]
+    for top in readdir(prefix)
+        top_path = joinpath(prefix, top)
+        push!(units, (top, top_path, false))
+        if isdir(lstat(top_path))
+            children = try
+                readdir(top_path)
+            catch e
+                if !isa(e, Base.IOError)
+                    rethrow(e)
+                end
+                String[]
+            end
+            for child in children
+                push!(units, (top, joinpath(top_path, child), true))
+            end
+        end
+    end
+
+    tasks = [Threads.@spawn(fingerprint_tree(path, recursive)) for (_, path, recursive) in units]
+    index = Dict{String,SubtreeFingerprint}()
+    for ((top, _, _), task) in zip(units, tasks)
+        index[top] = merge(get(index, top, SubtreeFingerprint()), fetch(task))
+    end
+    return index
+end
+
+"""
+    changed_subtrees(old_index, new_index)
+
+Given two results of `scan_directory()`, returns the (sorted) names of the top-level
+entries that were added, removed or changed between them.
+"""
+function changed_subtrees(old_index::Dict{String,SubtreeFingerprint}, new_index::Dict{String,SubtreeFingerprint})
+    return sort!([k for k in union(keys(old_index), keys(new_index)) if get(old_index, k, nothing) != get(new_index, k, nothing)])
+end
+
+"""
+    max_directory_ctime(prefix::String; index = scan_directory(prefix))
 
 Takes the `stat()` of all files in a directory root, keeping the maximum ctime,
 recursively.  Comparing just this value allows for quick directory change detection.
+If an `index` from `scan_directory()` is already at hand, it is used instead of
+walking the tree again.
 """
-function max_directory_ctime(prefix::String)
-    max_time = 0.0
-    for (root, dirs, files) in walkdir(prefix)
-        for f in files
-            max_time = max(max_time, lstat(joinpath(root, f)).ctime)
+function max_directory_ctime(prefix::String; index::Dict{String,SubtreeFingerprint} = scan_directory(prefix))
+    return maximum(fp.max_ctime for fp in values(index); init=0.0)
+end
+
+# The mount table, as a trie of path components that knows which filesystem is mounted
+# at each mountpoint (the topmost one, if several are stacked on top of each other).
+mutable struct MountTrie
+    children::Dict{String,MountTrie}
+    fstype::Union{String,Nothing}
+end
+MountTrie() = MountTrie(Dict{String,MountTrie}(), nothing)
+
+# mountinfo escapes spaces and the like in paths as octal, e.g. `\040`
+unescape_mount_path(path::AbstractString) = replace(path, r"\\([0-7]{3})" => m -> string(Char(parse(UInt8, m[2:end]; base=8))))
+
+function MountTrie(mountinfo::AbstractString)
+    root = MountTrie()
+    for line in split(mountinfo, "\n"; keepempty=false)
+        # `<id> <parent> <dev> <root> <mountpoint> <options> [<optional>...] - <fstype> ...`
+        fields = split(line)
+        separator = findfirst(==("-"), fields)
+        if length(fields) < 5 || separator === nothing || separator == length(fields)
+            continue
         end
+        node = root
+        for component in splitpath(unescape_mount_path(fields[5]))[2:end]
+            node = get!(MountTrie, node.children, component)
+        end
+        # Mounting over a directory hides everything that was mounted within it before
+        node.fstype = fields[separator + 1]
+        empty!(node.children)
+    end
+    return root
+end
+
+# Returns the filesystem of the mount that `path` lives on, and where that is mounted
+function mountpoint_of(trie::MountTrie, path::AbstractString)
+    node = trie
+    fstype, mountpoint = trie.fstype, "/"
+    components = splitpath(path)[2:end]
+    for (idx, component) in enumerate(components)
+        node = get(node.children, component, nothing)
+        node === nothing && break
+        if node.fstype !== nothing
+            fstype, mountpoint = node.fstype, joinpath("/", components[1:idx]...) * "/"
+        end
+    end
+    return fstype, mountpoint
+end
+
+struct PollFD
+    fd::Cint
+    events::Cshort
+    revents::Cshort
+end
+const POLLPRI = Cshort(0x002)
+const POLLERR = Cshort(0x008)
+
+# We parse the mount table only once, and keep `/proc/self/mountinfo` open to find out
+# when it changes: the kernel flags it with `POLLPRI` whenever something is (un)mounted.
+_mountinfo_io = nothing
+_mount_trie = nothing
+const _mount_trie_lock = ReentrantLock()
+function mount_trie()
+    global _mountinfo_io, _mount_trie
+    lock(_mount_trie_lock) do
+        if _mountinfo_io === nothing
+            if !isfile("/proc/self/mountinfo")
+                return nothing
+            end
+            _mountinfo_io = open("/proc/self/mountinfo")
+        else
+            pfd = Ref(PollFD(Base.cconvert(Cint, fd(_mountinfo_io)), POLLPRI, 0))
+            if ccall(:poll, Cint, (Ptr{PollFD}, Culong, Cint), pfd, 1, 0) > 0 &&
+               (pfd[].revents & (POLLPRI | POLLERR)) != 0
+                _mount_trie = nothing
+            end
+        end
+        if _mount_trie === nothing
+            seekstart(_mountinfo_io)
+            _mount_trie = MountTrie(read(_mountinfo_io, String))
+        end
+        return _mount_trie
     end
-    return max_time
 end
 
 """
@@ -36,43 +217,61 @@ function is_ecryptfs(path::AbstractString; verbose::Bool=false)
         @info("Checking to see if $path is encrypted...")
     end
 
-    # Get a listing of the current mounts.  If we can't do this, just give up
-    if !isfile("/proc/mounts")
+    # Get the current mount table.  If we can't do this, just give up
+    trie = mount_trie()
+    if trie === nothing
         if verbose
-            @info("Couldn't open /proc/mounts, returning...")
+            @info("Couldn't open /proc/self/mountinfo, returning...")
         end
         return false, path
     end
-    mounts = String(read("/proc/mounts"))
-
-    # Grab the fstype and the mountpoints
-    mounts = [split(m)[2:3] for m in split(mounts, "\n") if !isempty(m)]
 
-    # Canonicalize mountpoints now so as to dodge symlink difficulties
-    mounts = [(abspath(m[1]*"/"), m[2]) for m in mounts]
-
-    # Fast-path asking for a mountpoint directly (e.g. not a subdirectory)
-    direct_path = [m[1] == path for m in mounts]
-    local parent
-    if any(direct_path)
-        parent = mounts[findfirst(direct_path)]
-    else
-        # Find the longest prefix mount:
-        parent_mounts = [m for m in mounts if startswith(path, m[1])]
-        if isempty(parent_mounts)
-            # This is weird; this means that we can't find any mountpoints that
-            # hold the given path.  I've only ever seen this in `chroot`'ed scenarios.
-            return false, path
-        end
-        parent = parent_mounts[argmax(map(m->length(m[1]), parent_mounts))]
+    fstype, mountpoint = mountpoint_of(trie, path)
+    if fstype === nothing
+        # This is weird; this means that we can't find any mountpoints that
+        # hold the given path.  I've only ever seen this in `chroot`'ed scenarios.
+        return false, path
     end
 
     # Return true if this mountpoint is an ecryptfs mount
-    val = parent[2] == "ecryptfs"
+    val = fstype == "ecryptfs"
     if verbose && val
-        @info("  -> $path is encrypted from mountpoint $(parent[1])")
+        @info("  -> $path is encrypted from mountpoint $(mountpoint)")
+    end
+    return val, mountpoint
+end
+
+"""
+    filesystem_image_type(path::AbstractString)
+
+Checks whether `path` is a filesystem image that `sandbox` can mount in place of a
+directory, by looking for the squashfs or EROFS superblock magic.  Returns `:squashfs`,
+`:erofs`, or `nothing` if `path` is not a (recognized) image file.
+"""
+function filesystem_image_type(path::AbstractString)
+    if !isfile(path)
+        return nothing
+    end
+    try
+        open(path) do io
+            # squashfs puts its magic right at the start, EROFS puts its superblock at 1KB
+            if filesize(io) >= 4 && ltoh(read(io, UInt32)) == 0x73717368
+                return :squashfs
+            end
+            if filesize(io) >= 1028
+                seek(io, 1024)
+                if ltoh(read(io, UInt32)) == 0xe0f5e1e2
+                    return :erofs
+                end
+            end
+            return nothing
+        end
+    catch e
+        if !isa(e, Base.IOError) && !isa(e, SystemError)
+            rethrow(e)
+        end
+        return nothing
     end
-    return val, parent[1]
 end
 
 """
@@ -199,3 +398,85 @@ function sudo_cmd()
     end
     return _sudo_cmd
 end
+
+"""
+    parse_cpu_list(list::AbstractString)
+
+Parses a kernel CPU (or NUMA node) list such as `"0-3,8,10-11"` into the numbers it lists.
+"""
+function parse_cpu_list(list::AbstractString)
+    ids = Int[]
+    for range in split(strip(list), ","; keepempty=false)
+        bounds = parse.(Int, split(range, "-"))
+        append!(ids, first(bounds):last(bounds))
+    end
+    return ids
+end
+
+# The cgroup v2 directory that we are running in, if we are running in one
+function current_cgroup_dir()
+    isfile("/proc/self/cgroup") || return nothing
+    for line in eachline("/proc/self/cgroup")
+        if startswith(line, "0::")
+            dir = joinpath("/sys/fs/cgroup", lstrip(line[4:end], '/'))
+            return isdir(dir) ? dir : nothing
+        end
+    end
+    return nothing
+end
+
+"""
+    cpu_budget()
+
+How many CPUs worth of time we may use: the number of CPUs in our cgroup's cpuset, capped
+by the tightest `cpu.max` quota of our cgroup or any of its parents.
+"""
+function cpu_budget()
+    budget = Float64(Sys.CPU_THREADS)
+    dir = current_cgroup_dir()
+    if dir === nothing
+        return budget
+    end
+    cpuset_path = joinpath(dir, "cpuset.cpus.effective")
+    if isfile(cpuset_path)
+        cpus = parse_cpu_list(read(cpuset_path, String))
+        if !isempty(cpus)
+            budget = min(budget, length(cpus))
+        end
+    end
+    while startswith(dir, "/sys/fs/cgroup/")
+        cpu_max_path = joinpath(dir, "cpu.max")
+        if isfile(cpu_max_path)
+            quota, period = split(read(cpu_max_path, String))
+            if quota != "max"
+                budget = min(budget, parse(Int, quota) / parse(Int, period))
+            end
+        end
+        dir = dirname(dir)
+    end
+    return budget
+end
+
+"""
+    numa_node_cpus()
+
+Maps every NUMA node of this machine to the list of its CPUs (as a kernel CPU list such
+as `"0-7"`).  Machines without NUMA information get an empty `Dict`.
+"""
+function numa_node_cpus()
+    nodes = Dict{Int,String}()
+    nodes_dir = "/sys/devices/system/node"
+    isdir(nodes_dir) || return nodes
+    for name in readdir(nodes_dir)
+        m = match(r"^node(\d+)$", name)
+        cpulist_path = joinpath(nodes_dir, name, "cpulist")
+        if m !== nothing && isfile(cpulist_path)
+            cpus = strip(read(cpulist_path, String))
+            # Memory-only nodes have no CPUs to run anything on
+            if !isempty(cpus)
+                nodes[parse(Int, m[1])] = cpus
+            end
+        end
+    end
+    return nodes
+end
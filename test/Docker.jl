@@ -8,6 +8,95 @@ function with_temp_scratch(f::Function)
     end
 end
 
+@testset "rootfs change detection" begin
+    mktempdir() do dir
+        mkpath(joinpath(dir, "bin"))
+        mkpath(joinpath(dir, "usr", "lib"))
+        write(joinpath(dir, "bin", "sh"), "sh")
+        write(joinpath(dir, "usr", "lib", "libc.so"), "libc")
+        write(joinpath(dir, "init"), "init")
+
+        index = Sandbox.scan_directory(dir)
+        @test sort(collect(keys(index))) == ["bin", "init", "usr"]
+        @test index["usr"].num_entries == 3
+        @test index["bin"].total_size >= 2
+        @test Sandbox.changed_subtrees(index, Sandbox.scan_directory(dir)) == String[]
+        @test Sandbox.max_directory_ctime(dir; index) == maximum(fp.max_ctime for fp in values(index))
+
+        # Touching something deep within `usr` only marks `usr` as changed
+        sleep(0.01)
+        write(joinpath(dir, "usr", "lib", "libm.so"), "libm")
+        rm(joinpath(dir, "init"))
+        @test Sandbox.changed_subtrees(index, Sandbox.scan_directory(dir)) == ["init", "usr"]
+    end
+end
+
+@testset "filesystem images" begin
+    mktempdir() do dir
+        squashfs_path = joinpath(dir, "rootfs.squashfs")
+        write(squashfs_path, UInt8['h', 's', 'q', 's'], zeros(UInt8, 2048))
+        erofs_path = joinpath(dir, "rootfs.erofs")
+        write(erofs_path, zeros(UInt8, 1024), htol(0xe0f5e1e2), zeros(UInt8, 1024))
+        @test Sandbox.filesystem_image_type(squashfs_path) == :squashfs
+        @test Sandbox.filesystem_image_type(erofs_path) == :erofs
+        @test Sandbox.filesystem_image_type(dir) === nothing
+        @test Sandbox.filesystem_image_type(joinpath(dir, "nonexistent")) === nothing
+
+        # Docker has no way of mounting these, so it must refuse up front
+        config = SandboxConfig(Dict("/" => squashfs_path))
+        @test_throws ArgumentError Sandbox.build_executor_command(DockerExecutor(), config, `/bin/true`)
+    end
+end
+
+@testset "layer ownership" begin
+    mktempdir() do dir
+        mkpath(joinpath(dir, "root", "bin", "x"^120))
+        write(joinpath(dir, "root", "bin", "sh"), "sh")
+        write(joinpath(dir, "root", "bin", "x"^120, "data"), rand(UInt8, 3000))
+        run(`tar -c --format=gnu --numeric-owner --owner=0 --group=0 -f $(dir)/root.tar -C $(dir)/root .`)
+
+        # Only the owners change, and the digest is that of the rewritten tarball
+        digest = Sandbox.retar_with_owner(joinpath(dir, "root.tar"), joinpath(dir, "user.tar"), 1000, 1001)
+        @test digest == open(io -> bytes2hex(Sandbox.sha256(io)), joinpath(dir, "user.tar"))
+        @test filesize(joinpath(dir, "user.tar")) == filesize(joinpath(dir, "root.tar"))
+        listing = readlines(`tar -tvf $(dir)/user.tar --numeric-owner`)
+        @test length(listing) == 5
+        @test all(line -> occursin("1000/1001", line), listing)
+        mkpath(joinpath(dir, "extracted"))
+        run(`tar -xf $(dir)/user.tar -C $(dir)/extracted`)
+        @test read(joinpath(dir, "extracted", "bin", "x"^120, "data")) == read(joinpath(dir, "root", "bin", "x"^120, "data"))
+    end
+end
+
+@testset "docker image layers" begin
+    @test Sandbox.chain_ids(String[]) == String[]
+    diff_ids = ["sha256:" * "a"^64, "sha256:" * "b"^64]
+    ids = Sandbox.chain_ids(diff_ids)
+    @test ids[1] == diff_ids[1]
+    @test ids[2] == "sha256:" * bytes2hex(Sandbox.sha256("$(diff_ids[1]) $(diff_ids[2])"))
+
+    mktempdir() do dir
+        lower = joinpath(dir, "lower")
+        mkpath(joinpath(lower, "etc", "conf.d"))
+        write(joinpath(lower, "etc", "passwd"), "root")
+        write(joinpath(lower, "etc", "conf.d", "old"), "old")
+        upper = joinpath(dir, "upper")
+        mkpath(joinpath(upper, "etc", "conf.d"))
+        touch(joinpath(upper, "etc", ".wh.passwd"))
+        touch(joinpath(upper, "etc", "conf.d", ".wh..wh..opq"))
+        write(joinpath(upper, "etc", "conf.d", "new"), "new")
+
+        # Whiteouts become 0:0 character devices, opaque directories hide each lower entry
+        Sandbox.convert_docker_whiteouts(upper, [lower])
+        @test !ispath(joinpath(upper, "etc", ".wh.passwd"))
+        @test !ispath(joinpath(upper, "etc", "conf.d", ".wh..wh..opq"))
+        @test ischardev(joinpath(upper, "etc", "passwd"))
+        @test stat(joinpath(upper, "etc", "passwd")).rdev == 0
+        @test ischardev(joinpath(upper, "etc", "conf.d", "old"))
+        @test read(joinpath(upper, "etc", "conf.d", "new"), String) == "new"
+    end
+end
+
 if executor_available(DockerExecutor)
     @testset "Docker" begin
         uid = Sandbox.getuid()
@@ -37,11 +126,16 @@ if executor_available(DockerExecutor)
 
                 # Change the content
                 chmod(joinpath(rootfs_path, "bin", "busybox"), 0o775)
+                @test Sandbox.docker_image_changes(rootfs_path, uid, gid) == ["bin"]
                 @test Sandbox.should_build_docker_image(rootfs_path, uid, gid)
                 @test_logs (:info, r"Building docker image") match_mode=:any begin
                     Sandbox.build_docker_image(rootfs_path, uid, gid; verbose=true)
                 end
 
+                # The image is made up of multiple layers, and only the changed one got rebuilt
+                layers = readlines(`docker image inspect --format "{{range .RootFS.Layers}}{{println .}}{{end}}" $(Sandbox.docker_image_name(rootfs_path, uid, gid))`)
+                @test length(filter(!isempty, layers)) > 1
+
                 # Ensure that it once again doesn't try to build
                 @test !Sandbox.should_build_docker_image(rootfs_path, uid, gid)
                 @test_logs begin
@@ -58,6 +152,31 @@ if executor_available(DockerExecutor)
             end
         end
 
+        @testset "reuse_container" begin
+            mktempdir() do dir
+                config = SandboxConfig(Dict("/" => Sandbox.alpine_rootfs()), Dict("/work" => dir),
+                                       Dict("FOO" => "bar"); pwd="/work")
+                with_executor(DockerExecutor; reuse_container=true) do exe
+                    # Every command is an `exec` into the same container, so state carries over
+                    @test success(run(exe, config, `/bin/sh -c "echo \$FOO > /tmp/state"`))
+                    cmd = Sandbox.build_executor_command(exe, config, `/bin/cat /tmp/state`)
+                    @test cmd.exec[1:2] == ["docker", "exec"]
+                    @test length(exe.containers) == 1
+                    @test readchomp(cmd) == "bar"
+                    @test readchomp(`docker inspect --format "{{.State.Running}}" $(only(values(exe.containers)))`) == "true"
+
+                    # A different set of mounts needs a container of its own
+                    other_config = SandboxConfig(Dict("/" => Sandbox.alpine_rootfs()))
+                    @test !success(run(exe, other_config, ignorestatus(`/bin/cat /tmp/state`)))
+                    @test length(exe.containers) == 2
+
+                    cleanup(exe)
+                    @test isempty(exe.containers)
+                    @test isempty(readchomp(`docker ps -a --filter label=$(Sandbox.docker_image_label(exe)) --format "{{.ID}}"`))
+                end
+            end
+        end
+
         @testset "pull_docker_image" begin
             with_temp_scratch() do
                 julia_rootfs = Sandbox.pull_docker_image("julia:alpine"; force=true, verbose=true)
@@ -76,6 +195,16 @@ if executor_available(DockerExecutor)
 
                 # Ensure it pulls a rootfs that actually contains `julia`
                 @test isfile(joinpath(julia_rootfs, "usr", "local", "julia", "bin", "julia"))
+
+                # Exported as layers, the same files are there; exporting again skips them all
+                layers = Sandbox.export_docker_image_layers("julia:alpine")
+                @test !isempty(layers)
+                @test all(isdir, layers)
+                @test any(layer -> isfile(joinpath(layer, "usr", "local", "julia", "bin", "julia")), layers)
+                @test_logs (:info, "Exporting julia:alpine") match_mode=:any begin
+                    @test Sandbox.export_docker_image_layers("julia:alpine"; verbose=true) == layers
+                end
+                @test Sandbox.export_docker_image_layers("pleasenooneactuallycreateanimagenamedthis") === nothing
             end
         end
     end
@@ -40,6 +40,27 @@ for executor in all_executors
             end
         end
 
+        @testset "streaming output" begin
+            mktempdir() do dir
+                # Files get written to by the sandboxed command directly
+                config = SandboxConfig(Dict("/" => rootfs_dir); stdout=joinpath(dir, "out.log"),
+                                       stderr=joinpath(dir, "err.log"))
+                with_executor(executor) do exe
+                    @test success(exe, config, `/bin/sh -c "echo out; echo err >&2"`)
+                end
+                @test read(joinpath(dir, "out.log"), String) == "out\n"
+                @test read(joinpath(dir, "err.log"), String) == "err\n"
+
+                # Line callbacks see every line, including an unterminated last one
+                lines = String[]
+                config = SandboxConfig(Dict("/" => rootfs_dir); stdout=LineCallback(line -> push!(lines, line)))
+                with_executor(executor) do exe
+                    @test success(exe, config, `/bin/sh -c "for i in 1 2 3; do echo line\$i; done; printf last"`)
+                end
+                @test lines == ["line1", "line2", "line3", "last"]
+            end
+        end
+
         @testset "ignorestatus()" begin
             config = SandboxConfig(Dict("/" => rootfs_dir))
             with_executor(executor) do exe
@@ -94,6 +115,45 @@ for executor in all_executors
             end
         end
 
+        @testset "symlinked and file maps" begin
+            mktempdir() do dir
+                mkpath(joinpath(dir, "real"))
+                write(joinpath(dir, "real", "note.txt"), "through a link")
+                symlink(joinpath(dir, "real"), joinpath(dir, "link"))
+                write(joinpath(dir, "single.txt"), " and a file")
+                stdout = IOBuffer()
+                # Neither of the mountpoints, nor their parents, exist in the rootfs yet
+                config = SandboxConfig(
+                    Dict("/" => rootfs_dir, "/linked/dir" => joinpath(dir, "link"),
+                         "/some/where/single.txt" => joinpath(dir, "single.txt"));
+                    stdout,
+                )
+                with_executor(executor) do exe
+                    @test success(exe, config, `/bin/sh -c "cat /linked/dir/note.txt /some/where/single.txt"`)
+                    @test String(take!(stdout)) == "through a link and a file"
+                end
+            end
+        end
+
+        @testset "nested maps" begin
+            mktempdir() do dir
+                mkpath(joinpath(dir, "outer", "inner"))
+                mkpath(joinpath(dir, "shard"))
+                write(joinpath(dir, "outer", "note.txt"), "outer")
+                write(joinpath(dir, "shard", "note.txt"), "inner")
+                stdout = IOBuffer()
+                # The inner map must end up on top, whatever order the maps come in
+                config = SandboxConfig(
+                    Dict("/" => rootfs_dir, "/glados/inner" => joinpath(dir, "shard"), "/glados" => joinpath(dir, "outer"));
+                    stdout,
+                )
+                with_executor(executor) do exe
+                    @test success(exe, config, `/bin/sh -c "cat /glados/note.txt /glados/inner/note.txt"`)
+                    @test String(take!(stdout)) == "outerinner";
+                end
+            end
+        end
+
         @testset "writing to workspaces" begin
             mktempdir() do dir
                 stdout = IOBuffer()
@@ -239,6 +299,144 @@ for executor in all_executors
             end
         end
 
+        if !(executor <: UserNamespacesExecutor) || Sandbox.sandbox_supports("--layer")
+            @testset "rootfs layers" begin
+                mktempdir() do dir
+                    # Each layer adds to or replaces what is beneath it
+                    mkpath(joinpath(dir, "a", "bin"))
+                    mkpath(joinpath(dir, "b", "bin"))
+                    write(joinpath(dir, "a", "bin", "science"), "a\n")
+                    write(joinpath(dir, "a", "bin", "aperture"), "a\n")
+                    write(joinpath(dir, "b", "bin", "science"), "b\n")
+                    stdout = IOBuffer()
+                    config = SandboxConfig(Dict("/" => rootfs_dir); stdout,
+                                           rootfs_layers=[joinpath(dir, "a"), joinpath(dir, "b")])
+                    with_executor(executor) do exe
+                        @test success(exe, config, `/bin/sh -c "cat /bin/science /bin/aperture; test -x /bin/busybox"`)
+                        @test String(take!(stdout)) == "b\na\n"
+                    end
+                end
+            end
+        end
+
+        if executor <: UserNamespacesExecutor && Sandbox.sandbox_supports("--layer")
+            @testset "snapshots" begin
+                stdout = IOBuffer()
+                config = SandboxConfig(Dict("/" => rootfs_dir); stdout, persist=true)
+                with_executor(executor) do exe
+                    @test_throws ErrorException snapshot(exe)
+                    @test success(exe, config, `/bin/sh -c "echo toolchain > /bin/science; rm /bin/echo"`)
+                    snap = snapshot(exe)
+                    try
+                        @test length(snap.layers) == 1
+                        @test exe.snapshot === snap
+
+                        # Forks each see the snapshot, but not each other's changes
+                        cmd = `/bin/sh -c "cat /bin/science; test -e /bin/echo || printf gone; printf x >> /bin/fork; cat /bin/fork"`
+                        for _ in 1:2
+                            with_executor(executor; snapshot=snap) do fork
+                                @test success(fork, config, cmd)
+                                @test String(take!(stdout)) == "toolchain\ngonex"
+                            end
+                        end
+
+                        # The original executor carries on from the snapshot
+                        @test success(exe, config, cmd)
+                        @test String(take!(stdout)) == "toolchain\ngonex"
+                        child = snapshot(exe)
+                        @test child.layers == vcat(snap.layers, joinpath(child.path, "rootfs"))
+                        cleanup(child)
+                    finally
+                        cleanup(snap)
+                    end
+                    @test !ispath(snap.path)
+                end
+            end
+        end
+
+        # The changes of privileged executors are owned by root
+        if executor <: UnprivilegedUserNamespacesExecutor ||
+           (executor <: PrivilegedUserNamespacesExecutor && Sandbox.getuid() == 0)
+            @testset "changes" begin
+                config = SandboxConfig(Dict("/" => rootfs_dir); persist=true)
+                with_executor(executor) do exe
+                    @test_throws ErrorException list_changes(exe)
+                    cmd = `/bin/sh -c "mkdir -p /out/sub && echo built > /out/sub/result && ln -s result /out/sub/link && mkfifo /out/sub/pipe && rm /bin/echo"`
+                    @test success(exe, config, cmd)
+
+                    changes = list_changes(exe)
+                    @test SandboxChange("/out", :directory) in changes
+                    @test SandboxChange("/bin/echo", :deleted) in changes
+                    @test list_changes(exe; prefix="/out/sub") == [
+                        SandboxChange("/out/sub", :directory),
+                        SandboxChange("/out/sub/link", :symlink),
+                        SandboxChange("/out/sub/pipe", :special),
+                        SandboxChange("/out/sub/result", :file),
+                    ]
+                    @test isempty(list_changes(exe; prefix="/nonexistent"))
+
+                    mktempdir() do dir
+                        extract_changes(exe, dir; prefix="/out")
+                        @test read(joinpath(dir, "out", "sub", "result"), String) == "built\n"
+                        @test readlink(joinpath(dir, "out", "sub", "link")) == "result"
+                        @test !ispath(joinpath(dir, "out", "sub", "pipe"))
+                        @test !ispath(joinpath(dir, "bin"))
+                    end
+
+                    # As a tarball, deletions become whiteouts
+                    tarball = take!(extract_changes(IOBuffer(), exe))
+                    paths = [header.path for header in Sandbox.Tar.list(IOBuffer(tarball))]
+                    @test "out/sub/result" in paths
+                    @test "out/sub/pipe" ∉ paths
+                    @test "bin/.wh.echo" in paths
+                end
+            end
+        end
+
+        if !(executor <: UserNamespacesExecutor) || Sandbox.sandbox_supports("--tmpfs-size")
+            @testset "scratch space" begin
+                mktempdir() do dir
+                    stdout = IOBuffer()
+                    config = SandboxConfig(Dict("/" => rootfs_dir); tmpfs_size="64M", tmpfs_huge=true, stdout)
+                    cmd = `/bin/sh -c "head -c 1048576 /dev/urandom > /bin/science && wc -c < /bin/science"`
+                    with_executor(executor) do exe
+                        @test success(exe, config, cmd)
+                        @test strip(String(take!(stdout))) == "1048576"
+                    end
+
+                    # Disk-backed scratch space gets cleaned up after every run
+                    config = SandboxConfig(Dict("/" => rootfs_dir); scratch_dir=dir, stdout)
+                    with_executor(executor) do exe
+                        @test success(exe, config, cmd)
+                        @test strip(String(take!(stdout))) == "1048576"
+                    end
+                    @test isempty(readdir(dir))
+                end
+            end
+        end
+
+        @testset "tracing" begin
+            config = SandboxConfig(Dict("/" => rootfs_dir); stdout=devnull)
+            with_executor(executor) do exe
+                trace = run(exe, config, ignorestatus(`/bin/sh -c "exit 3"`); trace=true)
+                @test isa(trace, SandboxTrace)
+                @test !success(trace)
+                @test trace.process.exitcode == 3
+                if executor <: UserNamespacesExecutor && Sandbox.sandbox_supports("--trace-file")
+                    @test trace.exitcode == 3
+                    @test trace.pid !== nothing
+                    @test "overlay" in first.(trace.phases)
+                    @test "pivot" in first.(trace.phases)
+                    @test any(m -> m.kind == "overlay" && m.target == rootfs_dir, trace.mounts)
+                    @test trace.wall_ms > 0
+                    @test trace.usage.max_rss_kb > 0
+                    @test trace.usage.minor_faults > 0
+                    @test trace.usage.user_ms + trace.usage.system_ms > 0
+                end
+                @test_throws ArgumentError run(exe, config, `/bin/true`; trace=true, wait=false)
+            end
+        end
+
         @testset "explicit user and group" begin
             for (uid,gid) in [(0,0), (999,0), (0,999), (999,999)]
                 stdout = IOBuffer()
@@ -256,6 +454,213 @@ for executor in all_executors
             end
         end
 
+        @testset "batched commands" begin
+            config = SandboxConfig(Dict("/" => rootfs_dir))
+            user_cmds = [`/bin/sh -c "echo $(idx); echo err$(idx) >&2; exit $(idx % 3)"` for idx in 1:6]
+            with_executor(executor) do exe
+                for parallelism in (1, 3)
+                    results = run(exe, config, user_cmds; parallelism)
+                    @test length(results) == length(user_cmds)
+                    for (idx, result) in enumerate(results)
+                        @test result.cmd == user_cmds[idx]
+                        @test result.exitcode == idx % 3
+                        @test success(result) == (idx % 3 == 0)
+                        @test result.stdout == "$(idx)\n"
+                        @test result.stderr == "err$(idx)\n"
+                    end
+                end
+            end
+        end
+
+        if executor <: UserNamespacesExecutor && Sandbox.sandbox_supports("--serve")
+            @testset "zygote" begin
+                stdout = IOBuffer()
+                stderr = IOBuffer()
+                config = SandboxConfig(
+                    Dict("/" => rootfs_dir),
+                    Dict{String,String}(),
+                    Dict("PATH" => "/bin:/usr/bin");
+                    stdout,
+                    stderr,
+                    pwd = "/tmp",
+                )
+                with_executor(executor; zygote=true) do exe
+                    # Commands served by the same zygote share its rootfs overlay
+                    cmd = `/bin/sh -c "echo aperture >> science && cat science"`
+                    @test success(exe, config, cmd)
+                    @test String(take!(stdout)) == "aperture\n"
+                    @test success(exe, config, cmd)
+                    @test String(take!(stdout)) == "aperture\naperture\n"
+                    @test length(exe.zygotes) == 1
+
+                    # Environment and exit codes make it through the zygote
+                    @test success(exe, config, setenv(`/bin/sh -c "echo \$SHELL; echo stderr >&2"`, "SHELL" => "monster"))
+                    @test String(take!(stdout)) == "monster\n"
+                    @test String(take!(stderr)) == "stderr\n"
+                    @test !success(exe, config, ignorestatus(`/bin/sh -c "exit 3"`))
+                end
+            end
+        end
+
+        if executor <: UserNamespacesExecutor && Sandbox.sandbox_supports("--pin")
+            @testset "join" begin
+                stdout = IOBuffer()
+                config = SandboxConfig(
+                    Dict("/" => rootfs_dir),
+                    Dict{String,String}(),
+                    Dict("PATH" => "/bin:/usr/bin");
+                    stdout,
+                    pwd = "/tmp",
+                )
+                with_executor(executor; join=true) do exe
+                    @test exe.zygote
+                    # Commands joining the same pinned sandbox share its rootfs overlay and pid namespace
+                    cmd = `/bin/sh -c "echo aperture >> science && cat science"`
+                    @test success(exe, config, cmd)
+                    @test String(take!(stdout)) == "aperture\n"
+                    @test success(exe, config, cmd)
+                    @test String(take!(stdout)) == "aperture\naperture\n"
+                    @test length(exe.zygotes) == 1
+                    @test success(exe, config, `/bin/sh -c "kill -0 1"`)
+
+                    @test success(exe, config, setenv(`/bin/sh -c "echo \$SHELL"`, "SHELL" => "monster"))
+                    @test String(take!(stdout)) == "monster\n"
+                    @test !success(exe, config, ignorestatus(`/bin/sh -c "exit 3"`))
+                end
+            end
+        end
+
+        if executor <: UserNamespacesExecutor
+            @testset "cancellation" begin
+                config = SandboxConfig(Dict("/" => rootfs_dir))
+                with_executor(executor) do exe
+                    # The command gets a SIGTERM, and whatever it left behind goes down with it
+                    sandbox_run = run_async(exe, config, `/bin/sh -c "sleep 1000 & sleep 1000"`; timeout=1)
+                    @test process_running(sandbox_run)
+                    t_start = time()
+                    @test !success(sandbox_run)
+                    @test sandbox_run.cancelled
+                    @test sandbox_run.process.exitcode == 128 + 15
+                    @test time() - t_start < 5
+
+                    # A command that ignores it gets killed, along with everything else, a little later
+                    sandbox_run = run_async(exe, config, `/bin/sh -c "trap '' TERM; sleep 1000"`)
+                    sleep(1)
+                    cancel(sandbox_run)
+                    @test !success(sandbox_run)
+                    @test sandbox_run.process.exitcode == 128 + 9
+
+                    sandbox_run = run_async(exe, config, `/bin/true`; timeout=60)
+                    @test success(sandbox_run)
+                    @test !sandbox_run.cancelled
+
+                    # Killing the sandbox itself (or the `sudo` it runs under) takes the command along
+                    sandbox_run = run_async(exe, config, `/bin/sh -c "trap '' TERM; sleep 1001"`)
+                    sleep(1)
+                    cancel(sandbox_run; kill_timeout=1)
+                    @test !success(sandbox_run)
+                    sleep(1)
+                    @test !success(`pgrep -f "sleep 1001"`)
+                end
+
+                # Zygote clients pass it on to everything their command started
+                with_executor(executor; zygote=true) do exe
+                    sandbox_run = run_async(exe, config, `/bin/sh -c "sleep 1002 & sleep 1003"`; timeout=1)
+                    @test !success(sandbox_run)
+                    @test sandbox_run.process.exitcode == 128 + 15
+                    sleep(1)
+                    @test !success(`pgrep -f "sleep 100[23]"`)
+
+                    sandbox_run = run_async(exe, config, `/bin/sh -c "trap '' TERM; sleep 1004 & sleep 1005"`)
+                    sleep(1)
+                    cancel(sandbox_run; kill_timeout=1)
+                    @test !success(sandbox_run)
+                    sleep(1)
+                    @test !success(`pgrep -f "sleep 100[45]"`)
+                end
+            end
+        end
+
+        if executor <: UserNamespacesExecutor
+            @testset "prewarming" begin
+                config = SandboxConfig(Dict("/" => rootfs_dir); stdout=devnull)
+                with_executor(executor) do exe
+                    # Evicting is only advice, which the kernel may not take (e.g. for pages
+                    # that are mapped elsewhere); we can only see the shell read what is gone.
+                    busybox = joinpath(rootfs_dir, "bin", "busybox")
+                    Sandbox.fadvise(busybox, Cint(Sandbox.POSIX_FADV_DONTNEED))
+                    evicted = Sandbox.resident_pages(busybox) == 0
+
+                    # Everything the shell needs to start up is read from the rootfs
+                    accesses = Sandbox.record_accesses(exe, config, `/bin/sh -c "true"`; evict=true)
+                    if evicted
+                        @test busybox in accesses
+                    else
+                        @test_skip busybox in accesses
+                    end
+                    @test all(path -> startswith(path, rootfs_dir), accesses)
+                    @test Sandbox.resident_pages(busybox) > 0
+
+                    warmed = Sandbox.prewarm(config; accesses)
+                    @test warmed >= filesize(busybox)
+                    @test Sandbox.prewarm(config) >= warmed
+                end
+            end
+        end
+
+        @testset "executor pool" begin
+            config = SandboxConfig(Dict("/" => rootfs_dir))
+            pool = ExecutorPool(executor; size=2, warm_config=config)
+            try
+                @test length(pool.executors) == 2
+                used = Channel{Any}(Inf)
+                @sync for idx in 1:4
+                    @async with_executor(pool) do exe
+                        put!(used, exe)
+                        @test success(exe, config, `/bin/sh -c "exit 0"`)
+                    end
+                end
+                close(used)
+                # Every task ran on one of the pool's executors, none were created on the side
+                @test all(exe -> any(e -> e === exe, pool.executors), collect(used))
+
+                exe = checkout(pool)
+                @test any(e -> e === exe, pool.executors)
+                checkin(pool, exe)
+                with_executor(executor) do other
+                    @test_throws ArgumentError checkin(pool, other)
+                end
+            finally
+                cleanup(pool)
+            end
+        end
+
+        @testset "fanout" begin
+            config = SandboxConfig(Dict("/" => rootfs_dir), Dict{String,String}(), Dict("PATH" => "/bin:/usr/bin"))
+            inputs = ["input-$(idx)" for idx in 1:6]
+            used = Channel{Any}(Inf)
+            results = fanout(inputs, config; executor, concurrency=2) do exe, config, input
+                put!(used, exe)
+                io = IOBuffer()
+                run(exe, SandboxConfig(config; stdout=io), `/bin/sh -c "echo $(input) | rev"`)
+                return String(take!(io))
+            end
+            collected = Dict(collect(results))
+            @test collected == Dict(idx => "$(reverse(input))\n" for (idx, input) in enumerate(inputs))
+            close(used)
+            @test length(unique(objectid, collect(used))) <= 2
+
+            # Failures make it out to whoever is collecting the results
+            results = fanout(1:4, config; executor, concurrency=2) do exe, config, input
+                input == 3 && error("boom")
+                return success(exe, config, `/bin/sh -c "exit 0"`)
+            end
+            @test_throws Exception collect(results)
+
+            @test_throws ArgumentError fanout((exe, config, input) -> nothing, 1:2, config; executor, concurrency=0)
+            @test Sandbox.default_concurrency(config) >= 1
+        end
+
         # If we have the docker executor available (necessary to do the initial pull),
         # let's test launching off of a docker image
         if executor_available(DockerExecutor)
@@ -280,6 +685,65 @@ for executor in all_executors
             end
         end
 
+        if executor <: UserNamespacesExecutor && Sandbox.sandbox_supports("--seccomp") &&
+           haskey(Sandbox.AUDIT_ARCH, Sys.ARCH)
+            @testset "seccomp" begin
+                stderr = IOBuffer()
+                config = SandboxConfig(Dict("/" => rootfs_dir); stderr,
+                                       seccomp=SeccompPolicy(["chroot"]; errno=13))
+                with_executor(executor) do exe
+                    @test success(exe, config, `/bin/sh -c "ls / > /dev/null"`)
+                    @test !success(exe, config, ignorestatus(`/bin/sh -c "chroot / /bin/true"`))
+                    @test occursin("Permission denied", String(take!(stderr)))
+                end
+            end
+        end
+
+        if executor <: UserNamespacesExecutor && Sandbox.sandbox_supports("--args-file")
+            @testset "argument files" begin
+                mktempdir() do dir
+                    write(joinpath(dir, "note.txt"), "mapped")
+                    stdout = IOBuffer()
+                    # Enough maps that their arguments go through a file instead of argv
+                    maps = Dict("/maps/$(idx)/$("x"^32)" => dir for idx in 1:2000)
+                    maps["/"] = rootfs_dir
+                    config = SandboxConfig(maps, Dict{String,String}(), Dict("FOO" => "foo"); stdout)
+                    with_executor(executor) do exe
+                        cmd = Sandbox.build_executor_command(exe, config, `/bin/true`)
+                        @test "--args-file" in cmd.exec
+                        @test success(exe, config, `/bin/sh -c "cat /maps/2000/$("x"^32)/note.txt; ls /maps | wc -l"`)
+                        @test success(exe, config, setenv(`/bin/sh -c "echo \$FOO\$BAR"`, "BAR" => "bar"))
+                        @test String(take!(stdout)) == "mapped2000\nfoobar\n"
+
+                        # The arguments were only worked out once, for all of those commands
+                        @test length(exe.templates) == 1
+                        args_file = only(values(exe.templates)).args_file
+                        @test isfile(args_file)
+
+                        # Configs that only differ in their stdio share them, too
+                        other = SandboxConfig(maps, Dict{String,String}(), Dict("FOO" => "foo"); stdout=devnull)
+                        @test Sandbox.build_executor_command(exe, other, `/bin/true`).exec == cmd.exec
+                        @test length(exe.templates) == 1
+                        cleanup(exe)
+                        @test !isfile(args_file)
+                    end
+                end
+            end
+        end
+
+        if executor <: DockerExecutor || Sandbox.sandbox_supports("--network")
+            @testset "network isolation" begin
+                stdout = IOBuffer()
+                config = SandboxConfig(Dict("/" => rootfs_dir); stdout, network=:loopback)
+                with_executor(executor) do exe
+                    # Nothing but the loopback interface, which is up
+                    @test success(exe, config, `/bin/sh -c "tail -n +3 /proc/net/dev | cut -d: -f1 | tr -d ' '"`)
+                    @test String(take!(stdout)) == "lo\n"
+                    @test success(exe, config, `/bin/sh -c "ip link show lo | grep -q UP"`)
+                end
+            end
+        end
+
         @testset "Internet access" begin
             mktempdir() do rw_dir
                 ro_mappings = Dict(
@@ -45,6 +45,105 @@ using Test, LazyArtifacts, Sandbox
         @test config.stdin == Base.stdout
         @test config.stdout == stdout
         @test config.stderr == Base.devnull
+        @test config.tmpfs_size === nothing
+        @test !config.tmpfs_huge
+        @test config.scratch_dir === nothing
+    end
+
+    @testset "scratch space" begin
+        config = SandboxConfig(Dict("/" => rootfs_dir); tmpfs_size=512*1024^2, tmpfs_huge=true)
+        @test config.tmpfs_size == string(512*1024^2)
+        @test config.tmpfs_huge
+        config = SandboxConfig(Dict("/" => rootfs_dir); tmpfs_size="50%", scratch_dir="/tmp")
+        @test config.tmpfs_size == "50%"
+        @test config.scratch_dir == "/tmp"
+    end
+
+    @testset "output" begin
+        config = SandboxConfig(Dict("/" => rootfs_dir); stdout="/tmp/out.log")
+        @test config.stdout == "/tmp/out.log"
+
+        lines = String[]
+        io = LineCallback(line -> push!(lines, line))
+        print(io, "one\ntw")
+        print(io, "o\n\nthree")
+        @test lines == ["one", "two", ""]
+        flush(io)
+        @test lines == ["one", "two", "", "three"]
+        flush(io)
+        @test length(lines) == 4
+    end
+
+    @testset "rootfs layers" begin
+        config = SandboxConfig(Dict("/" => rootfs_dir))
+        @test isempty(config.rootfs_layers)
+        config = SandboxConfig(Dict("/" => rootfs_dir); rootfs_layers=["/layers/a", "/layers/b"])
+        @test config.rootfs_layers == ["/layers/a", "/layers/b"]
+    end
+
+    @testset "resource limits" begin
+        config = SandboxConfig(Dict("/" => rootfs_dir))
+        @test config.cpus === nothing
+        @test config.memory === nothing
+        @test isempty(config.io_max)
+        config = SandboxConfig(Dict("/" => rootfs_dir); cpus=2, memory=512*1024^2, cpuset="0-1",
+                               numa_nodes="0", io_max=["8:0 wbps=1048576"], cgroup="/sys/fs/cgroup/sandbox")
+        @test config.cpus === 2.0
+        @test config.memory == 512*1024^2
+        @test config.cpuset == "0-1"
+        @test config.numa_nodes == "0"
+        @test config.io_max == ["8:0 wbps=1048576"]
+        @test config.cgroup == "/sys/fs/cgroup/sandbox"
+    end
+
+    @testset "mount table" begin
+        trie = Sandbox.MountTrie("""
+        22 1 8:1 / / rw,relatime shared:1 - ext4 /dev/sda1 rw
+        30 22 0:25 / /home rw shared:5 - ext4 /dev/sda2 rw
+        31 30 0:26 / /home/user/Private rw - ecryptfs /home/user/.Private rw
+        32 22 0:27 / /mnt/with\\040space rw - tmpfs tmpfs rw
+        33 22 0:28 / /srv/data rw - ext4 /dev/sdb1 rw
+        34 22 0:29 / /srv rw - tmpfs tmpfs rw
+        """)
+        @test Sandbox.mountpoint_of(trie, "/usr/bin") == ("ext4", "/")
+        @test Sandbox.mountpoint_of(trie, "/home/user") == ("ext4", "/home/")
+        @test Sandbox.mountpoint_of(trie, "/home/user/Private/secrets") == ("ecryptfs", "/home/user/Private/")
+        # Mounting over a directory hides whatever was mounted beneath it before
+        @test Sandbox.mountpoint_of(trie, "/srv/data/file") == ("tmpfs", "/srv/")
+        @test Sandbox.mountpoint_of(trie, "/mnt/with space/file") == ("tmpfs", "/mnt/with space/")
+
+        if Sys.islinux()
+            @test Sandbox.is_ecryptfs("/") == (false, "/")
+            @test Sandbox.mount_trie() === Sandbox.mount_trie()
+        end
+    end
+
+    @testset "copies" begin
+        config = SandboxConfig(Dict("/" => rootfs_dir), Dict("/workspace" => "/tmp"), Dict("FOO" => "bar");
+                               pwd="/workspace", cpus=2, verbose=true)
+        copied = SandboxConfig(config; pwd="/tmp", cpuset="0-1")
+        @test copied.pwd == "/tmp"
+        @test copied.cpuset == "0-1"
+        @test copied.cpus == 2.0
+        @test copied.verbose
+        @test copied.read_write_maps == config.read_write_maps
+        @test copied.env == Dict("FOO" => "bar")
+        # Copies don't share their maps with the original
+        copied.env["FOO"] = "baz"
+        @test config.env["FOO"] == "bar"
+        @test SandboxConfig(config; env=Dict("A" => "B")).env == Dict("A" => "B")
+        @test_throws ArgumentError SandboxConfig(config; pwd="relative")
+    end
+
+    @testset "cpu lists" begin
+        @test Sandbox.parse_cpu_list("0-3,8,10-11\n") == [0, 1, 2, 3, 8, 10, 11]
+        @test Sandbox.parse_cpu_list("") == Int[]
+        @test 0 < Sandbox.cpu_budget() <= Sys.CPU_THREADS
+    end
+
+    @testset "network" begin
+        @test SandboxConfig(Dict("/" => rootfs_dir)).network === :host
+        @test SandboxConfig(Dict("/" => rootfs_dir); network=:loopback).network === :loopback
     end
 
     @testset "errors" begin
@@ -58,5 +157,15 @@ using Test, LazyArtifacts, Sandbox
         @test_throws ArgumentError SandboxConfig(Dict("/" => rootfs_dir), Dict("/rootfs" => basename(rootfs_dir)))
         @test_throws ArgumentError SandboxConfig(Dict("/" => rootfs_dir); pwd="lib")
         @test_throws ArgumentError SandboxConfig(Dict("/" => rootfs_dir); entrypoint="init")
+        @test_throws ArgumentError SandboxConfig(Dict("/" => rootfs_dir); scratch_dir="tmp")
+        @test_throws ArgumentError SandboxConfig(Dict("/" => rootfs_dir); rootfs_layers=["layers/a"])
+        @test_throws ArgumentError SandboxConfig(Dict("/" => rootfs_dir); scratch_dir="/tmp", persist=true)
+        @test_throws ArgumentError SandboxConfig(Dict("/" => rootfs_dir); tmpfs_size=0)
+        @test_throws ArgumentError SandboxConfig(Dict("/" => rootfs_dir); tmpfs_size="1G,mode=777")
+        @test_throws ArgumentError SandboxConfig(Dict("/" => rootfs_dir); tmpfs_size="G")
+        @test_throws ArgumentError SandboxConfig(Dict("/" => rootfs_dir); cpus=0)
+        @test_throws ArgumentError SandboxConfig(Dict("/" => rootfs_dir); memory=-1)
+        @test_throws ArgumentError SandboxConfig(Dict("/" => rootfs_dir); cgroup="sandbox")
+        @test_throws ArgumentError SandboxConfig(Dict("/" => rootfs_dir); network=:bridge)
     end
 end
@@ -0,0 +1,83 @@
+using Test, Sandbox
+
+@testset "Seccomp" begin
+    @testset "policies" begin
+        policy = SeccompPolicy(["ptrace", "mount", "ptrace", 165])
+        @test policy.denied == ["ptrace", "mount", 165]
+        @test policy.errno == 1
+        @test policy == SeccompPolicy(["ptrace", "mount", 165])
+        @test hash(policy) == hash(SeccompPolicy(["ptrace", "mount", 165]))
+        @test policy != SeccompPolicy(["ptrace", "mount", 165]; errno=13)
+
+        @test_throws ArgumentError SeccompPolicy(["ptrace"]; errno=0)
+        @test_throws ArgumentError SeccompPolicy(["ptrace"]; errno=4096)
+        @test_throws ArgumentError SeccompPolicy([-1])
+        @test_throws ArgumentError SeccompPolicy([:ptrace])
+    end
+
+    @testset "compilation" begin
+        insns(bytes) = [(code = reinterpret(UInt16, bytes[i:i+1])[1], jt = bytes[i+2], jf = bytes[i+3],
+                         k = reinterpret(UInt32, bytes[i+4:i+7])[1]) for i in 1:8:length(bytes)]
+
+        prog = insns(Sandbox.compile_seccomp(SeccompPolicy(["ptrace", "mount", "read", 1000]; errno=13); arch=:x86_64))
+        # Check the architecture first, then load the syscall number
+        @test prog[1].code == Sandbox.BPF_LD_W_ABS && prog[1].k == 4
+        @test prog[2].k == Sandbox.AUDIT_ARCH[:x86_64] && prog[2].jt == 2
+        @test prog[3].k == Sandbox.AUDIT_ARCH_I386
+        @test prog[4].k == Sandbox.SECCOMP_RET_KILL_PROCESS
+        @test prog[5].code == Sandbox.BPF_LD_W_ABS && prog[5].k == 0
+        @test prog[end-1].k == Sandbox.SECCOMP_RET_ALLOW
+        @test prog[end].k == Sandbox.SECCOMP_RET_ERRNO | 13
+
+        # The native checks end in a return of their own, followed by those for i386
+        target(idx) = idx + prog[idx].jt + 1
+        i386_start = target(3)
+        @test prog[i386_start - 1].k == Sandbox.SECCOMP_RET_ALLOW
+        @test prog[i386_start].code == Sandbox.BPF_LD_W_ABS && prog[i386_start].k == 0
+
+        # Every comparison is a jump to one of the two returns
+        returns = (length(prog) - 1, length(prog))
+        for (compares, expected) in ((6:i386_start-2, [Sandbox.X32_SYSCALL_BIT, 101, 165, 0, 1000]),
+                                     (i386_start+1:length(prog)-2, [26, 21, 3]))
+            @test all(idx -> target(idx) ∈ returns, compares)
+            allowed = [prog[idx].k for idx in compares if target(idx) == length(prog) - 1]
+            denied = [prog[idx].k for idx in compares if target(idx) == length(prog)]
+            @test sort(denied) == sort(expected)
+            @test !isempty(allowed) && all(nr -> nr ∉ denied, allowed)
+        end
+
+        # Hot syscalls come first, except when they are denied
+        allowed = [prog[idx].k for idx in 7:i386_start-2 if target(idx) == length(prog) - 1]
+        @test all(idx -> target(idx) == length(prog) - 1, 7:6+length(allowed))
+        @test 1 ∈ allowed && 0 ∉ allowed
+
+        # Everything we know by name for x86_64 is known for i386 too, unless it doesn't exist there
+        @test setdiff(keys(Sandbox.SYSCALL_NUMBERS[:x86_64]), keys(Sandbox.I386_SYSCALL_NUMBERS)) ==
+              Set(Sandbox.I386_MISSING_SYSCALLS)
+
+        # There is no x32 ABI to worry about on aarch64
+        prog = insns(Sandbox.compile_seccomp(SeccompPolicy(["ptrace"]); arch=:aarch64))
+        @test prog[2].k == Sandbox.AUDIT_ARCH[:aarch64]
+        @test prog[3].k == Sandbox.SECCOMP_RET_KILL_PROCESS
+        @test !any(insn -> insn.k == Sandbox.AUDIT_ARCH_I386, prog)
+        @test count(insn -> insn.k == 117, prog) == 1
+        @test !any(insn -> insn.k == Sandbox.X32_SYSCALL_BIT, prog)
+
+        @test_throws ArgumentError Sandbox.compile_seccomp(SeccompPolicy(["not_a_syscall"]); arch=:x86_64)
+        @test_throws ArgumentError Sandbox.compile_seccomp(SeccompPolicy(["ptrace"]); arch=:powerpc64le)
+    end
+
+    if haskey(Sandbox.AUDIT_ARCH, Sys.ARCH)
+        @testset "caching" begin
+            policy = SeccompPolicy(["ptrace", "kexec_load"])
+            path = Sandbox.seccomp_filter_path(policy)
+            @test isfile(path)
+            @test read(path) == Sandbox.compile_seccomp(policy)
+            @test Sandbox.seccomp_filter_path(SeccompPolicy(["ptrace", "kexec_load"])) == path
+            @test Sandbox.seccomp_filter_path(SeccompPolicy(["ptrace"])) != path
+
+            profile = read(Sandbox.docker_seccomp_profile(policy), String)
+            @test occursin("\"names\": [\"ptrace\", \"kexec_load\"]", profile)
+        end
+    end
+end
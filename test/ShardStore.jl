@@ -0,0 +1,49 @@
+using Test, Sandbox
+
+@testset "ShardStore" begin
+    mktempdir() do dir
+        store = joinpath(dir, "store")
+        library = rand(UInt8, 3 * Sandbox.SHARD_STORE_MIN_SIZE)
+        for tree in ("alpine", "debian")
+            mkpath(joinpath(dir, tree, "lib"))
+            write(joinpath(dir, tree, "lib", "libc.so"), library)
+            write(joinpath(dir, tree, "lib", "small"), "small")
+            write(joinpath(dir, tree, "lib", "$(tree).so"), rand(UInt8, Sandbox.SHARD_STORE_MIN_SIZE))
+            write(joinpath(dir, tree, "lib", "writable.so"), library)
+            run(`touch -d @1000000000 $(joinpath(dir, tree, "lib", "libc.so"))`)
+            for name in ("libc.so", "small", "$(tree).so")
+                chmod(joinpath(dir, tree, "lib", name), 0o444)
+            end
+        end
+        # The same file, but from a different point in time
+        mkpath(joinpath(dir, "ubuntu", "lib"))
+        write(joinpath(dir, "ubuntu", "lib", "libc.so"), library)
+        chmod(joinpath(dir, "ubuntu", "lib", "libc.so"), 0o444)
+        # Left behind by an earlier run that got interrupted
+        write(joinpath(dir, "debian", "lib", "libc.so.partial"), "stale")
+        chmod(joinpath(dir, "debian", "lib"), 0o555)
+
+        # The first tree donates its files to the store, the second one links to them
+        @test Sandbox.dedup_tree(joinpath(dir, "alpine"), store) == 0
+        @test Sandbox.dedup_tree(joinpath(dir, "debian"), store) == length(library)
+        @test stat(joinpath(dir, "alpine", "lib", "libc.so")).inode == stat(joinpath(dir, "debian", "lib", "libc.so")).inode
+        @test stat(joinpath(dir, "alpine", "lib", "libc.so")).nlink == 3
+        @test read(joinpath(dir, "debian", "lib", "libc.so")) == library
+        @test stat(joinpath(dir, "debian", "lib", "small")).nlink == 1
+        @test stat(joinpath(dir, "debian", "lib", "debian.so")).nlink == 2
+        @test filemode(joinpath(dir, "debian", "lib")) & 0o777 == 0o555
+        @test filemode(joinpath(dir, "debian", "lib", "libc.so")) & 0o777 == 0o444
+        @test mtime(joinpath(dir, "debian", "lib", "libc.so")) == 1000000000
+        @test !ispath(joinpath(dir, "debian", "lib", "libc.so.partial"))
+
+        # Files that could still be written to are never shared, and keep their permissions
+        @test stat(joinpath(dir, "debian", "lib", "writable.so")).nlink == 1
+        @test filemode(joinpath(dir, "debian", "lib", "writable.so")) & 0o200 != 0
+
+        # Running again has nothing left to do
+        @test Sandbox.dedup_tree(joinpath(dir, "debian"), store) == 0
+        @test Sandbox.dedup_tree(joinpath(dir, "ubuntu"), store) == 0
+        @test stat(joinpath(dir, "ubuntu", "lib", "libc.so")).inode != stat(joinpath(dir, "debian", "lib", "libc.so")).inode
+        chmod(joinpath(dir, "debian", "lib"), 0o755)
+    end
+end
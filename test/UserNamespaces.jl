@@ -12,6 +12,67 @@ if executor_available(UnprivilegedUserNamespacesExecutor)
                 @test probe_executor(exe; test_read_only_map=true, test_read_write_map=true, verbose=true)
             end
         end
+
+        @testset "persistence dir cleanup" begin
+            exe = UnprivilegedUserNamespacesExecutor()
+            # Mimic what overlayfs leaves behind: directories we can't read or write into
+            exe.persistence_dir = mktempdir()
+            locked = joinpath(exe.persistence_dir, "upper", "a", "b")
+            mkpath(locked)
+            touch(joinpath(locked, "file"))
+            chmod(locked, 0o000)
+            chmod(dirname(locked), 0o500)
+            mkpath(joinpath(exe.persistence_dir, "work", "work"))
+            chmod(joinpath(exe.persistence_dir, "work", "work"), 0o000)
+            cleanup(exe)
+            @test !ispath(exe.persistence_dir)
+        end
+
+        @testset "opaque directories" begin
+            exe = UnprivilegedUserNamespacesExecutor()
+            exe.persistence_dir = mktempdir()
+            opaque = joinpath(exe.persistence_dir, "upper", "rootfs", "etc")
+            mkpath(opaque)
+            touch(joinpath(opaque, "fresh"))
+            # Not every filesystem takes `user.*` extended attributes
+            if ccall(:setxattr, Cint, (Cstring, Cstring, Cstring, Csize_t, Cint), opaque, "user.overlay.opaque", "y", 1, 0) == 0
+                @test list_changes(exe) == [SandboxChange("/etc", :opaque), SandboxChange("/etc/fresh", :file)]
+                mktempdir() do dir
+                    extract_changes(exe, dir; whiteouts=true)
+                    @test isfile(joinpath(dir, "etc", ".wh..wh..opq"))
+                    @test isfile(joinpath(dir, "etc", "fresh"))
+                end
+            end
+            cleanup(exe)
+        end
+
+        @testset "resource limits" begin
+            if Sandbox.sandbox_supports("--cgroup")
+                with_executor(UnprivilegedUserNamespacesExecutor) do exe
+                    config = SandboxConfig(Dict("/" => Sandbox.debian_rootfs()); memory=512*1024^2)
+                    @test_throws ArgumentError Sandbox.build_executor_command(exe, config, `/bin/true`)
+                end
+
+                # Actually applying limits needs a cgroup v2 delegated to us, which CI has to provide
+                cgroup = get(ENV, "SANDBOX_TEST_CGROUP", nothing)
+                if cgroup !== nothing
+                    # The sandbox runs in a fresh child of `cgroup`, so read its limit while it is still around
+                    memory_max = Ref{String}("")
+                    on_line = LineCallback() do line
+                        if startswith(line, "0::")
+                            memory_max[] = strip(read(joinpath("/sys/fs/cgroup", lstrip(line[4:end], '/'), "memory.max"), String))
+                        end
+                    end
+                    config = SandboxConfig(Dict("/" => Sandbox.debian_rootfs()); cgroup, memory=512*1024^2, stdout=on_line)
+                    with_executor(UnprivilegedUserNamespacesExecutor) do exe
+                        @test success(exe, config, `/bin/sh -c "cat /proc/self/cgroup; sleep 1"`)
+                    end
+                    @test memory_max[] == string(512*1024^2)
+                else
+                    @test_skip false
+                end
+            end
+        end
     end
 else
     @error("Skipping Unprivileged tests, as it does not seem to be available")
@@ -34,6 +34,8 @@ if UserNSSandbox_jll.is_available()
 end
 
 include("SandboxConfig.jl")
+include("Seccomp.jl")
+include("ShardStore.jl")
 include("UserNamespaces.jl")
 include("Docker.jl")
 include("Sandbox.jl")